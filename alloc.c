@@ -0,0 +1,196 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc.h"
+
+/**
+ * Each block is preceded by a header recording its size, for the byte
+ * counters, and its offset from the start of the underlying allocation,
+ * which is only non-zero for parse_aligned_alloc. The header is as large as
+ * the strictest fundamental alignment, so blocks stay suitably aligned for
+ * any type.
+ */
+
+union alloc_header {
+  struct {
+    size_t size;
+    size_t offset;
+  } block;
+  long double ld;
+  long long ll;
+  void *p;
+};
+
+#define HEADER sizeof(union alloc_header)
+
+static void *
+default_malloc(void *ctx, size_t size)
+{
+  (void)ctx;
+  return malloc(size);
+}
+
+static void *
+default_realloc(void *ctx, void *p, size_t size)
+{
+  (void)ctx;
+  return realloc(p, size);
+}
+
+static void
+default_free(void *ctx, void *p)
+{
+  (void)ctx;
+  free(p);
+}
+
+static const struct parse_allocator default_allocator = {
+  default_malloc, default_realloc, default_free, NULL,
+};
+
+static struct parse_allocator allocator = {
+  default_malloc, default_realloc, default_free, NULL,
+};
+
+static struct parse_alloc_stats stats;
+
+void
+parse_set_allocator(const struct parse_allocator *a)
+{
+  allocator = a ? *a : default_allocator;
+}
+
+void
+parse_alloc_stats(struct parse_alloc_stats *out)
+{
+  out->allocations = __atomic_load_n(&stats.allocations, __ATOMIC_RELAXED);
+  out->frees = __atomic_load_n(&stats.frees, __ATOMIC_RELAXED);
+  out->bytes = __atomic_load_n(&stats.bytes, __ATOMIC_RELAXED);
+  out->live_bytes = __atomic_load_n(&stats.live_bytes, __ATOMIC_RELAXED);
+  out->peak_bytes = __atomic_load_n(&stats.peak_bytes, __ATOMIC_RELAXED);
+}
+
+void
+parse_alloc_stats_reset()
+{
+  __atomic_store_n(&stats.allocations, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&stats.frees, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&stats.bytes, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&stats.peak_bytes,
+                   __atomic_load_n(&stats.live_bytes, __ATOMIC_RELAXED),
+                   __ATOMIC_RELAXED);
+}
+
+static void
+count_alloc(size_t size)
+{
+  __atomic_fetch_add(&stats.allocations, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&stats.bytes, size, __ATOMIC_RELAXED);
+  uint64_t live = __atomic_add_fetch(&stats.live_bytes, size,
+                                     __ATOMIC_RELAXED);
+  uint64_t peak = __atomic_load_n(&stats.peak_bytes, __ATOMIC_RELAXED);
+  while (live > peak &&
+         !__atomic_compare_exchange_n(&stats.peak_bytes, &peak, live, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+static void
+count_free(size_t size)
+{
+  __atomic_fetch_add(&stats.frees, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_sub(&stats.live_bytes, size, __ATOMIC_RELAXED);
+}
+
+static union alloc_header *
+header_of(void *p)
+{
+  return (union alloc_header *)p - 1;
+}
+
+void *
+parse_malloc(size_t size)
+{
+  union alloc_header *h = allocator.malloc(allocator.ctx, HEADER + size);
+  if (h == NULL) {
+    return NULL;
+  }
+  h->block.size = size;
+  h->block.offset = 0;
+  count_alloc(size);
+  return h + 1;
+}
+
+void *
+parse_calloc(size_t n, size_t size)
+{
+  if (size && n > SIZE_MAX / size) {
+    return NULL;
+  }
+  void *p = parse_malloc(n * size);
+  if (p) {
+    memset(p, 0, n * size);
+  }
+  return p;
+}
+
+void *
+parse_realloc(void *p, size_t size)
+{
+  if (p == NULL) {
+    return parse_malloc(size);
+  }
+  union alloc_header *h = header_of(p);
+  size_t old = h->block.size;
+  h = allocator.realloc(allocator.ctx, h, HEADER + size);
+  if (h == NULL) {
+    return NULL;
+  }
+  h->block.size = size;
+  __atomic_fetch_sub(&stats.live_bytes, old, __ATOMIC_RELAXED);
+  count_alloc(size);
+  return h + 1;
+}
+
+void *
+parse_aligned_alloc(size_t alignment, size_t size)
+{
+  if (alignment <= HEADER) {
+    return parse_malloc(size);
+  }
+  char *raw = allocator.malloc(allocator.ctx, HEADER + alignment + size);
+  if (raw == NULL) {
+    return NULL;
+  }
+  uintptr_t start = (uintptr_t)(raw + HEADER);
+  char *p = raw + HEADER + (alignment - start % alignment) % alignment;
+  union alloc_header *h = header_of(p);
+  h->block.size = size;
+  h->block.offset = (char *)h - raw;
+  count_alloc(size);
+  return p;
+}
+
+char *
+parse_strdup(const char *s)
+{
+  size_t len = strlen(s) + 1;
+  char *copy = parse_malloc(len);
+  if (copy) {
+    memcpy(copy, s, len);
+  }
+  return copy;
+}
+
+void
+parse_free(void *p)
+{
+  if (p == NULL) {
+    return;
+  }
+  union alloc_header *h = header_of(p);
+  count_free(h->block.size);
+  allocator.free(allocator.ctx, (char *)h - h->block.offset);
+}
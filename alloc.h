@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Every allocation the library makes goes through one process-wide
+ * allocator, which defaults to malloc, realloc and free. Replace it with
+ * parse_set_allocator before creating any parser, context or other library
+ * object, or after freeing all of them: memory must be freed by the
+ * allocator that allocated it. ctx is passed back to every call, for
+ * allocators with arenas or pools. The functions may be called from any
+ * thread that runs the library.
+ */
+struct parse_allocator {
+  void *(*malloc)(void *ctx, size_t size);
+  void *(*realloc)(void *ctx, void *p, size_t size);
+  void (*free)(void *ctx, void *p);
+  void *ctx;
+};
+
+/**
+ * Install allocator, or restore the default with NULL. The allocator is
+ * copied.
+ */
+void
+parse_set_allocator(const struct parse_allocator *allocator);
+
+/**
+ * Counters kept over every allocation the library makes, whatever the
+ * allocator. allocations counts calls that returned new memory (including
+ * reallocations), bytes the total requested by them, live_bytes the bytes
+ * currently allocated and peak_bytes the largest live_bytes has been.
+ */
+struct parse_alloc_stats {
+  uint64_t allocations;
+  uint64_t frees;
+  uint64_t bytes;
+  uint64_t live_bytes;
+  uint64_t peak_bytes;
+};
+
+void
+parse_alloc_stats(struct parse_alloc_stats *out);
+
+/**
+ * Zero the cumulative counters and start measuring the peak from the bytes
+ * now live.
+ */
+void
+parse_alloc_stats_reset();
+
+/**
+ * The library's own allocation functions, with the semantics of their
+ * standard counterparts. Memory from them must be released with parse_free,
+ * and memory from parse_aligned_alloc cannot be passed to parse_realloc.
+ */
+void *parse_malloc(size_t size);
+void *parse_calloc(size_t n, size_t size);
+void *parse_realloc(void *p, size_t size);
+void *parse_aligned_alloc(size_t alignment, size_t size);
+char *parse_strdup(const char *s);
+void parse_free(void *p);
+
+#ifdef __cplusplus
+}
+#endif
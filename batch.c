@@ -0,0 +1,211 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "parser/parser_internal.h"
+#include "batch.h"
+#include "context.h"
+#include "parse.h"
+#include "state.h"
+
+/**
+ * Batch runner. Inputs are split evenly between workers up front; each
+ * worker pops from the front of its own range and, once empty, steals the
+ * back half of another worker's range. A range is packed into one 64 bit word
+ * (next in the low half, end in the high half) so that both the pop and the
+ * steal are a single compare-and-swap.
+ *
+ * Grammars are never written to while running (every run function takes a
+ * const struct parser *) so one grammar can be shared by all workers. Each
+ * worker owns its parse context, and exe() handlers run on the worker that
+ * parsed the record.
+ */
+
+#define BATCH_WINDOW UINT32_MAX
+
+struct batch_worker {
+  uint64_t range;
+  struct batch *batch;
+  struct parse_context *ctx;
+  size_t self;
+  pthread_t thread;
+  /* thread is running and must be joined */
+  bool started;
+} __attribute__((aligned(64)));
+
+struct batch {
+  batch_fn *fn;
+  void *arg;
+  size_t offset;
+  struct batch_worker *workers;
+  size_t num_workers;
+};
+
+static uint64_t
+range_pack(uint32_t next, uint32_t end)
+{
+  return (uint64_t)end << 32 | next;
+}
+
+static uint32_t
+range_next(uint64_t range)
+{
+  return (uint32_t)range;
+}
+
+static uint32_t
+range_end(uint64_t range)
+{
+  return (uint32_t)(range >> 32);
+}
+
+static bool
+batch_pop(struct batch_worker *w, size_t *i)
+{
+  uint64_t range = __atomic_load_n(&w->range, __ATOMIC_ACQUIRE);
+  while (range_next(range) < range_end(range)) {
+    uint64_t taken = range_pack(range_next(range) + 1, range_end(range));
+    if (__atomic_compare_exchange_n(&w->range, &range, taken, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      *i = range_next(range);
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool
+batch_steal(struct batch_worker *w)
+{
+  struct batch *batch = w->batch;
+  for (size_t k = 1; k < batch->num_workers; k += 1) {
+    struct batch_worker *victim =
+      &batch->workers[(w->self + k) % batch->num_workers];
+    uint64_t range = __atomic_load_n(&victim->range, __ATOMIC_ACQUIRE);
+    while (range_next(range) < range_end(range)) {
+      uint32_t next = range_next(range), end = range_end(range);
+      uint32_t mid = next + (end - next) / 2;
+      if (__atomic_compare_exchange_n(&victim->range, &range,
+                                      range_pack(next, mid), false,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&w->range, range_pack(mid, end), __ATOMIC_RELEASE);
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+static void *
+batch_work(void *arg)
+{
+  struct batch_worker *w = arg;
+  struct batch *batch = w->batch;
+  size_t i;
+  do {
+    while (batch_pop(w, &i)) {
+      batch->fn(batch->arg, w->ctx, batch->offset + i);
+    }
+  } while (batch_steal(w));
+  return NULL;
+}
+
+static void
+batch_run_window(struct batch *batch, size_t n)
+{
+  size_t per_worker = n / batch->num_workers;
+  size_t extra = n % batch->num_workers;
+  size_t start = 0;
+  for (size_t t = 0; t < batch->num_workers; t += 1) {
+    size_t len = per_worker + (t < extra ? 1 : 0);
+    batch->workers[t].range = range_pack(start, start + len);
+    start += len;
+  }
+
+  for (size_t t = 1; t < batch->num_workers; t += 1) {
+    batch->workers[t].started = pthread_create(
+        &batch->workers[t].thread, NULL, batch_work, &batch->workers[t]) == 0;
+  }
+  batch_work(&batch->workers[0]);
+  for (size_t t = 1; t < batch->num_workers; t += 1) {
+    if (batch->workers[t].started) {
+      pthread_join(batch->workers[t].thread, NULL);
+    } else {
+      // The thread could not be created: run whatever of its range the
+      // other workers have not stolen on the calling thread.
+      batch_work(&batch->workers[t]);
+    }
+  }
+}
+
+void
+batch_for_each(size_t n, size_t nthreads, batch_fn *fn, void *arg)
+{
+  if (nthreads == 0) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = online > 0 ? (size_t)online : 1;
+  }
+  if (nthreads > n) {
+    nthreads = n ? n : 1;
+  }
+
+  struct batch batch;
+  batch.fn = fn;
+  batch.arg = arg;
+  batch.num_workers = nthreads;
+  batch.workers = parse_aligned_alloc(64, nthreads *
+                                      sizeof(struct batch_worker));
+  for (size_t t = 0; t < nthreads; t += 1) {
+    batch.workers[t].batch = &batch;
+    batch.workers[t].self = t;
+    batch.workers[t].ctx = parse_context_new();
+  }
+
+  for (size_t done = 0; done < n; ) {
+    size_t window = n - done < BATCH_WINDOW ? n - done : BATCH_WINDOW;
+    batch.offset = done;
+    batch_run_window(&batch, window);
+    done += window;
+  }
+
+  for (size_t t = 0; t < nthreads; t += 1) {
+    parse_context_free(batch.workers[t].ctx);
+  }
+  parse_free(batch.workers);
+}
+
+struct run_batch {
+  const struct parser *p;
+  const struct parse_input *inputs;
+  struct parse_result *results;
+};
+
+static void
+run_batch_one(void *arg, struct parse_context *ctx, size_t i)
+{
+  struct run_batch *batch = arg;
+  const struct parse_input *in = &batch->inputs[i];
+  struct parse_result *out = &batch->results[i];
+  out->success = parse_context_run(ctx, batch->p, in->input, in->len, NULL);
+  out->consumed = ctx->state.pos;
+}
+
+size_t
+run_batch(
+    const struct parser *p,
+    const struct parse_input *inputs,
+    size_t n,
+    struct parse_result *results,
+    size_t nthreads)
+{
+  struct run_batch batch = {p, inputs, results};
+  batch_for_each(n, nthreads, run_batch_one, &batch);
+
+  size_t matched = 0;
+  for (size_t i = 0; i < n; i += 1) {
+    matched += results[i].success;
+  }
+  return matched;
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stddef.h>
+
+struct parse_context;
+
+/**
+ * Called once per item by batch_for_each, on whichever worker claimed it.
+ * ctx belongs to that worker and may be reused freely within the call.
+ */
+typedef void batch_fn(void *arg, struct parse_context *ctx, size_t i);
+
+/**
+ * Call fn for every i in [0, n) using a work-stealing pool of nthreads
+ * workers (0 means one per online CPU). Returns once every item is done.
+ */
+void batch_for_each(size_t n, size_t nthreads, batch_fn *fn, void *arg);
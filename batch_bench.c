@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "parse.h"
+#include "log.h"
+
+/**
+ * Scaling benchmark for run_batch: parses the same set of roman numeral
+ * records with 1 to N worker threads and reports throughput and speedup.
+ * Usage: batch_bench [max_threads] [records]
+ */
+
+static struct parser *
+roman_numeral_simple()
+{
+  struct parser *parse_x = many(ch('X'));
+  struct parser *parse_v = optional(ch('V'));
+  struct parser *parse_i = or(try(and(ch('I'), ch('X'))),
+                              try(and(ch('I'), ch('V'))),
+                              optional(many(ch('I'))));
+  return and(parse_x, parse_v, parse_i, eof);
+}
+
+static double
+now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+main(int argc, char **argv)
+{
+  long online = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t max_threads = argc > 1 ? strtoul(argv[1], NULL, 10) : (size_t)online;
+  size_t n = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+  const char *records[] = {"XXXVIII", "XIV", "XXIX", "VII", "XXXXXXXIX"};
+
+  struct parse_input *inputs = malloc(n * sizeof(struct parse_input));
+  struct parse_result *results = malloc(n * sizeof(struct parse_result));
+  size_t bytes = 0;
+  for (size_t i = 0; i < n; i += 1) {
+    inputs[i].input = records[i % 5];
+    inputs[i].len = strlen(records[i % 5]);
+    bytes += inputs[i].len;
+  }
+
+  struct parser *p = roman_numeral_simple();
+  double base = 0;
+  for (size_t t = 1; t <= max_threads; t += 1) {
+    double start = now();
+    size_t matched = run_batch(p, inputs, n, results, t);
+    double elapsed = now() - start;
+    if (t == 1) {
+      base = elapsed;
+    }
+    info("threads %2zu: %8.1f ns/record %8.1f MB/s speedup %.2fx (%zu/%zu matched)",
+         t, elapsed * 1e9 / n, bytes / elapsed / 1e6, base / elapsed,
+         matched, n);
+  }
+
+  parser_free(p);
+  free(inputs);
+  free(results);
+  return 0;
+}
@@ -0,0 +1,147 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "alloc.h"
+#include "bench.h"
+#include "log.h"
+
+/**
+ * Benchmark runner. Each benchmark is first run with growing n until a run
+ * takes BENCH_MIN_NS, which also warms caches and allocator free lists; it is
+ * then repeated BENCH_REPEAT times at that n and the median run is reported.
+ *
+ * Allocations are the library's own, as counted by parse_alloc_stats.
+ */
+
+#define BENCH_MIN_NS 200000000ull
+#define BENCH_MAX_N 1000000000ull
+#define BENCH_REPEAT 5
+
+static uint64_t
+now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static uint64_t
+allocs()
+{
+  struct parse_alloc_stats stats;
+  parse_alloc_stats(&stats);
+  return stats.allocations;
+}
+
+void
+bench_reset_timer(struct bench *b)
+{
+  b->elapsed = 0;
+  b->allocs = 0;
+  if (b->timing) {
+    b->start = now_ns();
+    b->start_allocs = allocs();
+  }
+}
+
+void
+bench_start_timer(struct bench *b)
+{
+  if (!b->timing) {
+    b->timing = true;
+    b->start = now_ns();
+    b->start_allocs = allocs();
+  }
+}
+
+void
+bench_stop_timer(struct bench *b)
+{
+  if (b->timing) {
+    b->elapsed += now_ns() - b->start;
+    b->allocs += allocs() - b->start_allocs;
+    b->timing = false;
+  }
+}
+
+void
+bench_set_bytes(struct bench *b, size_t bytes)
+{
+  b->bytes = bytes;
+}
+
+static void
+bench_run(bench_case_fn_t *fn, struct bench *b, size_t n)
+{
+  memset(b, 0, sizeof(struct bench));
+  b->n = n;
+  bench_start_timer(b);
+  fn(b);
+  bench_stop_timer(b);
+}
+
+static int
+compare_elapsed(const void *a, const void *b)
+{
+  uint64_t x = ((const struct bench *)a)->elapsed;
+  uint64_t y = ((const struct bench *)b)->elapsed;
+  return (x > y) - (x < y);
+}
+
+static bool
+bench_should_run(char *name, char **valid_names, size_t num_valid_names)
+{
+  for (size_t i = 0; i < num_valid_names; i += 1) {
+    if (strcmp(name, valid_names[i]) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+int
+main(int argc, char **argv)
+{
+  for (size_t i = 0; i < num_benches(); i++) {
+    get_bench_fn(fn, i);
+    get_bench_name(name, i);
+    if (argc > 1 && !bench_should_run(*name, &argv[1], argc - 1)) {
+      continue;
+    }
+
+    // Grow n towards BENCH_MIN_NS, predicting from the last run but never
+    // more than a hundredfold at once.
+    struct bench b;
+    size_t n = 1;
+    bench_run(fn, &b, n);
+    while (b.elapsed < BENCH_MIN_NS && n < BENCH_MAX_N) {
+      uint64_t per_op = b.elapsed / n + 1;
+      uint64_t next = BENCH_MIN_NS * 6 / 5 / per_op;
+      if (next > 100 * n) {
+        next = 100 * n;
+      }
+      n = next > n ? next : n + 1;
+      bench_run(fn, &b, n);
+    }
+
+    struct bench runs[BENCH_REPEAT];
+    for (size_t r = 0; r < BENCH_REPEAT; r += 1) {
+      bench_run(fn, &runs[r], n);
+    }
+    qsort(runs, BENCH_REPEAT, sizeof(struct bench), compare_elapsed);
+    struct bench *median = &runs[BENCH_REPEAT / 2];
+
+    double ns = (double)median->elapsed / n;
+    if (median->bytes) {
+      info("%-24s %10zu %12.1f ns/op %10.2f MB/s %10.2f allocs/op",
+           *name, n, ns, median->bytes * 1e3 / ns,
+           (double)median->allocs / n);
+    } else {
+      info("%-24s %10zu %12.1f ns/op %10s      %10.2f allocs/op",
+           *name, n, ns, "-", (double)median->allocs / n);
+    }
+  }
+  return 0;
+}
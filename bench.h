@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "linker_set.h"
+
+/**
+ * Benchmarks register themselves the same way as tests (see test.h). A
+ * benchmark runs the operation it measures b->n times; the runner picks n so
+ * that a run takes long enough to time, and reports the time, throughput and
+ * allocations per operation. Set-up that should not be measured goes before
+ * bench_reset_timer, or between bench_stop_timer and bench_start_timer.
+ *
+ *   new_bench(bench_thing)
+ *   {
+ *     char *input = make_input();
+ *     bench_set_bytes(b, strlen(input));
+ *     bench_reset_timer(b);
+ *     for (size_t i = 0; i < b->n; i += 1) {
+ *       parse_thing(input);
+ *     }
+ *     free(input);
+ *   }
+ */
+struct bench {
+  /* Number of operations to run */
+  size_t n;
+  /* Input bytes per operation, for MB/s; 0 if not meaningful */
+  size_t bytes;
+  bool timing;
+  uint64_t start;
+  uint64_t elapsed;
+  uint64_t start_allocs;
+  uint64_t allocs;
+};
+
+typedef void (bench_case_fn_t)(struct bench *);
+typedef char *bench_case_name_t;
+
+LINKERSET_DECLARE(bench_case_fn);
+LINKERSET_DECLARE(bench_case_name);
+
+#define declare_bench(name)                                     \
+  void name(struct bench *);                                    \
+  LINKERSET_ADD_ITEM(bench_case_fn, name);                      \
+  const char *bench_case_##name##_str = #name;                  \
+  LINKERSET_ADD_ITEM(bench_case_name, bench_case_##name##_str)
+
+#define define_bench(name)                      \
+  void name(struct bench *b)
+
+#define new_bench(name)                         \
+  declare_bench(name);                          \
+  define_bench(name)
+
+#define num_benches() LINKERSET_SIZE(bench_case_fn, size_t)
+#define get_bench_fn(fn, i) LINKERSET_GET(bench_case_fn, fn, i)
+#define get_bench_name(name, i) LINKERSET_GET(bench_case_name, name, i)
+
+/**
+ * Discard the time and allocations counted so far.
+ */
+void bench_reset_timer(struct bench *b);
+
+void bench_start_timer(struct bench *b);
+
+void bench_stop_timer(struct bench *b);
+
+void bench_set_bytes(struct bench *b, size_t bytes);
@@ -0,0 +1,266 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "parser/parser_internal.h"
+#include "cache.h"
+#include "context.h"
+#include "state.h"
+
+/**
+ * Entries live in a fixed array that the CLOCK hand sweeps, and are found
+ * through a chained hash table of entry indices (plus one, so that 0 ends a
+ * chain). Every entry owns a single allocation holding its input, output,
+ * handlers and handler strings.
+ */
+
+struct cache_entry {
+  const struct parser *p;
+  uint64_t id;
+  uint64_t hash;
+  size_t next;
+  bool used;
+  bool referenced;
+  bool matched;
+  size_t pos;
+  size_t len;
+  size_t output_len;
+  size_t num_handlers;
+  size_t strings_len;
+  /* input, then output, then handlers, then strings */
+  char *data;
+};
+
+struct parse_cache {
+  pthread_mutex_t lock;
+  struct cache_entry *entries;
+  size_t cap;
+  size_t *buckets;
+  size_t num_buckets;
+  size_t hand;
+  size_t max_input;
+  struct parse_cache_stats stats;
+};
+
+struct parse_cache *
+parse_cache_new(size_t capacity, size_t max_input)
+{
+  struct parse_cache *cache = parse_malloc(sizeof(struct parse_cache));
+  pthread_mutex_init(&cache->lock, NULL);
+  cache->cap = capacity ? capacity : 1;
+  cache->entries = parse_calloc(cache->cap, sizeof(struct cache_entry));
+  cache->num_buckets = 1;
+  while (cache->num_buckets < cache->cap) {
+    cache->num_buckets *= 2;
+  }
+  cache->buckets = parse_calloc(cache->num_buckets, sizeof(size_t));
+  cache->hand = 0;
+  cache->max_input = max_input;
+  memset(&cache->stats, 0, sizeof(struct parse_cache_stats));
+  return cache;
+}
+
+void
+parse_cache_free(struct parse_cache *cache)
+{
+  for (size_t i = 0; i < cache->cap; i += 1) {
+    parse_free(cache->entries[i].data);
+  }
+  parse_free(cache->entries);
+  parse_free(cache->buckets);
+  pthread_mutex_destroy(&cache->lock);
+  parse_free(cache);
+}
+
+void
+parse_context_set_cache(struct parse_context *ctx, struct parse_cache *cache)
+{
+  ctx->cache = cache;
+}
+
+void
+parse_cache_stats(struct parse_cache *cache, struct parse_cache_stats *out)
+{
+  pthread_mutex_lock(&cache->lock);
+  *out = cache->stats;
+  pthread_mutex_unlock(&cache->lock);
+}
+
+/**
+ * Where an entry's handlers start in its data, rounded up to keep them
+ * aligned.
+ */
+static size_t
+handlers_offset(size_t len, size_t output_len)
+{
+  size_t at = len + output_len;
+  return at + -at % sizeof(void *);
+}
+
+static uint64_t
+cache_hash(const struct parser *p, const char *input, size_t len)
+{
+  // FNV-1a over the input, seeded with the grammar's address and id.
+  uint64_t h = 0xcbf29ce484222325ull ^ (uintptr_t)p ^ p->id << 32;
+  for (size_t i = 0; i < len; i += 1) {
+    h = (h ^ (unsigned char)input[i]) * 0x100000001b3ull;
+  }
+  return h;
+}
+
+static size_t *
+cache_bucket(struct parse_cache *cache, uint64_t hash)
+{
+  return &cache->buckets[hash & (cache->num_buckets - 1)];
+}
+
+static struct cache_entry *
+cache_find(struct parse_cache *cache, const struct parser *p, uint64_t hash,
+           const char *input, size_t len)
+{
+  for (size_t i = *cache_bucket(cache, hash); i != 0;
+       i = cache->entries[i - 1].next) {
+    struct cache_entry *e = &cache->entries[i - 1];
+    if (e->hash == hash && e->p == p && e->id == p->id && e->len == len &&
+        memcmp(e->data, input, len) == 0) {
+      return e;
+    }
+  }
+  return NULL;
+}
+
+bool
+cache_lookup(
+    struct parse_cache *cache,
+    const struct parser *p,
+    struct parse_state *state,
+    bool *matched)
+{
+  if (state->input_len > cache->max_input) {
+    return false;
+  }
+  uint64_t hash = cache_hash(p, state->input, state->input_len);
+  pthread_mutex_lock(&cache->lock);
+  struct cache_entry *e = cache_find(cache, p, hash, state->input,
+                                     state->input_len);
+  if (e == NULL) {
+    cache->stats.misses += 1;
+    pthread_mutex_unlock(&cache->lock);
+    return false;
+  }
+  cache->stats.hits += 1;
+  e->referenced = true;
+  *matched = e->matched;
+  if (e->matched) {
+    const char *output = e->data + e->len;
+    const struct parse_handler *handlers = (const struct parse_handler *)
+      (e->data + handlers_offset(e->len, e->output_len));
+    const char *strings = (const char *)(handlers + e->num_handlers);
+    state->pos = e->pos;
+    state_output_append_n(state, output, e->output_len);
+    state_append_handlers(state, handlers, e->num_handlers, strings,
+                          e->strings_len);
+  }
+  pthread_mutex_unlock(&cache->lock);
+  return true;
+}
+
+/**
+ * Unlink entry i from its hash chain.
+ */
+static void
+cache_unlink(struct parse_cache *cache, size_t i)
+{
+  size_t *link = cache_bucket(cache, cache->entries[i].hash);
+  while (*link != i + 1) {
+    link = &cache->entries[*link - 1].next;
+  }
+  *link = cache->entries[i].next;
+}
+
+/**
+ * Advance the hand to an unused or unreferenced entry, clearing reference
+ * bits on the way, and free it.
+ */
+static struct cache_entry *
+cache_evict(struct parse_cache *cache)
+{
+  for (;;) {
+    size_t i = cache->hand;
+    struct cache_entry *e = &cache->entries[i];
+    cache->hand = (i + 1) % cache->cap;
+    if (!e->used) {
+      cache->stats.entries += 1;
+      return e;
+    }
+    if (e->referenced) {
+      e->referenced = false;
+      continue;
+    }
+    cache_unlink(cache, i);
+    parse_free(e->data);
+    cache->stats.evictions += 1;
+    return e;
+  }
+}
+
+void
+cache_insert(
+    struct parse_cache *cache,
+    const struct parser *p,
+    const struct parse_state *state,
+    bool matched)
+{
+  size_t len = state->input_len;
+  if (len > cache->max_input || state->eager || state->commits > 0) {
+    return;
+  }
+  size_t output_len = matched ? state->output_len : 0;
+  size_t num_handlers = matched ? state->num_outputs : 0;
+  size_t strings_len = matched ? state->strings_len : 0;
+  size_t handlers_at = handlers_offset(len, output_len);
+  size_t strings_at = handlers_at +
+    num_handlers * sizeof(struct parse_handler);
+
+  char *data = parse_malloc(strings_at + strings_len);
+  memcpy(data, state->input, len);
+  if (output_len) {
+    memcpy(data + len, state->output, output_len);
+  }
+  if (num_handlers) {
+    memcpy(data + handlers_at, state->handlers,
+           num_handlers * sizeof(struct parse_handler));
+  }
+  if (strings_len) {
+    memcpy(data + strings_at, state->strings, strings_len);
+  }
+
+  uint64_t hash = cache_hash(p, state->input, len);
+  pthread_mutex_lock(&cache->lock);
+  if (cache_find(cache, p, hash, state->input, len) != NULL) {
+    // Another thread got there first.
+    pthread_mutex_unlock(&cache->lock);
+    parse_free(data);
+    return;
+  }
+  struct cache_entry *e = cache_evict(cache);
+  size_t *bucket = cache_bucket(cache, hash);
+  *e = (struct cache_entry){
+    .p = p,
+    .id = p->id,
+    .hash = hash,
+    .next = *bucket,
+    .used = true,
+    .referenced = false,
+    .matched = matched,
+    .pos = state->pos,
+    .len = len,
+    .output_len = output_len,
+    .num_handlers = num_handlers,
+    .strings_len = strings_len,
+    .data = data,
+  };
+  *bucket = e - cache->entries + 1;
+  pthread_mutex_unlock(&cache->lock);
+}
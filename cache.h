@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct parser;
+struct parse_context;
+
+/**
+ * A bounded cache of run results, for streams that repeat the same inputs.
+ * Entries are keyed on the grammar and the exact input, and hold whether it
+ * matched, the output and the handler log; a hit replays the logged handlers
+ * without parsing. When full, CLOCK evicts an entry that has not been hit
+ * since the hand last passed it. The entries of a grammar that has been
+ * freed are never hit again, even by a new grammar at the same address;
+ * they are left for eviction.
+ *
+ * Only runs whose handlers all run at the end are cached: runs with eager
+ * handlers or that passed a cut() outside any try() are not, since their
+ * handlers ran mid-parse. A cache may be shared by contexts on any number of
+ * threads; handlers are not run under its lock.
+ */
+struct parse_cache;
+
+struct parse_cache_stats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  size_t entries;
+};
+
+/**
+ * A cache of up to capacity entries, skipping inputs longer than max_input
+ * bytes.
+ */
+struct parse_cache *
+parse_cache_new(size_t capacity, size_t max_input);
+
+void
+parse_cache_free(struct parse_cache *cache);
+
+/**
+ * Attach cache to ctx, or detach with NULL.
+ */
+void
+parse_context_set_cache(struct parse_context *ctx, struct parse_cache *cache);
+
+void
+parse_cache_stats(struct parse_cache *cache, struct parse_cache_stats *out);
+
+#ifdef __cplusplus
+}
+#endif
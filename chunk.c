@@ -0,0 +1,158 @@
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "parser/parser_internal.h"
+#include "batch.h"
+#include "parse.h"
+#include "state.h"
+
+/**
+ * Chunked parsing of separator-delimited input. The input is cut into
+ * roughly equal chunks, each ending just after a separator, and every chunk
+ * is parsed with the full grammar on the worker pool. Handlers are not run
+ * by the workers: each chunk keeps its own handler log, and once every chunk
+ * has matched the logs are executed in chunk order, so handlers see records
+ * in input order exactly as a single run() would.
+ */
+
+#define CHUNKS_PER_THREAD 4
+#define CHUNK_MIN_SIZE (64 * 1024)
+
+struct chunked {
+  const struct parser *p;
+  const char *input;
+  size_t *starts;
+  struct parse_state *states;
+  bool *success;
+};
+
+/**
+ * Split input into at most max_chunks chunks. There is always at least one
+ * chunk, so that empty input is parsed as well.
+ */
+static size_t
+chunk_split(const char *input, size_t len, char sep, size_t max_chunks,
+            size_t *starts)
+{
+  size_t n = 0, start = 0;
+  for (size_t k = 1; k <= max_chunks && (start < len || n == 0); k += 1) {
+    size_t end = k == max_chunks ? len : len / max_chunks * k;
+    if (end < start) {
+      end = start;
+    }
+    const char *found = memchr(input + end, sep, len - end);
+    end = found ? (size_t)(found - input) + 1 : len;
+    starts[n++] = start;
+    start = end;
+  }
+  starts[n] = len;
+  return n;
+}
+
+static void
+chunk_run(void *arg, struct parse_context *ctx, size_t i)
+{
+  (void)ctx;
+  struct chunked *c = arg;
+  size_t start = c->starts[i];
+  state_create_len(&c->states[i], c->input + start, c->starts[i + 1] - start);
+  // Handlers may only run once every chunk has matched, so a cut() must not
+  // commit anything here.
+  c->states[i].backtrack_depth = 1;
+  c->success[i] = parser_run(c->p, &c->states[i]);
+}
+
+bool
+run_chunked(
+    const struct parser *p,
+    const char *input,
+    size_t len,
+    char sep,
+    size_t nthreads,
+    struct parse_result *result)
+{
+  if (nthreads == 0) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = online > 0 ? (size_t)online : 1;
+  }
+  size_t max_chunks = nthreads * CHUNKS_PER_THREAD;
+  if (len / max_chunks < CHUNK_MIN_SIZE) {
+    max_chunks = len / CHUNK_MIN_SIZE + 1;
+  }
+
+  struct chunked c;
+  c.p = p;
+  c.input = input;
+  c.starts = parse_malloc((max_chunks + 1) * sizeof(size_t));
+  size_t n = chunk_split(input, len, sep, max_chunks, c.starts);
+  c.states = parse_malloc(n * sizeof(struct parse_state));
+  c.success = parse_malloc(n * sizeof(bool));
+
+  batch_for_each(n, nthreads, chunk_run, &c);
+
+  size_t failed = n;
+  for (size_t i = 0; i < n && failed == n; i += 1) {
+    if (!c.success[i]) {
+      failed = i;
+    }
+  }
+  if (failed == n) {
+    for (size_t i = 0; i < n; i += 1) {
+      state_execute(&c.states[i]);
+    }
+  }
+  if (result) {
+    result->success = failed == n;
+    result->consumed = failed == n ? len : c.starts[failed] + c.states[failed].pos;
+  }
+
+  for (size_t i = 0; i < n; i += 1) {
+    state_destroy(&c.states[i]);
+  }
+  parse_free(c.states);
+  parse_free(c.success);
+  parse_free(c.starts);
+  return failed == n;
+}
+
+bool
+run_chunked_file(
+    const struct parser *p,
+    const char *path,
+    char sep,
+    size_t nthreads,
+    struct parse_result *result)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return false;
+  }
+  size_t len = st.st_size;
+  const char *input = "";
+  void *map = NULL;
+  if (len > 0) {
+    map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      close(fd);
+      return false;
+    }
+    input = map;
+  }
+  close(fd);
+
+  bool success = run_chunked(p, input, len, sep, nthreads, result);
+  if (map) {
+    munmap(map, len);
+  }
+  return success;
+}
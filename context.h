@@ -0,0 +1,17 @@
+#pragma once
+
+#include "parse.h"
+#include "parser/engine.h"
+#include "state.h"
+
+/**
+ * A parse context owns a parse_state and an engine stack whose buffers
+ * outlive a single run. Contexts are not thread safe; keep one per thread.
+ */
+struct parse_context {
+  struct parse_state state;
+  struct engine engine;
+  enum parse_engine mode;
+  struct parse_perf *perf;
+  struct parse_cache *cache;
+};
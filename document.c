@@ -0,0 +1,304 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "parser/parser_internal.h"
+#include "context.h"
+#include "document.h"
+#include "state.h"
+
+/**
+ * The memo table is an array of entries found through a chained hash table
+ * of entry indices (plus one, so that 0 ends a chain), keyed on node and
+ * start position. Entries match on the node's id as well as its address,
+ * so a node allocated where a freed one was does not see its entries. Every
+ * entry owns a single allocation holding the output,
+ * handlers and handler strings its node added. An edit compacts the array
+ * in place and rebuilds the chains, since the entries after the edit have
+ * moved.
+ */
+
+struct memo_entry {
+  const struct parser *p;
+  uint64_t id;
+  size_t start;
+  size_t end;
+  /* One past the furthest input position the node looked at */
+  size_t examined;
+  /* cut() nodes passed that no try() inside the node absorbed */
+  size_t cuts;
+  size_t next;
+  bool matched;
+  size_t output_len;
+  size_t num_handlers;
+  size_t strings_len;
+  /* output, then handlers, then strings */
+  char *data;
+};
+
+struct parse_document {
+  char *text;
+  size_t len;
+  size_t cap;
+  struct memo_entry *entries;
+  size_t num_entries;
+  size_t entries_cap;
+  size_t *buckets;
+  size_t num_buckets;
+  struct parse_document_stats stats;
+};
+
+struct parse_document *
+parse_document_new(const char *input, size_t len)
+{
+  struct parse_document *doc = parse_calloc(1, sizeof(struct parse_document));
+  doc->cap = len + 1;
+  doc->text = parse_malloc(doc->cap);
+  memcpy(doc->text, input, len);
+  doc->text[len] = '\0';
+  doc->len = len;
+  doc->num_buckets = 64;
+  doc->buckets = parse_calloc(doc->num_buckets, sizeof(size_t));
+  return doc;
+}
+
+void
+parse_document_free(struct parse_document *doc)
+{
+  for (size_t i = 0; i < doc->num_entries; i += 1) {
+    parse_free(doc->entries[i].data);
+  }
+  parse_free(doc->entries);
+  parse_free(doc->buckets);
+  parse_free(doc->text);
+  parse_free(doc);
+}
+
+const char *
+parse_document_text(const struct parse_document *doc, size_t *len)
+{
+  if (len) {
+    *len = doc->len;
+  }
+  return doc->text;
+}
+
+void
+parse_document_stats(
+    const struct parse_document *doc,
+    struct parse_document_stats *out)
+{
+  *out = doc->stats;
+  out->entries = doc->num_entries;
+}
+
+static size_t *
+memo_bucket(struct parse_document *doc, const struct parser *p, size_t start)
+{
+  uint64_t h = ((uintptr_t)p ^ start) * 0x9e3779b97f4a7c15ull;
+  return &doc->buckets[(h >> 32) & (doc->num_buckets - 1)];
+}
+
+static void
+memo_rehash(struct parse_document *doc)
+{
+  memset(doc->buckets, 0, doc->num_buckets * sizeof(size_t));
+  for (size_t i = 0; i < doc->num_entries; i += 1) {
+    struct memo_entry *e = &doc->entries[i];
+    size_t *bucket = memo_bucket(doc, e->p, e->start);
+    e->next = *bucket;
+    *bucket = i + 1;
+  }
+}
+
+/**
+ * Where an entry's handlers start in its data, rounded up to keep them
+ * aligned.
+ */
+static size_t
+handlers_offset(size_t output_len)
+{
+  return output_len + -output_len % sizeof(void *);
+}
+
+bool
+memo_lookup(
+    struct parse_document *doc,
+    const struct parser *p,
+    struct parse_state *state,
+    bool *matched)
+{
+  const struct memo_entry *e = NULL;
+  for (size_t i = *memo_bucket(doc, p, state->pos); i != 0;
+       i = doc->entries[i - 1].next) {
+    const struct memo_entry *entry = &doc->entries[i - 1];
+    if (entry->p == p && entry->id == p->id && entry->start == state->pos) {
+      e = entry;
+      break;
+    }
+  }
+  // A cut() recorded inside a try() would have committed here.
+  if (e == NULL || (e->cuts > 0 && state->backtrack_depth == 0)) {
+    doc->stats.misses += 1;
+    return false;
+  }
+  doc->stats.hits += 1;
+
+  const struct parse_handler *handlers = (const struct parse_handler *)
+    (e->data + handlers_offset(e->output_len));
+  const char *strings = (const char *)(handlers + e->num_handlers);
+  state->pos = e->end;
+  state_output_append_n(state, e->data, e->output_len);
+  state_append_handlers(state, handlers, e->num_handlers, strings,
+                        e->strings_len);
+  state->cuts += e->cuts;
+  if (e->examined > state->examined) {
+    state->examined = e->examined;
+  }
+  *matched = e->matched;
+  return true;
+}
+
+void
+memo_begin(struct parse_state *state, struct memo_frame *frame)
+{
+  state_checkpoint(state, &frame->cp);
+  frame->examined = state->examined;
+  frame->cuts = state->cuts;
+  frame->commits = state->commits;
+  state->examined = state->pos;
+}
+
+static void
+memo_record(
+    struct parse_document *doc,
+    const struct parser *p,
+    const struct parse_state *state,
+    const struct memo_frame *frame,
+    bool matched)
+{
+  const struct parse_checkpoint *cp = &frame->cp;
+  size_t output_len = state->output_len - cp->output_len;
+  size_t num_handlers = state->num_outputs - cp->num_outputs;
+  size_t strings_len = state->strings_len - cp->strings_len;
+  size_t handlers_at = handlers_offset(output_len);
+  size_t strings_at = handlers_at +
+    num_handlers * sizeof(struct parse_handler);
+
+  char *data = parse_malloc(strings_at + strings_len);
+  if (output_len) {
+    memcpy(data, state->output + cp->output_len, output_len);
+  }
+  struct parse_handler *handlers = (struct parse_handler *)(data + handlers_at);
+  for (size_t i = 0; i < num_handlers; i += 1) {
+    handlers[i] = state->handlers[cp->num_outputs + i];
+    handlers[i].string -= cp->strings_len;
+  }
+  if (strings_len) {
+    memcpy(data + strings_at, state->strings + cp->strings_len, strings_len);
+  }
+
+  if (doc->num_entries == doc->entries_cap) {
+    doc->entries_cap = doc->entries_cap ? doc->entries_cap * 2 : 64;
+    doc->entries = parse_realloc(
+        doc->entries, doc->entries_cap * sizeof(struct memo_entry));
+  }
+  size_t i = doc->num_entries++;
+  doc->entries[i] = (struct memo_entry){
+    .p = p,
+    .id = p->id,
+    .start = cp->pos,
+    .end = state->pos,
+    .examined = state->examined,
+    .cuts = state->cuts - frame->cuts,
+    .matched = matched,
+    .output_len = output_len,
+    .num_handlers = num_handlers,
+    .strings_len = strings_len,
+    .data = data,
+  };
+  if (doc->num_entries > doc->num_buckets) {
+    doc->num_buckets *= 2;
+    doc->buckets = parse_realloc(doc->buckets,
+                                 doc->num_buckets * sizeof(size_t));
+    memo_rehash(doc);
+  } else {
+    size_t *bucket = memo_bucket(doc, p, cp->pos);
+    doc->entries[i].next = *bucket;
+    *bucket = i + 1;
+  }
+}
+
+void
+memo_end(
+    struct parse_state *state,
+    const struct parser *p,
+    const struct memo_frame *frame,
+    bool matched)
+{
+  // Handlers that already ran cannot be replayed.
+  if (state->commits == frame->commits && !state->eager) {
+    memo_record(state->document, p, state, frame, matched);
+  }
+  if (frame->examined > state->examined) {
+    state->examined = frame->examined;
+  }
+}
+
+bool
+parse_document_edit(
+    struct parse_document *doc,
+    size_t from,
+    size_t to,
+    const char *bytes,
+    size_t n)
+{
+  if (from > to || to > doc->len) {
+    return false;
+  }
+  size_t len = doc->len - (to - from) + n;
+  if (len + 1 > doc->cap) {
+    while (doc->cap < len + 1) {
+      doc->cap *= 2;
+    }
+    doc->text = parse_realloc(doc->text, doc->cap);
+  }
+  memmove(doc->text + from + n, doc->text + to, doc->len - to);
+  memcpy(doc->text + from, bytes, n);
+  doc->len = len;
+  doc->text[len] = '\0';
+
+  // Entries wholly after the edit move with their input and those that
+  // looked only at input before it stay; every other entry looked at a
+  // replaced byte.
+  size_t kept = 0;
+  for (size_t i = 0; i < doc->num_entries; i += 1) {
+    struct memo_entry *e = &doc->entries[i];
+    if (e->start >= to) {
+      e->start = e->start - (to - from) + n;
+      e->end = e->end - (to - from) + n;
+      e->examined = e->examined - (to - from) + n;
+    } else if (e->start >= from || e->examined > from) {
+      parse_free(e->data);
+      doc->stats.invalidated += 1;
+      continue;
+    }
+    doc->entries[kept++] = *e;
+  }
+  doc->num_entries = kept;
+  memo_rehash(doc);
+  return true;
+}
+
+bool
+parse_document_run(
+    struct parse_document *doc,
+    struct parse_context *ctx,
+    const struct parser *p,
+    const char **output)
+{
+  ctx->state.document = doc;
+  bool success = parse_context_run(ctx, p, doc->text, doc->len, output);
+  ctx->state.document = NULL;
+  return success;
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct parser;
+struct parse_context;
+
+/**
+ * A text that is parsed again after every small edit. The document keeps the
+ * results of the memo() nodes of the grammar between runs, keyed on the node
+ * and the position it ran at, together with how far into the input each one
+ * looked. An edit drops only the results that looked at the replaced bytes;
+ * results before it are kept as they are and those after it are moved along
+ * with their input. A run after an edit then re-parses little more than the
+ * memo() nodes that overlap it.
+ *
+ * Results are only reused where nothing but the input could have changed
+ * them: runs in eager mode and parts of a run that passed a cut() outside any
+ * try() are not recorded. Nodes of kinds other than the built-in combinators
+ * must read input through state_getc and state_finished to be memoized
+ * correctly. A document is not thread safe.
+ */
+struct parse_document;
+
+struct parse_document_stats {
+  /* memo() nodes answered from the table and run afresh */
+  uint64_t hits;
+  uint64_t misses;
+  /* Entries dropped because an edit touched input they looked at */
+  uint64_t invalidated;
+  size_t entries;
+};
+
+struct parse_document *
+parse_document_new(const char *input, size_t len);
+
+void
+parse_document_free(struct parse_document *doc);
+
+/**
+ * Replace the bytes [from, to) with the n bytes at bytes. Returns false, and
+ * leaves the document alone, if the range is not within the text.
+ */
+bool
+parse_document_edit(
+    struct parse_document *doc,
+    size_t from,
+    size_t to,
+    const char *bytes,
+    size_t n);
+
+/**
+ * The current text, which stays valid until the next edit.
+ */
+const char *
+parse_document_text(const struct parse_document *doc, size_t *len);
+
+/**
+ * parse_context_run over the current text, reusing and recording the
+ * results of p's memo() nodes.
+ */
+bool
+parse_document_run(
+    struct parse_document *doc,
+    struct parse_context *ctx,
+    const struct parser *p,
+    const char **output);
+
+void
+parse_document_stats(
+    const struct parse_document *doc,
+    struct parse_document_stats *out);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,427 @@
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "parser/parser_internal.h"
+#include "parse.h"
+#include "state.h"
+
+/**
+ * C code generation. Every node of the tree becomes one static function,
+ * named after the node's index in breadth-first order, whose body is the
+ * node's run function with its children, characters and literals filled in.
+ * exe() handlers are not known at generation time, so the generated code
+ * takes them from a binding table indexed by exe() nodes in the same
+ * breadth-first order (see parser_index); parser_exe_bindings fills such a
+ * table from a tree.
+ */
+
+size_t
+parser_exe_bindings(
+    const struct parser *p,
+    struct parser_exe_binding *bindings,
+    size_t n)
+{
+  size_t len, exes = 0;
+  struct parser_index *nodes = parser_index(p, &len);
+  for (size_t i = 0; i < len; i += 1) {
+    if (nodes[i].p->kind != PARSER_EXECUTE) {
+      continue;
+    }
+    const struct parser_execute *exe =
+      (const struct parser_execute *)nodes[i].p;
+    if (exes < n) {
+      bindings[exes].handle = exe->handle;
+      bindings[exes].extra = exe->extra;
+    }
+    exes += 1;
+  }
+  parse_free(nodes);
+  return exes;
+}
+
+static void
+emit_char(FILE *out, char c)
+{
+  if (c == '\'' || c == '\\') {
+    fprintf(out, "'\\%c'", c);
+  } else if (isprint((unsigned char)c)) {
+    fprintf(out, "'%c'", c);
+  } else {
+    fprintf(out, "'\\%03o'", (unsigned char)c);
+  }
+}
+
+static void
+emit_dfa(FILE *out, const char *name, size_t id, const struct parser_dfa *dfa)
+{
+  uint32_t width = dfa->num_classes + 1;
+
+  // Rows for the two final states are never read, so the table starts at
+  // state 2.
+  fprintf(out, "static const uint8_t %s_%zu_classes[256] = {", name, id);
+  for (size_t c = 0; c < 256; c += 1) {
+    fprintf(out, "%s%u,", c % 16 ? " " : "\n  ", dfa->classes[c]);
+  }
+  fprintf(out, "\n};\n\n");
+  fprintf(out, "static const uint32_t %s_%zu_table[] = {", name, id);
+  for (size_t s = 2; s < dfa->num_states; s += 1) {
+    fprintf(out, "\n ");
+    for (size_t c = 0; c < width; c += 1) {
+      fprintf(out, " 0x%08x,", dfa->table[s * width + c]);
+    }
+  }
+  fprintf(out, "\n};\n\n");
+
+  fprintf(out,
+          "static bool\n"
+          "%s_%zu(struct parse_state *state, const struct parser_exe_binding *exes)\n"
+          "{\n"
+          "  (void)exes;\n"
+          "  size_t start = state->pos, pos = start;\n"
+          "  uint32_t s = %u;\n"
+          "  while (s > 1) {\n"
+          "    uint32_t c = %u;\n"
+          "    if (pos < state->input_len) {\n"
+          "      c = %s_%zu_classes[(uint8_t)state->input[pos]];\n"
+          "    } else {\n"
+          "      state->starved |= state->partial;\n"
+          "    }\n"
+          "    uint32_t next = %s_%zu_table[(s - 2) * %u + c];\n"
+          "    pos += (next & 0x80000000u) != 0;\n"
+          "    s = next & ~0x80000000u;\n"
+          "  }\n"
+          "  state_output_append_n(state, state->input + start, pos - start);\n"
+          "  state->pos = pos;\n"
+          "  return s == 1;\n"
+          "}\n\n",
+          name, id, dfa->start, dfa->num_classes, name, id, name, id, width);
+}
+
+static void
+emit_node(FILE *out, const char *name, size_t id,
+          const struct parser_index *node)
+{
+  const struct parser *p = node->p;
+  size_t a = node->children[0], b = node->children[1];
+
+  if (p->kind == PARSER_DFA) {
+    emit_dfa(out, name, id, (const struct parser_dfa *)p);
+    return;
+  }
+
+  fprintf(out,
+          "static bool\n"
+          "%s_%zu(struct parse_state *state, const struct parser_exe_binding *exes)\n"
+          "{\n", name, id);
+
+  switch (p->kind) {
+  case PARSER_BLANK:
+    fprintf(out,
+            "  (void)exes;\n"
+            "  return state_success_blank(state);\n");
+    break;
+
+  case PARSER_NULL:
+    fprintf(out,
+            "  (void)state;\n"
+            "  (void)exes;\n"
+            "  return false;\n");
+    break;
+
+  case PARSER_EOF:
+    fprintf(out,
+            "  (void)exes;\n"
+            "  if (state_finished(state)) {\n"
+            "    return state_success_blank(state);\n"
+            "  }\n"
+            "  return false;\n");
+    break;
+
+  case PARSER_CHAR:
+    fprintf(out,
+            "  (void)exes;\n"
+            "  if (state->pos >= state->input_len) {\n"
+            "    state->starved |= state->partial;\n"
+            "    return false;\n"
+            "  }\n"
+            "  if (state->input[state->pos] != ");
+    emit_char(out, ((const struct parser_char *)p)->c);
+    fprintf(out, ") {\n"
+            "    return false;\n"
+            "  }\n"
+            "  return state_success(state, state->input[state->pos]);\n");
+    break;
+
+  case PARSER_TOKEN:
+    fprintf(out,
+            "  (void)exes;\n"
+            "  if (state->pos >= state->input_len) {\n"
+            "    state->starved |= state->partial;\n"
+            "    return false;\n"
+            "  }\n"
+            "  if (state->input[state->pos] != ");
+    emit_char(out, ((const struct parser_token *)p)->kind);
+    fprintf(out, ") {\n"
+            "    return false;\n"
+            "  }\n"
+            "  return state_success_token(state);\n");
+    break;
+
+  case PARSER_STR:
+    fprintf(out, "  (void)exes;\n");
+    for (const char *c = ((const struct parser_str *)p)->literal; *c; c += 1) {
+      fprintf(out,
+              "  if (state->pos >= state->input_len) {\n"
+              "    state->starved |= state->partial;\n"
+              "    return true;\n"
+              "  }\n"
+              "  if (state->input[state->pos] != ");
+      emit_char(out, *c);
+      fprintf(out, ") {\n"
+              "    return false;\n"
+              "  }\n"
+              "  state_success(state, state->input[state->pos]);\n");
+    }
+    fprintf(out, "  return true;\n");
+    break;
+
+  case PARSER_MANY:
+    fprintf(out,
+            "  state_success_blank(state);\n"
+            "  while (%s_%zu(state, exes)) {\n"
+            "  }\n"
+            "  return true;\n", name, a);
+    break;
+
+  case PARSER_OPTIONAL:
+    fprintf(out,
+            "  size_t pos = state->pos;\n"
+            "  if (!%s_%zu(state, exes) && pos != state->pos) {\n"
+            "    return false;\n"
+            "  }\n"
+            "  return state_success_blank(state);\n", name, a);
+    break;
+
+  case PARSER_TRY:
+    fprintf(out,
+            "  struct parse_checkpoint cp;\n"
+            "  size_t cuts = state->cuts;\n"
+            "  state_checkpoint(state, &cp);\n"
+            "  state->backtrack_depth += 1;\n"
+            "  bool success = %s_%zu(state, exes);\n"
+            "  state->backtrack_depth -= 1;\n"
+            "  if (!success && state->cuts == cuts) {\n"
+            "    state_restore(state, &cp);\n"
+            "  }\n"
+            "  state->cuts = cuts;\n"
+            "  return success;\n", name, a);
+    break;
+
+  case PARSER_UNTIL:
+    fprintf(out,
+            "  struct parse_checkpoint cp;\n"
+            "  size_t cuts = state->cuts;\n"
+            "  while (!state_finished(state)) {\n"
+            "    state_checkpoint(state, &cp);\n"
+            "    state->backtrack_depth += 1;\n"
+            "    bool success = %s_%zu(state, exes);\n"
+            "    state->backtrack_depth -= 1;\n"
+            "    state->cuts = cuts;\n"
+            "    state_restore(state, &cp);\n"
+            "    if (success) {\n"
+            "      return true;\n"
+            "    }\n"
+            "    state_success(state, state->input[state->pos]);\n"
+            "  }\n"
+            "  return state_success_blank(state);\n", name, a);
+    break;
+
+  case PARSER_REPEAT: {
+    const struct parser_repeat *r = (const struct parser_repeat *)p;
+    fprintf(out,
+            "  struct parse_checkpoint cp;\n"
+            "  size_t n = 0;\n"
+            "  while (n != (size_t)%zuu) {\n"
+            "    size_t cuts = state->cuts;\n"
+            "    state_checkpoint(state, &cp);\n"
+            "    state->backtrack_depth += 1;\n"
+            "    bool success = %s_%zu(state, exes);\n"
+            "    state->backtrack_depth -= 1;\n"
+            "    if (state->cuts == cuts) {\n"
+            "      if (!success) {\n"
+            "        state_restore(state, &cp);\n"
+            "        break;\n"
+            "      }\n"
+            "    } else if (!success) {\n"
+            "      return false;\n"
+            "    } else if (state->backtrack_depth == 0) {\n"
+            "      state_commit(state);\n"
+            "    }\n"
+            "    n += 1;\n"
+            "    if (state->pos == cp.pos) {\n"
+            "      return state_success_blank(state);\n"
+            "    }\n", r->max, name, a);
+    if (r->min > 1) {
+      fprintf(out,
+              "    size_t consumed = state->pos - cp.pos;\n"
+              "    if (n == 1 && %zuu <= (state->input_len - state->pos) / consumed) {\n"
+              "      state_output_reserve(state, %zuu * (state->output_len - cp.output_len));\n"
+              "    }\n", r->min - 1, r->min - 1);
+    }
+    fprintf(out, "  }\n");
+    if (r->min > 0) {
+      fprintf(out, "  return n >= %zuu && state_success_blank(state);\n",
+              r->min);
+    } else {
+      fprintf(out, "  return state_success_blank(state);\n");
+    }
+    break;
+  }
+
+  case PARSER_SEP_BY:
+    // Each step is the separator and the next item; in sep_end_by() the
+    // separator ends a step of its own.
+    fprintf(out,
+            "  struct parse_checkpoint cp;\n"
+            "  size_t start = SIZE_MAX;\n"
+            "  size_t cuts = state->cuts;\n"
+            "  state_checkpoint(state, &cp);\n"
+            "  state->backtrack_depth += 1;\n"
+            "  bool success = %s_%zu(state, exes);\n"
+            "  for (;;) {\n"
+            "    state->backtrack_depth -= 1;\n"
+            "    if (state->cuts == cuts) {\n"
+            "      if (!success) {\n"
+            "        state_restore(state, &cp);\n"
+            "      }\n"
+            "    } else if (!success) {\n"
+            "      return false;\n"
+            "    } else if (state->backtrack_depth == 0) {\n"
+            "      state_commit(state);\n"
+            "    }\n"
+            "    if (!success || state->pos == start) {\n"
+            "      return state_success_blank(state);\n"
+            "    }\n"
+            "    start = state->pos;\n"
+            "    cuts = state->cuts;\n"
+            "    state_checkpoint(state, &cp);\n"
+            "    state->backtrack_depth += 1;\n"
+            "    success = %s_%zu(state, exes);\n",
+            name, a, name, b);
+    if (((const struct parser_sep_by *)p)->end) {
+      fprintf(out,
+              "    if (success) {\n"
+              "      state->backtrack_depth -= 1;\n"
+              "      if (state->cuts != cuts && state->backtrack_depth == 0) {\n"
+              "        state_commit(state);\n"
+              "      }\n"
+              "      cuts = state->cuts;\n"
+              "      state_checkpoint(state, &cp);\n"
+              "      state->backtrack_depth += 1;\n"
+              "    }\n");
+    }
+    fprintf(out,
+            "    success = success && %s_%zu(state, exes);\n"
+            "  }\n", name, a);
+    break;
+
+  case PARSER_OR:
+    fprintf(out,
+            "  return %s_%zu(state, exes) || %s_%zu(state, exes);\n",
+            name, a, name, b);
+    break;
+
+  case PARSER_AND:
+    fprintf(out,
+            "  return %s_%zu(state, exes) && %s_%zu(state, exes);\n",
+            name, a, name, b);
+    break;
+
+  case PARSER_EXECUTE:
+    fprintf(out,
+            "  size_t start = state->output_len;\n"
+            "  state->capture_depth += 1;\n"
+            "  bool success = %s_%zu(state, exes);\n"
+            "  state->capture_depth -= 1;\n"
+            "  if (!success) {\n"
+            "    state_output_truncate(state, start);\n"
+            "    return false;\n"
+            "  }\n"
+            "  state_success_blank(state);\n"
+            "  state_add_handler_n(state, exes[%zu].handle, state->output + start,\n"
+            "                      state->output_len - start, exes[%zu].extra);\n"
+            "  return true;\n",
+            name, a, node->exe_index, node->exe_index);
+    break;
+
+  case PARSER_MEMO:
+    fprintf(out, "  return %s_%zu(state, exes);\n", name, a);
+    break;
+
+  case PARSER_LOOKAHEAD:
+    fprintf(out,
+            "  struct parse_checkpoint cp;\n"
+            "  size_t cuts = state->cuts;\n"
+            "  state_checkpoint(state, &cp);\n"
+            "  state->backtrack_depth += 1;\n"
+            "  bool success = %s_%zu(state, exes);\n"
+            "  state->backtrack_depth -= 1;\n"
+            "  state->cuts = cuts;\n"
+            "  state_restore(state, &cp);\n"
+            "  return %ssuccess && state_success_blank(state);\n",
+            name, a, ((const struct parser_lookahead *)p)->negate ? "!" : "");
+    break;
+
+  case PARSER_CUT:
+    fprintf(out,
+            "  (void)exes;\n"
+            "  state->cuts += 1;\n"
+            "  if (state->backtrack_depth == 0) {\n"
+            "    state_commit(state);\n"
+            "  }\n"
+            "  return state_success_blank(state);\n");
+    break;
+
+  default:
+    break;
+  }
+  fprintf(out, "}\n\n");
+}
+
+bool
+parser_emit_c(const struct parser *p, FILE *out, const char *name)
+{
+  size_t len;
+  struct parser_index *nodes = parser_index(p, &len);
+  for (size_t i = 0; i < len; i += 1) {
+    if (nodes[i].p->kind == PARSER_OTHER || nodes[i].p->kind == PARSER_PRATT) {
+      parse_free(nodes);
+      return false;
+    }
+  }
+
+  fprintf(out,
+          "/* Generated by parser_emit_c. Do not edit. */\n\n"
+          "#include \"parse.h\"\n"
+          "#include \"state.h\"\n\n");
+  for (size_t i = 0; i < len; i += 1) {
+    fprintf(out,
+            "static bool %s_%zu(struct parse_state *, "
+            "const struct parser_exe_binding *);\n", name, i);
+  }
+  fprintf(out, "\n");
+  for (size_t i = 0; i < len; i += 1) {
+    emit_node(out, name, i, &nodes[i]);
+  }
+  fprintf(out,
+          "bool\n"
+          "%s(struct parse_state *state, const struct parser_exe_binding *exes)\n"
+          "{\n"
+          "  return %s_0(state, exes);\n"
+          "}\n", name, name);
+
+  parse_free(nodes);
+  return !ferror(out);
+}
@@ -0,0 +1,47 @@
+#include <stdio.h>
+
+#include "parse.h"
+#include "roman.h"
+
+/**
+ * Writes the Roman numeral grammars as C to the file named on the command
+ * line, for emit_test.
+ */
+
+static bool
+emit(FILE *out, struct parser *p, const char *name)
+{
+  bool success = parser_emit_c(p, out, name);
+  fprintf(out, "\n");
+  parser_free(p);
+  return success;
+}
+
+int
+main(int argc, char **argv)
+{
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s output.c\n", argv[0]);
+    return 1;
+  }
+  FILE *out = fopen(argv[1], "w");
+  if (out == NULL) {
+    perror(argv[1]);
+    return 1;
+  }
+
+  int total = 0;
+  size_t total_full = 0;
+  bool success = emit(out, roman_numeral_basic(&total), "roman_basic_gen")
+    && emit(out, roman_numeral_simple(&total), "roman_simple_gen")
+    && emit(out, roman_numeral(&total_full), "roman_gen")
+    && emit(out, parser_compile(roman_numeral_simple(&total)),
+            "roman_compiled_gen");
+
+  if (fclose(out) != 0 || !success) {
+    fprintf(stderr, "failed to write %s\n", argv[1]);
+    remove(argv[1]);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,157 @@
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "assert.h"
+#include "error.h"
+#include "test.h"
+#include "parse.h"
+#include "roman.h"
+#include "state.h"
+#include "parser/parser_internal.h"
+
+/* Generated by emit_roman from the grammars in roman.c */
+bool roman_basic_gen(struct parse_state *, const struct parser_exe_binding *);
+bool roman_simple_gen(struct parse_state *, const struct parser_exe_binding *);
+bool roman_gen(struct parse_state *, const struct parser_exe_binding *);
+bool roman_compiled_gen(struct parse_state *,
+                        const struct parser_exe_binding *);
+
+typedef bool generated_fn(struct parse_state *,
+                          const struct parser_exe_binding *);
+
+#define MAX_EXES 64
+
+/*
+ * A grammar from roman.c built twice, once for the interpreter and once to
+ * bind the generated code to, each with its own total of the given size.
+ */
+struct roman_pair {
+  struct parser *p;
+  struct parser *q;
+  generated_fn *gen;
+  void *p_total;
+  void *q_total;
+  size_t size;
+};
+
+/*
+ * Runs the interpreted grammar and the generated function over input and
+ * checks that the runs, and the totals their handlers compute, are identical.
+ */
+static struct error *
+check_generated(const char *input, const struct roman_pair *g)
+{
+  struct parser_exe_binding exes[MAX_EXES];
+  struct parse_state expected, actual;
+  struct error *error = NULL;
+  error_try(assert(parser_exe_bindings(g->q, exes, MAX_EXES) <= MAX_EXES));
+  state_create(&expected, input);
+  state_create(&actual, input);
+  memset(g->p_total, 0, g->size);
+  memset(g->q_total, 0, g->size);
+
+  bool matched = parser_run(g->p, &expected);
+  if (matched != g->gen(&actual, exes)) {
+    error_to(error, "Generated code disagrees on success for %s", input);
+  } else if (expected.pos != actual.pos) {
+    error_to(error, "Generated code disagrees on position for %s", input);
+  } else if (strcmp(expected.output ? expected.output : "",
+                    actual.output ? actual.output : "") != 0) {
+    error_to(error, "Generated code disagrees on output for %s", input);
+  } else if (expected.num_outputs != actual.num_outputs) {
+    error_to(error, "Generated code disagrees on handlers for %s", input);
+  } else if (matched) {
+    state_execute(&expected);
+    state_execute(&actual);
+    if (memcmp(g->p_total, g->q_total, g->size) != 0) {
+      error_to(error, "Generated code disagrees on value for %s", input);
+    }
+  }
+
+  state_destroy(&expected);
+  state_destroy(&actual);
+  return error;
+}
+
+/*
+ * Every string of up to four numeral letters, plus one with a stray letter.
+ */
+static struct error *
+check_all_inputs(const struct roman_pair *g)
+{
+  const char letters[] = "IVXLCDM";
+  char input[8];
+  for (size_t len = 0; len <= 4; len += 1) {
+    size_t count = 1;
+    for (size_t i = 0; i < len; i += 1) {
+      count *= 7;
+    }
+    for (size_t n = 0; n < count; n += 1) {
+      for (size_t i = 0, m = n; i < len; i += 1, m /= 7) {
+        input[i] = letters[m % 7];
+      }
+      input[len] = '\0';
+      error_try(check_generated(input, g));
+      input[len] = 'a';
+      input[len + 1] = '\0';
+      error_try(check_generated(input, g));
+    }
+  }
+  return NULL;
+}
+
+static struct error *
+check_roman(struct roman_pair *g)
+{
+  struct error *error = check_all_inputs(g);
+  parser_free(g->p);
+  parser_free(g->q);
+  return error;
+}
+
+new_test(test_emit_roman_basic)
+{
+  int p_total, q_total;
+  return check_roman(&(struct roman_pair){
+      roman_numeral_basic(&p_total), roman_numeral_basic(&q_total),
+      roman_basic_gen, &p_total, &q_total, sizeof(int)});
+}
+
+new_test(test_emit_roman_simple)
+{
+  int p_total, q_total;
+  return check_roman(&(struct roman_pair){
+      roman_numeral_simple(&p_total), roman_numeral_simple(&q_total),
+      roman_simple_gen, &p_total, &q_total, sizeof(int)});
+}
+
+new_test(test_emit_roman_compiled)
+{
+  int p_total, q_total;
+  return check_roman(&(struct roman_pair){
+      roman_numeral_simple(&p_total),
+      parser_compile(roman_numeral_simple(&q_total)),
+      roman_compiled_gen, &p_total, &q_total, sizeof(int)});
+}
+
+new_test(test_emit_roman_numeral)
+{
+  size_t p_total, q_total;
+  struct roman_pair g = {roman_numeral(&p_total), roman_numeral(&q_total),
+                         roman_gen, &p_total, &q_total, sizeof(size_t)};
+  error_try(check_generated("MDCCXCVII", &g));
+  error_try(assert_unsigned_equal(1797, q_total));
+  return check_roman(&g);
+}
+
+new_test(test_emit_rejects_unknown_nodes)
+{
+  struct parser *p = and(ch('a'), ch('b'));
+  ((struct parser_and *)p)->second->kind = PARSER_OTHER;
+  FILE *out = tmpfile();
+  error_try(assert(!parser_emit_c(p, out, "unknown")));
+  fclose(out);
+  parser_free(p);
+  return NULL;
+}
@@ -0,0 +1,90 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include "parse.hpp"
+#include "roman.hpp"
+
+extern "C" {
+#include "log.h"
+#include "parse.h"
+#include "roman.h"
+}
+
+/**
+ * Compares the C tree walker with the parse.hpp version of the same grammar
+ * on a set of roman numeral records, both reusing one state.
+ * Usage: hpp_bench [records]
+ */
+
+static const char *records[] = {"XXXVIII", "XIV", "MCMXCIX", "VII",
+                                "MMMDCCCLXXXVIII", "XLII", "CDXLIV", "IIX"};
+static const size_t num_records = sizeof(records) / sizeof(records[0]);
+
+static double
+now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+report(const char *name, double elapsed, size_t n, size_t bytes,
+       size_t matched, size_t total, double base)
+{
+  info("%-10s %8.1f ns/record %8.1f MB/s %.2fx (%zu matched, total %zu)",
+       name, elapsed * 1e9 / n, bytes / elapsed / 1e6, base / elapsed,
+       matched, total);
+}
+
+static void
+bench_tree(const char *name, struct parser *p, size_t *total, size_t n,
+           size_t bytes, double *base)
+{
+  struct parse_context *ctx = parse_context_new();
+  size_t matched = 0;
+  *total = 0;
+  double start = now();
+  for (size_t i = 0; i < n; i += 1) {
+    const char *r = records[i % num_records];
+    matched += parse_context_run(ctx, p, r, strlen(r), NULL);
+  }
+  double elapsed = now() - start;
+  if (*base == 0) {
+    *base = elapsed;
+  }
+  report(name, elapsed, n, bytes, matched, *total, *base);
+  parse_context_free(ctx);
+}
+
+int
+main(int argc, char **argv)
+{
+  size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 2000000;
+  size_t bytes = 0;
+  for (size_t i = 0; i < n; i += 1) {
+    bytes += strlen(records[i % num_records]);
+  }
+
+  double base = 0;
+  size_t total = 0;
+  struct parser *p = roman_numeral(&total);
+  bench_tree("tree", p, &total, n, bytes, &base);
+  parser_free(p);
+
+  auto g = roman_numeral_hpp(total);
+  struct parse_state state;
+  state_create(&state, "");
+  size_t matched = 0;
+  total = 0;
+  double start = now();
+  for (size_t i = 0; i < n; i += 1) {
+    const char *r = records[i % num_records];
+    matched += parse::run(g, state, r, strlen(r));
+  }
+  report("template", now() - start, n, bytes, matched, total, base);
+  state_destroy(&state);
+  return 0;
+}
@@ -0,0 +1,168 @@
+#include <cstring>
+
+#include "parse.hpp"
+#include "roman.hpp"
+
+extern "C" {
+#include "assert.h"
+#include "error.h"
+#include "test.h"
+#include "parse.h"
+#include "roman.h"
+#include "parser/parser_internal.h"
+}
+
+using namespace parse;
+
+/*
+ * Runs the C tree p and the template grammar g over input and checks that
+ * they leave the same state behind and compute the same total.
+ */
+template <class G>
+static struct error *
+check_same(const char *input, struct parser *p, const G &g,
+           size_t *p_total, size_t *g_total)
+{
+  struct parse_state expected, actual;
+  state_create(&expected, input);
+  state_create(&actual, input);
+  *p_total = *g_total = 0;
+
+  bool matched = parser_run(p, &expected);
+  struct error *error = assert(matched == g(actual));
+  if (error == NULL) {
+    error = assert_unsigned_equal(expected.pos, actual.pos);
+  }
+  if (error == NULL) {
+    error = assert(strcmp(expected.output ? expected.output : "",
+                          actual.output ? actual.output : "") == 0);
+  }
+  if (error == NULL) {
+    error = assert_unsigned_equal(expected.num_outputs, actual.num_outputs);
+  }
+  if (error == NULL) {
+    state_execute(&expected);
+    state_execute(&actual);
+    error = assert_unsigned_equal(*p_total, *g_total);
+  }
+
+  state_destroy(&expected);
+  state_destroy(&actual);
+  return error;
+}
+
+new_test(test_hpp_roman_numeral)
+{
+  size_t total = 0;
+  struct parse_state state;
+  state_create(&state, "");
+  auto g = roman_numeral_hpp(total);
+
+  error_try(assert(run(g, state, "MDCCXCVII", 9)));
+  error_try(assert_unsigned_equal(1797, total));
+  error_try(assert(strcmp(state.output, "MDCCXCVII") == 0));
+  error_try(assert(!run(g, state, "IIX", 3)));
+
+  state_destroy(&state);
+  return NULL;
+}
+
+new_test(test_hpp_matches_tree)
+{
+  const char letters[] = "IVXLCDMa";
+  size_t p_total, g_total;
+  struct parser *p = roman_numeral(&p_total);
+  auto g = roman_numeral_hpp(g_total);
+  char input[8];
+
+  // Every string of up to four letters, including a non-numeral one.
+  for (size_t len = 0; len <= 4; len += 1) {
+    size_t count = 1;
+    for (size_t i = 0; i < len; i += 1) {
+      count *= 8;
+    }
+    for (size_t n = 0; n < count; n += 1) {
+      for (size_t i = 0, m = n; i < len; i += 1, m /= 8) {
+        input[i] = letters[m % 8];
+      }
+      input[len] = '\0';
+      error_try(check_same(input, p, g, &p_total, &g_total));
+    }
+  }
+
+  parser_free(p);
+  return NULL;
+}
+
+new_test(test_hpp_builds_c_trees)
+{
+  // The C constructors are callable from C++, including kinds that have no
+  // template counterpart.
+  size_t p_total = 0, g_total = 0;
+  struct parser *p = parser_create_and(
+      parser_create_repeat(1, SIZE_MAX, parser_create_char('a')),
+      parser_create_eof());
+  auto g = seq(ch('a'), many(ch('a')), eof());
+  const char *inputs[] = {"", "a", "aaa", "ab", "b"};
+  for (const char *input : inputs) {
+    error_try(check_same(input, p, g, &p_total, &g_total));
+  }
+
+  parser_free(p);
+  return NULL;
+}
+
+static bool
+capture(char *match, void *dest)
+{
+  strcpy(static_cast<char *>(dest), match);
+  return true;
+}
+
+new_test(test_hpp_until_and_str)
+{
+  char inner[16] = "";
+  struct parse_state state;
+  state_create(&state, "");
+  auto g = seq(ch('{'), exe(until(ch('}')), capture, inner), ch('}'),
+               str("end"));
+
+  error_try(assert(run(g, state, "{test}end", 9)));
+  error_try(assert(strcmp(inner, "test") == 0));
+  // str() matches a prefix at the end of input, as in C.
+  error_try(assert(run(g, state, "{}en", 4)));
+  error_try(assert(!run(g, state, "{}ex", 4)));
+
+  state_destroy(&state);
+  return NULL;
+}
+
+new_test(test_hpp_cut_commits_try)
+{
+  struct parse_state state;
+  state_create(&state, "");
+  auto g = alt(try_(seq(ch('a'), cut(), ch('b'))), str("ac"));
+
+  error_try(assert(run(g, state, "ab", 2)));
+  // The cut stops the try from rolling back, so str("ac") starts after a.
+  error_try(assert(!run(g, state, "ac", 2)));
+  error_try(assert_unsigned_equal(1, state.pos));
+
+  state_destroy(&state);
+  return NULL;
+}
+
+new_test(test_hpp_partial_input)
+{
+  struct parse_state state;
+  state_create(&state, "ab");
+  state.partial = true;
+  auto g = seq(many(ch('a')), ch('b'), eof());
+
+  // The match depends on the end of input, so a session would wait for more.
+  error_try(assert(g(state)));
+  error_try(assert(state.starved));
+
+  state_destroy(&state);
+  return NULL;
+}
@@ -1,5 +1,7 @@
 #include <istream.h>
 
+#include <alloc.h>
+
 #include <error.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -33,7 +35,7 @@ cstr_istream_get_next_uint8(struct istream *_self, uint8_t *char_out)
 struct cstr_istream *
 cstr_istream_new()
 {
-    struct cstr_istream *self = malloc(sizeof(struct cstr_istream));
+    struct cstr_istream *self = parse_malloc(sizeof(struct cstr_istream));
     self->parent.eof = cstr_istream_eof;
     self->parent.get_next_uint8 = cstr_istream_get_next_uint8;
     self->str = NULL;
@@ -44,7 +46,7 @@ cstr_istream_new()
 void
 cstr_istream_free(struct cstr_istream *self)
 {
-    free(self);
+    parse_free(self);
 }
 
 void
@@ -0,0 +1,297 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "parser/parser_internal.h"
+#include "context.h"
+#include "lexer.h"
+#include "parse.h"
+#include "state.h"
+
+/**
+ * Rules are tried in order at every position, skipping those that cannot
+ * start with the byte there. Grammar rules all run on one state that is
+ * rolled back after each attempt; it is marked as inside a try() so that a
+ * cut() in a rule cannot commit anything.
+ */
+
+struct lexer_rule {
+  int kind;
+  /* NULL for a class rule */
+  struct parser *rule;
+  /* Bytes a match can start with; for a class rule, the class */
+  uint8_t first[32];
+};
+
+static void
+set_add(uint8_t *set, uint8_t c)
+{
+  set[c / 8] |= 1 << (c % 8);
+}
+
+static bool
+set_has(const uint8_t *set, uint8_t c)
+{
+  return set[c / 8] >> (c % 8) & 1;
+}
+
+/**
+ * Add to set every byte that a match of p can start by consuming, and return
+ * whether p can match without consuming anything. Where the answer is not
+ * known, p is taken to start with any byte.
+ */
+static bool
+lexer_first(const struct parser *p, uint8_t *set)
+{
+  switch (p->kind) {
+  case PARSER_BLANK:
+  case PARSER_EOF:
+  case PARSER_CUT:
+  case PARSER_LOOKAHEAD:
+    return true;
+  case PARSER_NULL:
+    return false;
+  case PARSER_CHAR:
+    set_add(set, ((const struct parser_char *)p)->c);
+    return false;
+  case PARSER_TOKEN:
+    set_add(set, ((const struct parser_token *)p)->kind);
+    return false;
+  case PARSER_STR: {
+    const char *literal = ((const struct parser_str *)p)->literal;
+    if (*literal) {
+      set_add(set, *literal);
+    }
+    return *literal == '\0';
+  }
+  case PARSER_MANY:
+  case PARSER_OPTIONAL:
+    lexer_first(((const struct parser_many *)p)->target, set);
+    return true;
+  case PARSER_REPEAT: {
+    const struct parser_repeat *r = (const struct parser_repeat *)p;
+    return lexer_first(r->target, set) || r->min == 0;
+  }
+  case PARSER_SEP_BY:
+    lexer_first(((const struct parser_sep_by *)p)->target, set);
+    return true;
+  case PARSER_TRY:
+  case PARSER_MEMO:
+    return lexer_first(((const struct parser_try *)p)->target, set);
+  case PARSER_EXECUTE:
+    return lexer_first(((const struct parser_execute *)p)->target, set);
+  case PARSER_OR: {
+    const struct parser_or *or_p = (const struct parser_or *)p;
+    bool first = lexer_first(or_p->first, set);
+    return lexer_first(or_p->second, set) || first;
+  }
+  case PARSER_AND: {
+    const struct parser_and *and_p = (const struct parser_and *)p;
+    return lexer_first(and_p->first, set) && lexer_first(and_p->second, set);
+  }
+  case PARSER_DFA: {
+    // Any first step that neither fails nor stops where it is.
+    const struct parser_dfa *dfa = (const struct parser_dfa *)p;
+    // Decided without reading anything; the final states have no rows.
+    if (dfa->start == DFA_FAIL) {
+      return false;
+    }
+    if (dfa->start == DFA_MATCH) {
+      return true;
+    }
+    const uint32_t *row = dfa->table + dfa->start * (dfa->num_classes + 1);
+    for (size_t c = 0; c < 256; c += 1) {
+      uint32_t next = row[dfa->classes[c]];
+      if (next != DFA_FAIL && next != DFA_MATCH) {
+        set_add(set, c);
+      }
+    }
+    return true;
+  }
+  default:
+    memset(set, 0xff, 32);
+    return true;
+  }
+}
+
+struct parse_lexer {
+  struct lexer_rule *rules;
+  size_t len;
+  size_t cap;
+  struct parse_state state;
+};
+
+struct parse_lexer *
+parse_lexer_new()
+{
+  struct parse_lexer *lexer = parse_calloc(1, sizeof(struct parse_lexer));
+  state_create_len(&lexer->state, "", 0);
+  return lexer;
+}
+
+void
+parse_lexer_free(struct parse_lexer *lexer)
+{
+  for (size_t i = 0; i < lexer->len; i += 1) {
+    if (lexer->rules[i].rule) {
+      parser_free(lexer->rules[i].rule);
+    }
+  }
+  parse_free(lexer->rules);
+  state_destroy(&lexer->state);
+  parse_free(lexer);
+}
+
+static struct lexer_rule *
+lexer_push(struct parse_lexer *lexer, int kind)
+{
+  if (lexer->len == lexer->cap) {
+    lexer->cap = lexer->cap ? lexer->cap * 2 : 8;
+    lexer->rules = parse_realloc(lexer->rules,
+                                 lexer->cap * sizeof(struct lexer_rule));
+  }
+  struct lexer_rule *r = &lexer->rules[lexer->len++];
+  memset(r, 0, sizeof(struct lexer_rule));
+  r->kind = kind;
+  return r;
+}
+
+static bool
+lexer_kind_valid(int kind)
+{
+  return kind == PARSE_TOKEN_SKIP || (kind >= 0 && kind <= UINT8_MAX);
+}
+
+bool
+parse_lexer_add(struct parse_lexer *lexer, int kind, struct parser *rule)
+{
+  if (!lexer_kind_valid(kind)) {
+    parser_free(rule);
+    return false;
+  }
+  struct lexer_rule *r = lexer_push(lexer, kind);
+  r->rule = parser_compile(rule);
+  lexer_first(r->rule, r->first);
+  return true;
+}
+
+bool
+parse_lexer_add_class(struct parse_lexer *lexer, int kind, const char *chars)
+{
+  if (!lexer_kind_valid(kind)) {
+    return false;
+  }
+  struct lexer_rule *r = lexer_push(lexer, kind);
+  for (const unsigned char *c = (const unsigned char *)chars; *c; c += 1) {
+    set_add(r->first, *c);
+  }
+  return true;
+}
+
+struct parse_tokens *
+parse_tokens_new()
+{
+  return parse_calloc(1, sizeof(struct parse_tokens));
+}
+
+void
+parse_tokens_free(struct parse_tokens *tokens)
+{
+  parse_free(tokens->tokens);
+  parse_free(tokens->kinds);
+  parse_free(tokens);
+}
+
+static void
+tokens_push(struct parse_tokens *tokens, uint8_t kind, size_t offset,
+            size_t len)
+{
+  if (tokens->len == tokens->cap) {
+    tokens->cap = tokens->cap ? tokens->cap * 2 : 64;
+    tokens->tokens = parse_realloc(
+        tokens->tokens, tokens->cap * sizeof(struct parse_token));
+    tokens->kinds = parse_realloc(tokens->kinds, tokens->cap);
+  }
+  tokens->tokens[tokens->len] = (struct parse_token){offset, len, kind};
+  tokens->kinds[tokens->len++] = kind;
+}
+
+/**
+ * Length of the match of r at pos, or 0.
+ */
+static size_t
+lexer_match(struct parse_lexer *lexer, const struct lexer_rule *r,
+            const char *input, size_t len, size_t pos)
+{
+  if (r->rule == NULL) {
+    size_t end = pos;
+    while (end < len && set_has(r->first, input[end])) {
+      end += 1;
+    }
+    return end - pos;
+  }
+  struct parse_state *state = &lexer->state;
+  struct parse_checkpoint cp;
+  state->pos = pos;
+  state_checkpoint(state, &cp);
+  size_t end = parser_run(r->rule, state) ? state->pos : pos;
+  state_restore(state, &cp);
+  return end > pos ? end - pos : 0;
+}
+
+bool
+parse_lexer_run(
+    struct parse_lexer *lexer,
+    const char *input,
+    size_t len,
+    struct parse_tokens *tokens)
+{
+  tokens->text = input;
+  tokens->len = 0;
+  tokens->end = 0;
+  if (len > UINT32_MAX) {
+    return false;
+  }
+  state_reset(&lexer->state, input, len);
+  lexer->state.backtrack_depth = 1;
+
+  size_t pos = 0;
+  while (pos < len) {
+    size_t best = 0;
+    int kind = PARSE_TOKEN_SKIP;
+    for (size_t i = 0; i < lexer->len; i += 1) {
+      if (!set_has(lexer->rules[i].first, input[pos])) {
+        continue;
+      }
+      size_t n = lexer_match(lexer, &lexer->rules[i], input, len, pos);
+      if (n > best) {
+        best = n;
+        kind = lexer->rules[i].kind;
+      }
+    }
+    if (best == 0) {
+      break;
+    }
+    if (kind != PARSE_TOKEN_SKIP) {
+      tokens_push(tokens, kind, pos, best);
+    }
+    pos += best;
+  }
+  lexer->state.backtrack_depth = 0;
+  tokens->end = pos;
+  return pos == len;
+}
+
+bool
+parse_context_run_tokens(
+    struct parse_context *ctx,
+    const struct parser *p,
+    const struct parse_tokens *tokens,
+    const char **output)
+{
+  ctx->state.tokens = tokens;
+  const char *kinds = tokens->kinds ? tokens->kinds : "";
+  bool success = parse_context_run(ctx, p, kinds, tokens->len, output);
+  ctx->state.tokens = NULL;
+  return success;
+}
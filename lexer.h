@@ -0,0 +1,103 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct parser;
+struct parse_context;
+
+/**
+ * An optional lexing stage. A lexer turns input into an array of tokens in a
+ * single pass, and tok() parses over that array: each token's kind is one
+ * byte of the input the grammar runs on, so every combinator works on
+ * tokens unchanged and choosing between alternatives that start with
+ * different tokens costs one compare. tok() adds the text of the token it
+ * matches to the output, so exe() handlers still see source text.
+ *
+ * At each position the lexer takes the longest match of any of its rules,
+ * the earliest rule winning ties. Rules are either grammars, which must not
+ * use exe(), or classes, which match the longest run of bytes from a set.
+ * Tokens of kind PARSE_TOKEN_SKIP, such as whitespace and comments, are
+ * dropped.
+ */
+#define PARSE_TOKEN_SKIP (-1)
+
+struct parse_token {
+  uint32_t offset;
+  uint32_t len;
+  uint8_t kind;
+};
+
+struct parse_tokens {
+  /* The input the tokens were read from, which is not copied */
+  const char *text;
+  struct parse_token *tokens;
+  /* The kind of every token, which is what token grammars run over */
+  char *kinds;
+  size_t len;
+  size_t cap;
+  /* How far lexing got: the whole input, or where no rule matched */
+  size_t end;
+};
+
+struct parse_lexer;
+
+struct parse_lexer *
+parse_lexer_new();
+
+void
+parse_lexer_free(struct parse_lexer *lexer);
+
+/**
+ * Add a rule producing tokens of kind, which is 0 to 255 or
+ * PARSE_TOKEN_SKIP. The lexer takes ownership of rule, and compiles it (see
+ * parser_compile). Returns false, freeing rule and adding nothing, if kind
+ * is out of range.
+ */
+bool
+parse_lexer_add(struct parse_lexer *lexer, int kind, struct parser *rule);
+
+/**
+ * Add a rule matching one or more bytes from the NUL-terminated set chars.
+ * Returns false, adding nothing, if kind is out of range.
+ */
+bool
+parse_lexer_add_class(struct parse_lexer *lexer, int kind, const char *chars);
+
+struct parse_tokens *
+parse_tokens_new();
+
+void
+parse_tokens_free(struct parse_tokens *tokens);
+
+/**
+ * Replace the contents of tokens with the tokens of input. Returns false if
+ * some position matched no rule (tokens->end is then that position) or the
+ * input is longer than a token offset can express.
+ */
+bool
+parse_lexer_run(
+    struct parse_lexer *lexer,
+    const char *input,
+    size_t len,
+    struct parse_tokens *tokens);
+
+/**
+ * parse_context_run over a token array. The output is the text of the tokens
+ * matched by tok(). Token runs bypass any cache attached to ctx.
+ */
+bool
+parse_context_run_tokens(
+    struct parse_context *ctx,
+    const struct parser *p,
+    const struct parse_tokens *tokens,
+    const char **output);
+
+#ifdef __cplusplus
+}
+#endif
@@ -14,7 +14,7 @@
 
 #define LINKERSET_ADD_ITEM(_name, _desc_name)         \
   static void const *__##_name##_ptr_##_desc_name     \
-  __attribute__((section(#_name),used)) = &_desc_name
+  __attribute__((section(#_name),used)) = (void const *)&_desc_name
 
 #define LINKERSET_ITERATE(_name, _var, _body)   \
   do {                                          \
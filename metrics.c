@@ -0,0 +1,204 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "parser/parser_internal.h"
+#include "metrics.h"
+
+/**
+ * Shards are only written by the thread that owns them, with relaxed atomic
+ * stores so that a concurrent snapshot never reads a torn counter. They are
+ * kept on a list, which is locked only to add a shard, hand one to a new
+ * thread or take a snapshot, and are never freed: when a thread exits, its
+ * shard is marked free for the next thread to claim.
+ */
+
+struct metrics_shard {
+  struct parse_metrics m;
+  struct metrics_shard *next;
+  bool owned;
+};
+
+static bool metrics_enabled;
+static struct metrics_shard *shards;
+static pthread_mutex_t shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t shard_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t shard_key;
+static __thread struct metrics_shard *shard;
+
+static void
+shard_release(void *s)
+{
+  pthread_mutex_lock(&shards_lock);
+  ((struct metrics_shard *)s)->owned = false;
+  pthread_mutex_unlock(&shards_lock);
+}
+
+static void
+shard_key_create()
+{
+  pthread_key_create(&shard_key, shard_release);
+}
+
+static struct metrics_shard *
+shard_claim()
+{
+  pthread_once(&shard_key_once, shard_key_create);
+  pthread_mutex_lock(&shards_lock);
+  struct metrics_shard *s = shards;
+  while (s != NULL && s->owned) {
+    s = s->next;
+  }
+  if (s == NULL) {
+    s = parse_calloc(1, sizeof(struct metrics_shard));
+    s->next = shards;
+    shards = s;
+  }
+  s->owned = true;
+  pthread_mutex_unlock(&shards_lock);
+  pthread_setspecific(shard_key, s);
+  return s;
+}
+
+void
+parse_metrics_enable(bool enabled)
+{
+  __atomic_store_n(&metrics_enabled, enabled, __ATOMIC_RELAXED);
+}
+
+static uint64_t
+now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+uint64_t
+metrics_start()
+{
+  if (!__atomic_load_n(&metrics_enabled, __ATOMIC_RELAXED)) {
+    return 0;
+  }
+  return now_ns();
+}
+
+static size_t
+bucket_of(uint64_t ns)
+{
+  if (ns < PARSE_METRICS_SUB_BUCKETS) {
+    return ns;
+  }
+  unsigned e = 63 - __builtin_clzll(ns);
+  return (e - 3) * PARSE_METRICS_SUB_BUCKETS +
+    ((ns >> (e - 4)) & (PARSE_METRICS_SUB_BUCKETS - 1));
+}
+
+uint64_t
+parse_metrics_bucket_limit(size_t bucket)
+{
+  if (bucket < PARSE_METRICS_SUB_BUCKETS) {
+    return bucket;
+  }
+  unsigned e = bucket / PARSE_METRICS_SUB_BUCKETS + 3;
+  uint64_t sub = bucket % PARSE_METRICS_SUB_BUCKETS;
+  uint64_t width = (uint64_t)1 << (e - 4);
+  return ((PARSE_METRICS_SUB_BUCKETS + sub) << (e - 4)) + (width - 1);
+}
+
+static void
+add(uint64_t *counter, uint64_t n)
+{
+  __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+void
+metrics_record(uint64_t start, bool matched, size_t bytes, size_t backtracks)
+{
+  if (start == 0) {
+    return;
+  }
+  uint64_t ns = now_ns() - start;
+  struct metrics_shard *s = shard ? shard : (shard = shard_claim());
+  add(&s->m.runs, 1);
+  add(matched ? &s->m.matched : &s->m.failed, 1);
+  add(&s->m.bytes, bytes);
+  add(&s->m.backtracks, backtracks);
+  add(&s->m.latency_ns, ns);
+  add(&s->m.latency[bucket_of(ns)], 1);
+}
+
+void
+parse_metrics_snapshot(struct parse_metrics *out)
+{
+  memset(out, 0, sizeof(struct parse_metrics));
+  pthread_mutex_lock(&shards_lock);
+  for (struct metrics_shard *s = shards; s != NULL; s = s->next) {
+    out->runs += __atomic_load_n(&s->m.runs, __ATOMIC_RELAXED);
+    out->matched += __atomic_load_n(&s->m.matched, __ATOMIC_RELAXED);
+    out->failed += __atomic_load_n(&s->m.failed, __ATOMIC_RELAXED);
+    out->bytes += __atomic_load_n(&s->m.bytes, __ATOMIC_RELAXED);
+    out->backtracks += __atomic_load_n(&s->m.backtracks, __ATOMIC_RELAXED);
+    out->latency_ns += __atomic_load_n(&s->m.latency_ns, __ATOMIC_RELAXED);
+    for (size_t i = 0; i < PARSE_METRICS_BUCKETS; i += 1) {
+      out->latency[i] += __atomic_load_n(&s->m.latency[i], __ATOMIC_RELAXED);
+    }
+  }
+  pthread_mutex_unlock(&shards_lock);
+}
+
+uint64_t
+parse_metrics_percentile(const struct parse_metrics *m, double q)
+{
+  // The histogram is read separately from runs, so count it afresh.
+  uint64_t total = 0, seen = 0;
+  for (size_t i = 0; i < PARSE_METRICS_BUCKETS; i += 1) {
+    total += m->latency[i];
+  }
+  if (total == 0) {
+    return 0;
+  }
+  // Nearest rank: the smallest sample with at least q of the runs at or
+  // below it.
+  double exact = q * total;
+  uint64_t rank = exact;
+  rank += rank < exact;
+  rank = rank < 1 ? 1 : rank > total ? total : rank;
+  for (size_t i = 0; i < PARSE_METRICS_BUCKETS; i += 1) {
+    seen += m->latency[i];
+    if (seen >= rank) {
+      return parse_metrics_bucket_limit(i);
+    }
+  }
+  return 0;
+}
+
+bool
+parse_metrics_write(const struct parse_metrics *m, FILE *out)
+{
+  static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+  fprintf(out,
+          "# TYPE parse_runs_total counter\n"
+          "parse_runs_total{result=\"matched\"} %llu\n"
+          "parse_runs_total{result=\"failed\"} %llu\n"
+          "# TYPE parse_bytes_total counter\n"
+          "parse_bytes_total %llu\n"
+          "# TYPE parse_backtracks_total counter\n"
+          "parse_backtracks_total %llu\n"
+          "# TYPE parse_run_latency_seconds summary\n",
+          (unsigned long long)m->matched, (unsigned long long)m->failed,
+          (unsigned long long)m->bytes, (unsigned long long)m->backtracks);
+  for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i += 1) {
+    fprintf(out, "parse_run_latency_seconds{quantile=\"%g\"} %.9f\n",
+            quantiles[i], parse_metrics_percentile(m, quantiles[i]) / 1e9);
+  }
+  fprintf(out,
+          "parse_run_latency_seconds_sum %.9f\n"
+          "parse_run_latency_seconds_count %llu\n",
+          m->latency_ns / 1e9, (unsigned long long)m->runs);
+  return !ferror(out);
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Always-available run metrics for monitoring: how many runs matched and
+ * failed, how many bytes they were given, how often they backtracked and a
+ * histogram of their latencies. Metrics cover run() and parse_context_run
+ * (and so batches), and are off until parse_metrics_enable is called; when
+ * on they cost two clock reads and a few uncontended counter updates per
+ * run.
+ *
+ * Each thread records into its own shard, without locks or shared cache
+ * lines; a snapshot adds the shards up. Counters only ever grow, so rates
+ * come from the difference between two snapshots. Shards of threads that
+ * have exited keep their counts and are reused by new threads.
+ */
+
+/**
+ * Latencies are bucketed in nanoseconds as in HDR histograms: values below
+ * 16 have a bucket each, and every power of two above is split into 16
+ * buckets, so a bucket's width is at most 1/16 of its values.
+ */
+#define PARSE_METRICS_SUB_BUCKETS 16
+#define PARSE_METRICS_BUCKETS (61 * PARSE_METRICS_SUB_BUCKETS)
+
+struct parse_metrics {
+  uint64_t runs;
+  uint64_t matched;
+  uint64_t failed;
+  uint64_t bytes;
+  /* try() and until() rewinds that moved the input position back */
+  uint64_t backtracks;
+  /* Total latency of every run, and their histogram */
+  uint64_t latency_ns;
+  uint64_t latency[PARSE_METRICS_BUCKETS];
+};
+
+void
+parse_metrics_enable(bool enabled);
+
+/**
+ * Add up every thread's metrics into out.
+ */
+void
+parse_metrics_snapshot(struct parse_metrics *out);
+
+/**
+ * The largest latency, in nanoseconds, counted in the given bucket.
+ */
+uint64_t
+parse_metrics_bucket_limit(size_t bucket);
+
+/**
+ * The latency below which a fraction q (0 to 1) of the runs in m fell,
+ * rounded up to its bucket's limit; 0 if m has no runs.
+ */
+uint64_t
+parse_metrics_percentile(const struct parse_metrics *m, double q);
+
+/**
+ * Write m in the Prometheus text format, with the latency as a summary.
+ */
+bool
+parse_metrics_write(const struct parse_metrics *m, FILE *out);
+
+#ifdef __cplusplus
+}
+#endif
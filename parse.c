@@ -5,9 +5,11 @@
 #include <stdio.h>
 
 #include "parser/parser_internal.h"
+#include "context.h"
 #include "parse.h"
 #include "state.h"
 #include "log.h"
+#include "metrics.h"
 
 /**
  * Publically exposed run function.
@@ -16,14 +18,89 @@
 bool
 run(struct parser *p, const char *input, char **output)
 {
+  uint64_t start = metrics_start();
   struct parse_state state;
   state_create(&state, input);
   bool success = parser_run(p, &state);
   if (success) {
     state_execute(&state);
-    *output = malloc(strlen(state.output));
-    strcpy(*output, state.output);
+    *output = malloc(state.output_len + 1);
+    memcpy(*output, state.output ? state.output : "", state.output_len + 1);
   }
+  metrics_record(start, success, state.input_len, state.backtracks);
   state_destroy(&state);
   return success;
 }
+
+struct parse_context *
+parse_context_new()
+{
+  struct parse_context *ctx = parse_malloc(sizeof(struct parse_context));
+  state_create_len(&ctx->state, "", 0);
+  engine_create(&ctx->engine);
+  ctx->mode = PARSE_ENGINE_RECURSIVE;
+  ctx->perf = NULL;
+  ctx->cache = NULL;
+  return ctx;
+}
+
+void
+parse_context_free(struct parse_context *ctx)
+{
+  state_destroy(&ctx->state);
+  engine_destroy(&ctx->engine);
+  parse_free(ctx);
+}
+
+void
+parse_context_set_engine(struct parse_context *ctx, enum parse_engine mode)
+{
+  ctx->mode = mode;
+}
+
+void
+parse_context_set_eager(struct parse_context *ctx, bool eager)
+{
+  ctx->state.eager = eager;
+}
+
+bool
+parse_context_run(
+    struct parse_context *ctx,
+    const struct parser *p,
+    const char *input,
+    size_t len,
+    const char **output)
+{
+  struct parse_state *state = &ctx->state;
+  struct parse_perf_counts start;
+  uint64_t metrics = metrics_start();
+  if (ctx->perf) {
+    parse_perf_read(ctx->perf, &start);
+  }
+  state_reset(state, input, len);
+  // A token run's output is source text that its input, the token kinds,
+  // does not determine.
+  struct parse_cache *cache = state->tokens ? NULL : ctx->cache;
+  bool success;
+  if (cache == NULL || !cache_lookup(cache, p, state, &success)) {
+    success = ctx->mode == PARSE_ENGINE_ITERATIVE
+      ? engine_run(&ctx->engine, p, state)
+      : parser_run(p, state);
+    if (cache) {
+      cache_insert(cache, p, state, success);
+    }
+  }
+  if (success) {
+    state_execute(state);
+    state_success_blank(state);
+    if (output) {
+      *output = state->output;
+    }
+  }
+  if (ctx->perf) {
+    perf_record_run(ctx->perf, &start);
+  }
+  metrics_record(metrics, success, len, state->backtracks);
+  return success;
+}
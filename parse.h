@@ -1,6 +1,21 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "alloc.h"
+#include "cache.h"
+#include "document.h"
+#include "lexer.h"
 #include "macros.h"
+#include "metrics.h"
+#include "profile.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 /* At some point it will be helpful to test the parsers and ensure they all
  * work as expected. */
@@ -10,45 +25,408 @@
  */
 struct parser;
 
+/**
+ * Run p over input. On success *o is a copy of the output, allocated with
+ * plain malloc for the caller to free.
+ */
 bool run(struct parser *p, const char *input, char **o);
 void parser_free(struct parser *p);
 
-#define blank parser_create_blank()
+/**
+ * Replace the parts of p built only from blank, null, eof, ch, str, many,
+ * optional, or and and with table-driven automata that give exactly the same
+ * results, output and end position. Takes ownership of p and returns the
+ * grammar to use in its place. Parts that cannot be compiled, such as many()
+ * over something that can match without consuming, are left as they are.
+ */
+struct parser *parser_compile(struct parser *p);
+
+/**
+ * The handler and argument of an exe() node, for code generated by
+ * parser_emit_c.
+ */
+struct parser_exe_binding {
+  bool (*handle)(char *, void *);
+  void *extra;
+};
+
+/**
+ * Write C source for a function
+ *
+ *   bool name(struct parse_state *state,
+ *             const struct parser_exe_binding *exes);
+ *
+ * that does exactly what running p on state would, with every node inlined
+ * as straight-line code. The generated file only needs parse.h and state.h.
+ * exes[i] stands for the i'th exe() node of p in the order that
+ * parser_exe_bindings uses. Returns false if p contains a node that cannot be
+ * emitted or the output could not be written.
+ */
+bool parser_emit_c(const struct parser *p, FILE *out, const char *name);
+
+/**
+ * Store the handlers of the exe() nodes of p, in the order generated code
+ * expects them, in bindings (which has room for n). Returns the number of
+ * exe() nodes.
+ */
+size_t parser_exe_bindings(
+    const struct parser *p,
+    struct parser_exe_binding *bindings,
+    size_t n);
+
+/**
+ * Write p to out as a flat, position-independent grammar image that
+ * parser_load_mmap can run in place. exe() handlers are not stored; they are
+ * bound again at load time in parser_exe_bindings order. Returns false if p
+ * contains a node that cannot be serialized or out could not be written.
+ */
+bool parser_serialize(const struct parser *p, FILE *out);
+
+/**
+ * Map a grammar image written by parser_serialize and return a grammar that
+ * runs directly from the mapping, so the file's pages are shared between
+ * every process that loads it. exes binds the image's exe() nodes and must
+ * have at least as many entries as the grammar had. Returns NULL if the file
+ * cannot be mapped or is not a valid image. Free the result with
+ * parser_free, which unmaps the file.
+ */
+struct parser *parser_load_mmap(
+    const char *path,
+    const struct parser_exe_binding *exes,
+    size_t num_exes);
+
+/**
+ * A reusable parse context. Running through a context keeps the output,
+ * handler log and string buffers between runs, so once a context has seen
+ * its largest input a run performs no allocation. The output pointer is owned
+ * by the context and stays valid until the next run.
+ */
+struct parse_context;
+
+struct parse_context *
+parse_context_new();
+
+void
+parse_context_free(struct parse_context *ctx);
+
+/**
+ * PARSE_ENGINE_RECURSIVE runs each node through its run function on the C
+ * stack. PARSE_ENGINE_ITERATIVE gives identical results but keeps one frame
+ * per active node on a heap stack owned by the context, so deeply nested
+ * grammars cannot overflow small thread stacks.
+ */
+enum parse_engine {
+  PARSE_ENGINE_RECURSIVE,
+  PARSE_ENGINE_ITERATIVE,
+};
+
+void
+parse_context_set_engine(struct parse_context *ctx, enum parse_engine mode);
+
+/**
+ * Eager handler mode. By default every exe() handler is deferred until the
+ * whole parse has matched, which means every matched string is kept until
+ * the end of the run. In eager mode a handler whose exe() is not inside a
+ * try() or until() is called as soon as its exe() matches and its string is
+ * dropped straight away. Guarantees:
+ *
+ * - Handlers are called in exactly the order deferred mode would call them;
+ *   handlers recorded inside a try() wait until the next eager call, cut() or
+ *   the end of the run.
+ * - A handler is never called for a match that is later rolled back.
+ * - Handlers may be called even though the parse as a whole later fails.
+ * - Once a handler returns false no further handler is called in that run.
+ */
+void
+parse_context_set_eager(struct parse_context *ctx, bool eager);
+
+bool
+parse_context_run(
+    struct parse_context *ctx,
+    const struct parser *p,
+    const char *input,
+    size_t len,
+    const char **output);
+
+/**
+ * Push-style parsing for input that arrives in pieces. Each feed appends to
+ * the session and parses as far as the data allows: NEED_MORE means the
+ * outcome depends on bytes not yet seen, MATCH and FAIL are final. finish
+ * marks the end of input and always settles the outcome. On MATCH the
+ * exe() handlers have run and the output can be read until the session is
+ * freed. Sessions run on the iterative engine and suspend in place when
+ * they run out of input, so each byte is parsed once. A top-level cut lets
+ * the session release everything before it, so a grammar such as
+ * many(and(record, cut)) runs in constant memory; the output is then only
+ * what was produced since the last such cut. Without top-level cuts the
+ * session holds all input fed to it until the outcome is settled.
+ */
+enum parse_status {
+  PARSE_NEED_MORE,
+  PARSE_MATCH,
+  PARSE_FAIL,
+};
+
+struct parser_session;
+
+struct parser_session *
+parser_session_new(const struct parser *p);
+
+void
+parser_session_free(struct parser_session *s);
+
+enum parse_status
+parser_session_feed(struct parser_session *s, const char *bytes, size_t n);
+
+enum parse_status
+parser_session_finish(struct parser_session *s);
+
+const char *
+parser_session_output(struct parser_session *s);
+
+/**
+ * Bytes of input the session is currently holding on to.
+ */
+size_t
+parser_session_buffered(struct parser_session *s);
+
+struct parse_input {
+  const char *input;
+  size_t len;
+};
+
+struct parse_result {
+  bool success;
+  size_t consumed;
+};
+
+/**
+ * Run p over n independent inputs using nthreads workers (0 means one per
+ * online CPU), writing one result per input. Each worker keeps its own parse
+ * context and idle workers steal from busy ones. Grammars are read-only while
+ * running, but exe() handlers are called from worker threads, so any state
+ * they share must be safe to touch concurrently. Returns the number of inputs
+ * that matched.
+ */
+size_t
+run_batch(
+    const struct parser *p,
+    const struct parse_input *inputs,
+    size_t n,
+    struct parse_result *results,
+    size_t nthreads);
+
+/**
+ * Parse a large separator-delimited input in parallel. The input is split
+ * into chunks that each end just after a sep character, and p is run over
+ * every chunk independently, so p must accept any whole number of records
+ * (typically many(record) followed by eof). exe() handlers are deferred
+ * until every chunk has matched and then run on the calling thread in input
+ * order; if any chunk fails no handler runs. result, if given, receives the
+ * input offset reached by the first failing chunk.
+ */
+bool
+run_chunked(
+    const struct parser *p,
+    const char *input,
+    size_t len,
+    char sep,
+    size_t nthreads,
+    struct parse_result *result);
+
+/**
+ * Speculative parallel parsing of a whole input as a repetition of record,
+ * for inputs with no reliable separator. Matches exactly what
+ * and(many(try(record)), eof) would, except that a record matching without
+ * consuming input ends the repetition. Workers start at guessed offsets and
+ * slide forward to the first offset where record matches; chunks whose
+ * guess turns out not to line up with the true record boundaries are
+ * re-parsed while stitching. record must not depend on anything but its
+ * start position, which holds for every grammar built from the combinators
+ * in this header. exe() handlers run on the calling thread in input order
+ * once the whole input has matched.
+ */
+bool
+run_speculative(
+    const struct parser *record,
+    const char *input,
+    size_t len,
+    size_t nthreads,
+    struct parse_result *result);
+
+/**
+ * run_chunked over a memory-mapped file. Returns false if the file cannot be
+ * mapped.
+ */
+bool
+run_chunked_file(
+    const struct parser *p,
+    const char *path,
+    char sep,
+    size_t nthreads,
+    struct parse_result *result);
+
 struct parser *
 parser_create_blank();
 
-#define null parser_create_null()
 struct parser *
 parser_create_null();
 
-#define eof parser_create_eof()
 struct parser *
 parser_create_eof();
 
-#define ch parser_create_char
+/**
+ * Commit point: no backtracking past here. Within a try() the try stops
+ * rolling back; at the top level pending exe() handlers run immediately, even
+ * if the parse later fails, and a session may drop input and output before
+ * the cut.
+ */
+struct parser *
+parser_create_cut();
+
 struct parser *
 parser_create_char(char c);
 
-#define str parser_create_str
+/**
+ * A token of the given kind, when parsing the output of a lexer (see
+ * lexer.h). On plain input, matches the byte kind.
+ */
+struct parser *
+parser_create_token(uint8_t kind);
+
 struct parser *
 parser_create_str(char *str);
 
-#define many parser_create_many
 struct parser *
 parser_create_many(struct parser *target);
 
-#define optional parser_create_optional
 struct parser *
 parser_create_optional(struct parser *target);
 
-#define try parser_create_try
 struct parser *
 parser_create_try(struct parser *target);
 
-#define until parser_create_until
 struct parser *
 parser_create_until(struct parser *target);
 
+struct parser *
+parser_create_or(struct parser *left, struct parser *right);
+
+struct parser *
+parser_create_and(struct parser *left, struct parser *right);
+
+/**
+ * open, then target, then close; the same as and(open, target, close).
+ */
+struct parser *
+parser_create_between(
+    struct parser *open,
+    struct parser *target,
+    struct parser *close);
+
+/**
+ * Native repetition. repeat(min, max, p) matches p as many times as it can,
+ * up to max (SIZE_MAX for no limit), and succeeds if that was at least min;
+ * count(n, p) matches p exactly n times and many1(p) at least once.
+ * sep_by(p, sep) matches zero or more p separated by sep, and
+ * sep_end_by(p, sep) also takes one sep after the last p.
+ *
+ * Each step runs as though inside a try(): a step that fails is rolled back
+ * and ends the repetition, so sep_by leaves a separator that is not followed
+ * by p unconsumed. A step that fails after passing a cut() fails the whole
+ * node instead. A step that matches without consuming input also ends the
+ * repetition, successfully, so unlike many() these never loop on a nullable
+ * target. Where a minimum count is known, output for it is reserved after
+ * the first step.
+ */
+struct parser *
+parser_create_repeat(size_t min, size_t max, struct parser *target);
+
+struct parser *
+parser_create_sep_by(struct parser *target, struct parser *sep);
+
+struct parser *
+parser_create_sep_end_by(struct parser *target, struct parser *sep);
+
+/**
+ * Lookahead predicates: peek(p) matches where p does and not(p) where it
+ * does not, both without consuming input. Whatever p did, output and
+ * pending exe() handlers included, is undone through a checkpoint, and a
+ * cut() inside p commits nothing. and(str("if"), not(ident_char)) matches
+ * the keyword but not the start of "iffy".
+ */
+struct parser *
+parser_create_peek(struct parser *target);
+
+struct parser *
+parser_create_not(struct parser *target);
+
+/**
+ * Packrat memoization point for parse_document_run: the result of target at
+ * each position is kept in the document and reused until an edit touches the
+ * input it looked at. Outside a document it just runs target.
+ */
+struct parser *
+parser_create_memo(struct parser *target);
+
+struct parser *
+parser_create_execute(
+    struct parser *target,
+    bool (*handle)(char *, void *),
+    void *extra);
+
+/**
+ * Operator precedence parsing. Parses atoms separated by binary operators in
+ * one left to right pass, without backtracking: after each atom the
+ * operators are tried in table order and the first to match is taken, and
+ * where no operator matches the expression ends. Higher precedences bind
+ * tighter. If open and close are given, an atom may also be an expression
+ * between them.
+ *
+ * Each operator's handler is called like an exe() handler, with the text the
+ * operator matched, once both of its operands have been parsed. Handlers
+ * therefore run in postfix order, after those of the atoms in its operands,
+ * so a result can be built with a stack: atoms push, operators pop two and
+ * push one. Pratt nodes take ownership of every parser passed to them.
+ */
+enum parse_assoc {
+  PARSE_ASSOC_LEFT,
+  PARSE_ASSOC_RIGHT,
+};
+
+struct parse_operator {
+  struct parser *op;
+  unsigned precedence;
+  enum parse_assoc assoc;
+  bool (*handle)(char *, void *);
+  void *extra;
+};
+
+struct parser *
+parser_create_pratt(
+    struct parser *atom,
+    struct parser *open,
+    struct parser *close,
+    const struct parse_operator *ops,
+    size_t num_ops);
+
+/* Short names for the combinators. They are C only, as they clash with C++
+ * keywords and the standard library; from C++, call the parser_create_*
+ * functions or build grammars with parse.hpp. */
+#ifndef __cplusplus
+
+#define blank parser_create_blank()
+#define null parser_create_null()
+#define eof parser_create_eof()
+#define cut parser_create_cut()
+#define ch parser_create_char
+#define tok parser_create_token
+#define str parser_create_str
+#define many parser_create_many
+#define optional parser_create_optional
+#define try parser_create_try
+#define until parser_create_until
+
 #define or8(p, ...) parser_create_or(p, or7(__VA_ARGS__))
 #define or7(p, ...) parser_create_or(p, or6(__VA_ARGS__))
 #define or6(p, ...) parser_create_or(p, or5(__VA_ARGS__))
@@ -58,8 +436,6 @@ parser_create_until(struct parser *target);
 #define or2(p, q) parser_create_or(p, q)
 #define or(...) \
     _NARGS_8(__VA_ARGS__, or8, or7, or6, or5, or4, or3, or2)(__VA_ARGS__)
-struct parser *
-parser_create_or(struct parser *left, struct parser *right);
 
 #define and8(p, ...) parser_create_and(p, and7(__VA_ARGS__))
 #define and7(p, ...) parser_create_and(p, and6(__VA_ARGS__))
@@ -70,12 +446,25 @@ parser_create_or(struct parser *left, struct parser *right);
 #define and2(p, q) parser_create_and(p, q)
 #define and(...) \
     _NARGS_8(__VA_ARGS__, and8, and7, and6, and5, and4, and3, and2)(__VA_ARGS__)
-struct parser *
-parser_create_and(struct parser *left, struct parser *right);
 
+#define between parser_create_between
+
+/* count and repeat are function-like so that variables of those names are
+ * left alone. */
+#define repeat(min, max, p) parser_create_repeat(min, max, p)
+#define count(n, p) parser_create_repeat(n, n, p)
+#define many1(p) parser_create_repeat(1, SIZE_MAX, p)
+
+#define sep_by parser_create_sep_by
+#define sep_end_by parser_create_sep_end_by
+#define peek parser_create_peek
+#define not parser_create_not
+#define memo parser_create_memo
 #define exe parser_create_execute
-struct parser *
-parser_create_execute(
-    struct parser *target,
-    bool (*handle)(char *, void *),
-    void *extra);
+#define pratt parser_create_pratt
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,344 @@
+#pragma once
+
+#include <cstddef>
+#include <string_view>
+#include <tuple>
+
+extern "C" {
+#include "state.h"
+}
+
+/**
+ * C++17 front end. Each combinator returns a small value whose type spells
+ * out the whole grammar, so a grammar has no nodes and no indirect calls at
+ * runtime: calling it on a parse_state runs code the compiler can inline
+ * into a single function. Every combinator behaves exactly like its C
+ * counterpart in parse.h, whose short names such as and and or are C only
+ * (C++ code can still call the parser_create_* functions), and grammars
+ * read and write an ordinary struct parse_state, so handlers, output and
+ * sessions' partial input work the same way.
+ *
+ *   auto digit = alt(ch('0'), ch('1'));
+ *   auto number = seq(digit, many(digit), eof());
+ *   parse::run(number, state, input, len);
+ *
+ * exe() handlers are stored inside the grammar value and the state keeps a
+ * pointer to them until they run, so a grammar must not be moved or
+ * destroyed between matching and state_execute.
+ */
+namespace parse {
+
+namespace detail {
+
+inline bool
+success_blank(parse_state &s)
+{
+  if (s.output == nullptr) {
+    state_output_reserve(&s, 0);
+    s.output[0] = '\0';
+  }
+  return true;
+}
+
+inline bool
+success(parse_state &s)
+{
+  if (s.output_len + 2 > s.output_cap) {
+    state_output_reserve(&s, 1);
+  }
+  s.output[s.output_len++] = s.input[s.pos++];
+  s.output[s.output_len] = '\0';
+  return true;
+}
+
+inline bool
+at_end(parse_state &s)
+{
+  if (s.pos >= s.input_len) {
+    s.starved |= s.partial;
+    return true;
+  }
+  return false;
+}
+
+} // namespace detail
+
+struct Blank {
+  bool operator()(parse_state &s) const { return detail::success_blank(s); }
+};
+
+struct Null {
+  bool operator()(parse_state &) const { return false; }
+};
+
+struct Eof {
+  bool
+  operator()(parse_state &s) const
+  {
+    if (s.pos == s.input_len) {
+      s.starved |= s.partial;
+      return detail::success_blank(s);
+    }
+    return false;
+  }
+};
+
+struct Cut {
+  bool
+  operator()(parse_state &s) const
+  {
+    s.cuts += 1;
+    if (s.backtrack_depth == 0) {
+      state_commit(&s);
+    }
+    return detail::success_blank(s);
+  }
+};
+
+struct Char {
+  char c;
+
+  bool
+  operator()(parse_state &s) const
+  {
+    if (detail::at_end(s) || s.input[s.pos] != c) {
+      return false;
+    }
+    return detail::success(s);
+  }
+};
+
+struct Str {
+  std::string_view literal;
+
+  bool
+  operator()(parse_state &s) const
+  {
+    for (char c : literal) {
+      if (detail::at_end(s)) {
+        return true;
+      }
+      if (s.input[s.pos] != c) {
+        return false;
+      }
+      detail::success(s);
+    }
+    return true;
+  }
+};
+
+template <class P>
+struct Many {
+  P target;
+
+  bool
+  operator()(parse_state &s) const
+  {
+    detail::success_blank(s);
+    while (target(s)) {
+    }
+    return true;
+  }
+};
+
+template <class P>
+struct Optional {
+  P target;
+
+  bool
+  operator()(parse_state &s) const
+  {
+    std::size_t pos = s.pos;
+    if (!target(s) && pos != s.pos) {
+      return false;
+    }
+    return detail::success_blank(s);
+  }
+};
+
+template <class P>
+struct Try {
+  P target;
+
+  bool
+  operator()(parse_state &s) const
+  {
+    parse_checkpoint cp;
+    std::size_t cuts = s.cuts;
+    state_checkpoint(&s, &cp);
+    s.backtrack_depth += 1;
+    bool matched = target(s);
+    s.backtrack_depth -= 1;
+    if (!matched && s.cuts == cuts) {
+      state_restore(&s, &cp);
+    }
+    s.cuts = cuts;
+    return matched;
+  }
+};
+
+template <class P>
+struct Until {
+  P target;
+
+  bool
+  operator()(parse_state &s) const
+  {
+    parse_checkpoint cp;
+    std::size_t cuts = s.cuts;
+    while (!state_finished(&s)) {
+      state_checkpoint(&s, &cp);
+      s.backtrack_depth += 1;
+      bool matched = target(s);
+      s.backtrack_depth -= 1;
+      s.cuts = cuts;
+      state_restore(&s, &cp);
+      if (matched) {
+        return true;
+      }
+      detail::success(s);
+    }
+    return detail::success_blank(s);
+  }
+};
+
+template <class... Ps>
+struct Seq {
+  std::tuple<Ps...> parsers;
+
+  bool
+  operator()(parse_state &s) const
+  {
+    return std::apply([&s](const Ps &...p) { return (p(s) && ...); },
+                      parsers);
+  }
+};
+
+template <class... Ps>
+struct Alt {
+  std::tuple<Ps...> parsers;
+
+  bool
+  operator()(parse_state &s) const
+  {
+    return std::apply([&s](const Ps &...p) { return (p(s) || ...); },
+                      parsers);
+  }
+};
+
+/**
+ * Shared by both forms of exe(): run the target and log the output it
+ * produced for handle(match, arg).
+ */
+template <class P>
+inline bool
+capture(const P &target, parse_state &s, bool (*handle)(char *, void *),
+        void *arg)
+{
+  std::size_t start = s.output_len;
+  s.capture_depth += 1;
+  bool matched = target(s);
+  s.capture_depth -= 1;
+  if (!matched) {
+    state_output_truncate(&s, start);
+    return false;
+  }
+  detail::success_blank(s);
+  state_add_handler_n(&s, handle, s.output + start, s.output_len - start, arg);
+  return true;
+}
+
+/**
+ * exe() with a C handler, as in parse.h.
+ */
+template <class P>
+struct Exe {
+  P target;
+  bool (*handle)(char *, void *);
+  void *extra;
+
+  bool
+  operator()(parse_state &s) const
+  {
+    return capture(target, s, handle, extra);
+  }
+};
+
+/**
+ * exe() with any callable taking the matched string as a char *.
+ */
+template <class P, class F>
+struct ExeFn {
+  P target;
+  F handle;
+
+  static bool
+  call(char *match, void *arg)
+  {
+    return (*static_cast<const F *>(arg))(match);
+  }
+
+  bool
+  operator()(parse_state &s) const
+  {
+    return capture(target, s, call, const_cast<F *>(&handle));
+  }
+};
+
+constexpr Blank blank() { return {}; }
+constexpr Null null() { return {}; }
+constexpr Eof eof() { return {}; }
+constexpr Cut cut() { return {}; }
+constexpr Char ch(char c) { return {c}; }
+constexpr Str str(std::string_view literal) { return {literal}; }
+
+template <class P>
+constexpr Many<P> many(P p) { return {p}; }
+
+template <class P>
+constexpr Optional<P> optional(P p) { return {p}; }
+
+template <class P>
+constexpr Try<P> try_(P p) { return {p}; }
+
+template <class P>
+constexpr Until<P> until(P p) { return {p}; }
+
+template <class... Ps>
+constexpr Seq<Ps...> seq(Ps... ps) { return {{ps...}}; }
+
+template <class... Ps>
+constexpr Alt<Ps...> alt(Ps... ps) { return {{ps...}}; }
+
+template <class P>
+constexpr Exe<P>
+exe(P p, bool (*handle)(char *, void *), void *extra)
+{
+  return {p, handle, extra};
+}
+
+template <class P, class F>
+constexpr ExeFn<P, F>
+exe(P p, F handle)
+{
+  return {p, handle};
+}
+
+/**
+ * The equivalent of parse_context_run: point state at input, match g and run
+ * the handlers if it matched.
+ */
+template <class G>
+bool
+run(const G &g, parse_state &state, const char *input, std::size_t len)
+{
+  state_reset(&state, input, len);
+  bool matched = g(state);
+  if (matched) {
+    state_execute(&state);
+    detail::success_blank(state);
+  }
+  return matched;
+}
+
+} // namespace parse
@@ -0,0 +1,328 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "parse.h"
+#include "roman.h"
+
+/**
+ * Benchmarks for the individual combinators and the Roman numeral grammars
+ * from the README. Small benchmarks parse a few bytes per operation and
+ * measure per-run overhead; the others parse BENCH_INPUT_LEN bytes of
+ * synthetic input and measure throughput.
+ */
+
+#define BENCH_INPUT_LEN (4 << 20)
+
+/**
+ * A buffer of len bytes repeating pattern, followed by tail.
+ */
+static char *
+fill(const char *pattern, size_t len, const char *tail)
+{
+  size_t n = strlen(pattern), tail_len = strlen(tail);
+  char *input = malloc(len + tail_len + 1);
+  for (size_t i = 0; i < len; i += 1) {
+    input[i] = pattern[i % n];
+  }
+  memcpy(input + len, tail, tail_len + 1);
+  return input;
+}
+
+/**
+ * Run p over input n times with one context, as a server handling many
+ * records would.
+ */
+static void
+bench_parse(struct bench *b, struct parser *p, const char *input)
+{
+  size_t len = strlen(input);
+  struct parse_context *ctx = parse_context_new();
+  bench_set_bytes(b, len);
+  bench_reset_timer(b);
+  for (size_t i = 0; i < b->n; i += 1) {
+    if (!parse_context_run(ctx, p, input, len, NULL)) {
+      abort();
+    }
+  }
+  bench_stop_timer(b);
+  parse_context_free(ctx);
+}
+
+static bool
+count_match(char *match, void *total)
+{
+  (void)match;
+  *(size_t *)total += 1;
+  return true;
+}
+
+new_bench(bench_char_small)
+{
+  struct parser *p = ch('a');
+  bench_parse(b, p, "a");
+  parser_free(p);
+}
+
+new_bench(bench_str_small)
+{
+  struct parser *p = and(str("hello"), eof);
+  bench_parse(b, p, "hello");
+  parser_free(p);
+}
+
+new_bench(bench_many_char)
+{
+  struct parser *p = and(many(ch('a')), eof);
+  char *input = fill("a", BENCH_INPUT_LEN, "");
+  bench_parse(b, p, input);
+  free(input);
+  parser_free(p);
+}
+
+new_bench(bench_many_str)
+{
+  struct parser *p = and(many(and(str("abcd"), ch('\n'))), eof);
+  char *input = fill("abcd\n", BENCH_INPUT_LEN, "");
+  bench_parse(b, p, input);
+  free(input);
+  parser_free(p);
+}
+
+new_bench(bench_until)
+{
+  struct parser *p = and(until(ch('!')), ch('!'), eof);
+  char *input = fill("a", BENCH_INPUT_LEN, "!");
+  bench_parse(b, p, input);
+  free(input);
+  parser_free(p);
+}
+
+new_bench(bench_try)
+{
+  // Every other "a" is read by the try, rolled back and read again.
+  struct parser *p = and(many(or(try(and(ch('a'), ch('b'))), ch('a'))), eof);
+  char *input = fill("aab", BENCH_INPUT_LEN - BENCH_INPUT_LEN % 3, "");
+  bench_parse(b, p, input);
+  free(input);
+  parser_free(p);
+}
+
+new_bench(bench_exe)
+{
+  size_t total = 0;
+  struct parser *p = and(many(exe(ch('a'), count_match, &total)), eof);
+  char *input = fill("a", BENCH_INPUT_LEN, "");
+  bench_parse(b, p, input);
+  free(input);
+  parser_free(p);
+}
+
+new_bench(bench_roman_simple_small)
+{
+  int total = 0;
+  struct parser *p = roman_numeral_basic(&total);
+  bench_parse(b, p, "XXVII");
+  parser_free(p);
+}
+
+new_bench(bench_roman_simple_large)
+{
+  int total = 0;
+  struct parser *p = roman_numeral_basic(&total);
+  char *input = fill("X", BENCH_INPUT_LEN, "VIII");
+  bench_parse(b, p, input);
+  free(input);
+  parser_free(p);
+}
+
+new_bench(bench_roman_small)
+{
+  size_t total = 0;
+  struct parser *p = roman_numeral(&total);
+  bench_parse(b, p, "MCMXCIV");
+  parser_free(p);
+}
+
+new_bench(bench_roman_large)
+{
+  size_t total = 0;
+  struct parser *p = roman_numeral(&total);
+  char *input = fill("M", BENCH_INPUT_LEN, "CMXCIV");
+  bench_parse(b, p, input);
+  free(input);
+  parser_free(p);
+}
+
+/**
+ * Statements that start with one of a few keywords, parsed on bytes and as
+ * tokens. The byte grammar re-reads each keyword in every alternative it
+ * tries; the token grammar compares one kind per alternative.
+ */
+enum { KW_LET = 1, KW_VAR, KW_CONST, KW_SEMI };
+
+static struct parser *
+keywords_bytes()
+{
+  return and(many(and(or(try(str("let")), try(str("var")), str("const")),
+                      ch(';'), ch('\n'))),
+             eof);
+}
+
+static struct parser *
+keywords_tokens()
+{
+  return and(many(and(or(tok(KW_LET), tok(KW_VAR), tok(KW_CONST)),
+                      tok(KW_SEMI))),
+             eof);
+}
+
+static struct parse_lexer *
+keywords_lexer()
+{
+  struct parse_lexer *lexer = parse_lexer_new();
+  parse_lexer_add(lexer, KW_LET, str("let"));
+  parse_lexer_add(lexer, KW_VAR, str("var"));
+  parse_lexer_add(lexer, KW_CONST, str("const"));
+  parse_lexer_add_class(lexer, KW_SEMI, ";");
+  parse_lexer_add_class(lexer, PARSE_TOKEN_SKIP, "\n");
+  return lexer;
+}
+
+new_bench(bench_keywords_bytes)
+{
+  struct parser *p = keywords_bytes();
+  size_t len = BENCH_INPUT_LEN - BENCH_INPUT_LEN % 17;
+  char *input = fill("const;\nvar;\nlet;\n", len, "");
+  bench_parse(b, p, input);
+  free(input);
+  parser_free(p);
+}
+
+/**
+ * Lexing and parsing together.
+ */
+new_bench(bench_keywords_tokens)
+{
+  struct parser *p = keywords_tokens();
+  struct parse_lexer *lexer = keywords_lexer();
+  struct parse_tokens *tokens = parse_tokens_new();
+  struct parse_context *ctx = parse_context_new();
+  size_t len = BENCH_INPUT_LEN - BENCH_INPUT_LEN % 17;
+  char *input = fill("const;\nvar;\nlet;\n", len, "");
+  bench_set_bytes(b, len);
+  bench_reset_timer(b);
+  for (size_t i = 0; i < b->n; i += 1) {
+    if (!parse_lexer_run(lexer, input, len, tokens) ||
+        !parse_context_run_tokens(ctx, p, tokens, NULL)) {
+      abort();
+    }
+  }
+  bench_stop_timer(b);
+  free(input);
+  parse_context_free(ctx);
+  parse_tokens_free(tokens);
+  parse_lexer_free(lexer);
+  parser_free(p);
+}
+
+/**
+ * Parsing alone, over tokens lexed once.
+ */
+new_bench(bench_keywords_tokens_parse)
+{
+  struct parser *p = keywords_tokens();
+  struct parse_lexer *lexer = keywords_lexer();
+  struct parse_tokens *tokens = parse_tokens_new();
+  struct parse_context *ctx = parse_context_new();
+  size_t len = BENCH_INPUT_LEN - BENCH_INPUT_LEN % 17;
+  char *input = fill("const;\nvar;\nlet;\n", len, "");
+  parse_lexer_run(lexer, input, len, tokens);
+  bench_set_bytes(b, len);
+  bench_reset_timer(b);
+  for (size_t i = 0; i < b->n; i += 1) {
+    if (!parse_context_run_tokens(ctx, p, tokens, NULL)) {
+      abort();
+    }
+  }
+  bench_stop_timer(b);
+  free(input);
+  parse_context_free(ctx);
+  parse_tokens_free(tokens);
+  parse_lexer_free(lexer);
+  parser_free(p);
+}
+
+static struct parser *
+digit()
+{
+  return or(or(ch('0'), ch('1'), ch('2'), ch('3'), ch('4')),
+            or(ch('5'), ch('6'), ch('7'), ch('8'), ch('9')));
+}
+
+/**
+ * Comma separated numbers, with sep_by and with the try() it replaces.
+ */
+new_bench(bench_sep_by_composed)
+{
+  struct parser *p = and(
+      and(many1(digit()),
+          many(try(and(ch(','), many1(digit()))))),
+      eof);
+  char *input = fill("1234,", BENCH_INPUT_LEN, "0");
+  bench_parse(b, p, input);
+  free(input);
+  parser_free(p);
+}
+
+new_bench(bench_sep_by_native)
+{
+  struct parser *p = and(sep_by(many1(digit()), ch(',')), eof);
+  char *input = fill("1234,", BENCH_INPUT_LEN, "0");
+  bench_parse(b, p, input);
+  free(input);
+  parser_free(p);
+}
+
+/**
+ * Fixed width records, with count and with the sequence it replaces.
+ */
+new_bench(bench_count_composed)
+{
+  struct parser *p = and(
+      many(and(digit(), digit(), digit(), digit(),
+               ch('\n'))),
+      eof);
+  char *input = fill("1234\n", BENCH_INPUT_LEN, "");
+  bench_parse(b, p, input);
+  free(input);
+  parser_free(p);
+}
+
+new_bench(bench_count_native)
+{
+  struct parser *p = and(many(and(count(4, digit()), ch('\n'))), eof);
+  char *input = fill("1234\n", BENCH_INPUT_LEN, "");
+  bench_parse(b, p, input);
+  free(input);
+  parser_free(p);
+}
+
+new_bench(bench_many1_composed)
+{
+  struct parser *p = and(ch('a'), many(ch('a')), eof);
+  char *input = fill("a", BENCH_INPUT_LEN, "");
+  bench_parse(b, p, input);
+  free(input);
+  parser_free(p);
+}
+
+new_bench(bench_many1_native)
+{
+  struct parser *p = and(many1(ch('a')), eof);
+  char *input = fill("a", BENCH_INPUT_LEN, "");
+  bench_parse(b, p, input);
+  free(input);
+  parser_free(p);
+}
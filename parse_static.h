@@ -0,0 +1,90 @@
+#pragma once
+
+#include "macros.h"
+#include "parse.h"
+#include "parser/parser_internal.h"
+
+/**
+ * Grammars as static const data. Each macro below expands to the address of
+ * a const compound literal laid out exactly like the node the matching
+ * parser_create_* function would allocate, so a grammar written with them
+ * at file scope is built by the compiler, lives in read-only memory and
+ * costs nothing at startup:
+ *
+ *   static const struct parser *digits =
+ *       static_and(static_ch('0'), static_many(static_ch('1')), static_eof);
+ *
+ * Such grammars run with run(), parse_context_run() and every other entry
+ * point that takes a finished grammar. They must never be passed to
+ * parser_free() or parser_compile(), and since block-scope compound
+ * literals are not static, they can only be written at file scope. exe()
+ * arguments must be addresses of static objects.
+ */
+
+#define PARSER_STATIC_HEAD(kind, run) {(run), NULL, (kind), 0}
+
+#define PARSER_STATIC(type, kind, run, ...)                              \
+  ((struct parser *)&((const struct type){                              \
+      PARSER_STATIC_HEAD(kind, run), __VA_ARGS__}).parser)
+
+#define PARSER_STATIC_LEAF(type, kind, run)                             \
+  ((struct parser *)&((const struct type){                              \
+      PARSER_STATIC_HEAD(kind, run)}).parser)
+
+#define static_blank \
+  PARSER_STATIC_LEAF(parser_blank, PARSER_BLANK, parser_run_blank)
+
+#define static_null \
+  PARSER_STATIC_LEAF(parser_null, PARSER_NULL, parser_run_null)
+
+#define static_eof \
+  PARSER_STATIC_LEAF(parser_eof, PARSER_EOF, parser_run_eof)
+
+#define static_cut \
+  PARSER_STATIC_LEAF(parser_cut, PARSER_CUT, parser_run_cut)
+
+#define static_ch(c) \
+  PARSER_STATIC(parser_char, PARSER_CHAR, parser_run_char, (c))
+
+#define static_str(s) \
+  PARSER_STATIC(parser_str, PARSER_STR, parser_run_str, (s))
+
+#define static_many(p) \
+  PARSER_STATIC(parser_many, PARSER_MANY, parser_run_many, (p))
+
+#define static_optional(p) \
+  PARSER_STATIC(parser_optional, PARSER_OPTIONAL, parser_run_optional, (p))
+
+#define static_try(p) \
+  PARSER_STATIC(parser_try, PARSER_TRY, parser_run_try, (p))
+
+#define static_until(p) \
+  PARSER_STATIC(parser_until, PARSER_UNTIL, parser_run_until, (p))
+
+#define static_exe(p, handle, extra)                                    \
+  PARSER_STATIC(parser_execute, PARSER_EXECUTE, parser_run_execute,     \
+                (p), (handle), (extra))
+
+#define static_or2(p, q) \
+  PARSER_STATIC(parser_or, PARSER_OR, parser_run_or, (p), (q))
+#define static_or3(p, ...) static_or2(p, static_or2(__VA_ARGS__))
+#define static_or4(p, ...) static_or2(p, static_or3(__VA_ARGS__))
+#define static_or5(p, ...) static_or2(p, static_or4(__VA_ARGS__))
+#define static_or6(p, ...) static_or2(p, static_or5(__VA_ARGS__))
+#define static_or7(p, ...) static_or2(p, static_or6(__VA_ARGS__))
+#define static_or8(p, ...) static_or2(p, static_or7(__VA_ARGS__))
+#define static_or(...)                                                  \
+  _NARGS_8(__VA_ARGS__, static_or8, static_or7, static_or6, static_or5, \
+           static_or4, static_or3, static_or2)(__VA_ARGS__)
+
+#define static_and2(p, q) \
+  PARSER_STATIC(parser_and, PARSER_AND, parser_run_and, (p), (q))
+#define static_and3(p, ...) static_and2(p, static_and2(__VA_ARGS__))
+#define static_and4(p, ...) static_and2(p, static_and3(__VA_ARGS__))
+#define static_and5(p, ...) static_and2(p, static_and4(__VA_ARGS__))
+#define static_and6(p, ...) static_and2(p, static_and5(__VA_ARGS__))
+#define static_and7(p, ...) static_and2(p, static_and6(__VA_ARGS__))
+#define static_and8(p, ...) static_and2(p, static_and7(__VA_ARGS__))
+#define static_and(...)                                                   \
+  _NARGS_8(__VA_ARGS__, static_and8, static_and7, static_and6,            \
+           static_and5, static_and4, static_and3, static_and2)(__VA_ARGS__)
@@ -1,19 +1,85 @@
+#include <pthread.h>
 #include <string.h>
+#include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include "assert.h"
 #include "error.h"
 #include "test.h"
 #include "parse.h"
+#include "parse_static.h"
 #include "log.h"
+#include "parser/engine.h"
+#include "parser/parser_internal.h"
+#include "roman.h"
+
+/*
+ * Checks that two runs, named who, left the same things behind.
+ */
+static struct error *
+check_runs_agree(const char *who, bool expected, struct parse_state *a,
+                 bool actual, struct parse_state *b)
+{
+  struct error *error = NULL;
+  if (expected != actual) {
+    error_to(error, "%s disagree on success: %d vs %d", who, expected, actual);
+  } else if (a->pos != b->pos) {
+    error_to(error, "%s disagree on position: %zu vs %zu", who, a->pos,
+             b->pos);
+  } else if (strcmp(a->output, b->output) != 0) {
+    error_to(error, "%s disagree on output: %s vs %s", who, a->output,
+             b->output);
+  } else if (a->num_outputs != b->num_outputs) {
+    error_to(error, "%s disagree on handler count: %zu vs %zu", who,
+             a->num_outputs, b->num_outputs);
+  }
+  for (size_t i = 0; error == NULL && i < a->num_outputs; i += 1) {
+    if (strcmp(state_handler_string(a, i), state_handler_string(b, i)) != 0) {
+      error_to(error, "%s disagree on handler %zu", who, i);
+    }
+  }
+  return error;
+}
+
+/*
+ * Runs p over input on both engines, without executing handlers, and checks
+ * that they agree on everything a run leaves behind.
+ */
+static struct error *
+check_engines_agree(const char *input, struct parser *p)
+{
+  struct parse_state recursive, iterative;
+  struct engine engine;
+  state_create(&recursive, input);
+  state_create(&iterative, input);
+  engine_create(&engine);
+
+  bool expected = parser_run(p, &recursive);
+  bool actual = engine_run(&engine, p, &iterative);
+  state_success_blank(&recursive);
+  state_success_blank(&iterative);
+  struct error *error =
+    check_runs_agree("Engines", expected, &recursive, actual, &iterative);
+
+  state_destroy(&recursive);
+  state_destroy(&iterative);
+  engine_destroy(&engine);
+  return error;
+}
 
 struct error*
 check_parse(const char *input, struct parser *p, const char *expected)
 {
+  struct error *error = check_engines_agree(input, p);
+  if (error != NULL) {
+    parser_free(p);
+    return error;
+  }
+
   char *output = NULL;
   bool success = run(p, input, &output);
-  struct error *error = NULL;
 
   if (!success && expected != NULL) {
     error_to(error, "Parser failed to match.");
@@ -187,170 +253,1692 @@ new_test(test_exe_fail)
   return NULL;
 }
 
+new_test(test_roman_numeral)
+{
+  int total = 0;
+  error_try(check_parse("XVII", roman_numeral_basic(&total), "XVII"));
+  error_try(assert_int_equal(17, total));
+  return NULL;
+}
+
+new_test(test_roman_numeral_2)
+{
+  int total = 0;
+  error_try(check_parse("XVII", roman_numeral_simple(&total), "XVII"));
+  error_try(assert_int_equal(17, total));
+  return NULL;
+}
+
+new_test(test_roman_numeral_3)
+{
+  size_t total = 0;
+  error_try(check_parse("XCII", roman_numeral(&total), "XCII"));
+  error_try(assert_int_equal(92, total));
+  return NULL;
+}
+
+new_test(test_roman_numeral_4)
+{
+  size_t total = 0;
+  error_try(check_parse("MDCCXCVII", roman_numeral(&total), "MDCCXCVII"));
+  error_try(assert_int_equal(1797, total));
+  return NULL;
+}
+
 static bool
-parsed_x(char *xs, void *total)
+capture_string(char *capture, void *dest)
 {
-  *(int *)total += 10 * strlen(xs);
+  // Gross
+  *((char **)dest) = malloc(strlen(capture) + 1);
+  strcpy(*((char **)dest), capture);
   return true;
 }
 
+static struct parser *
+delim_parser(char left, char right, char **inner)
+{
+  return and(ch(left),
+              exe(until(ch(right)),
+                  capture_string,
+                  inner),
+              ch(right));
+}
+
+new_test(test_delims)
+{
+  char *inner = NULL;
+  error_try(check_parse("{test}", delim_parser('{', '}', &inner), "{test}"));
+  error_try(assert_string_equal("test", inner));
+  return NULL;
+}
+
+new_test(test_context_reuse)
+{
+  struct parse_context *ctx = parse_context_new();
+  struct parser *p = and(many(ch('a')), eof);
+  const char *output = NULL;
+
+  error_try(assert(parse_context_run(ctx, p, "aaaa", 4, &output)));
+  error_try(assert_string_equal("aaaa", (char *)output));
+  error_try(assert(!parse_context_run(ctx, p, "aab", 3, &output)));
+  error_try(assert(parse_context_run(ctx, p, "aa", 2, &output)));
+  error_try(assert_string_equal("aa", (char *)output));
+
+  parser_free(p);
+  parse_context_free(ctx);
+  return NULL;
+}
+
+new_test(test_context_reuse_handlers)
+{
+  struct parse_context *ctx = parse_context_new();
+  size_t total = 0;
+  struct parser *p = roman_numeral(&total);
+  const char *output = NULL;
+
+  error_try(assert(parse_context_run(ctx, p, "XCII", 4, &output)));
+  error_try(assert_int_equal(92, total));
+  total = 0;
+  error_try(assert(parse_context_run(ctx, p, "MDCCXCVII", 9, &output)));
+  error_try(assert_string_equal("MDCCXCVII", (char *)output));
+  error_try(assert_int_equal(1797, total));
+
+  parser_free(p);
+  parse_context_free(ctx);
+  return NULL;
+}
+
 static bool
-parsed_v(char *vs, void *total)
+count_match(char *match, void *count)
 {
-  *(int *)total += 5 * strlen(vs);
+  (void)match;
+  __atomic_fetch_add((size_t *)count, 1, __ATOMIC_RELAXED);
   return true;
 }
 
+new_test(test_run_batch)
+{
+  size_t count = 0;
+  struct parser *p = and(exe(many(ch('a')), count_match, &count), eof);
+  struct parse_input inputs[1000];
+  struct parse_result results[1000];
+  for (size_t i = 0; i < 1000; i += 1) {
+    inputs[i].input = i % 3 == 0 ? "aab" : "aaaa";
+    inputs[i].len = i % 3 == 0 ? 3 : 4;
+  }
+
+  size_t matched = run_batch(p, inputs, 1000, results, 4);
+  error_try(assert_unsigned_equal(666, matched));
+  error_try(assert_unsigned_equal(666, count));
+  for (size_t i = 0; i < 1000; i += 1) {
+    error_try(assert(results[i].success == (i % 3 != 0)));
+    error_try(assert_unsigned_equal(i % 3 == 0 ? 2 : 4, results[i].consumed));
+  }
+
+  parser_free(p);
+  return NULL;
+}
+
+static struct parser *
+digit()
+{
+  return or(or(ch('0'), ch('1'), ch('2'), ch('3'), ch('4')),
+            or(ch('5'), ch('6'), ch('7'), ch('8'), ch('9')));
+}
+
 static bool
-parsed_i(char *is, void *total)
+check_sequence(char *number, void *next)
 {
-  *(int *)total += strlen(is);
+  if ((size_t)atol(number) != *(size_t *)next) {
+    return false;
+  }
+  *(size_t *)next += 1;
   return true;
 }
 
+static char *
+numbered_lines(size_t n)
+{
+  char *input = malloc(n * 7 + 1);
+  for (size_t i = 0; i < n; i += 1) {
+    sprintf(input + i * 7, "%06zu\n", i);
+  }
+  return input;
+}
+
+new_test(test_run_chunked_in_order)
+{
+  size_t next = 0;
+  struct parser *p = and(many(and(exe(many(digit()), check_sequence, &next),
+                                  ch('\n'))),
+                         eof);
+  char *input = numbered_lines(50000);
+  struct parse_result result;
+
+  error_try(assert(run_chunked(p, input, 50000 * 7, '\n', 4, &result)));
+  error_try(assert_unsigned_equal(50000, next));
+  error_try(assert_unsigned_equal(50000 * 7, result.consumed));
+
+  free(input);
+  parser_free(p);
+  return NULL;
+}
+
+new_test(test_run_chunked_failure)
+{
+  size_t next = 0;
+  struct parser *p = and(many(and(exe(many(digit()), check_sequence, &next),
+                                  ch('\n'))),
+                         eof);
+  char *input = numbered_lines(50000);
+  input[40000 * 7 + 3] = 'x';
+  struct parse_result result;
+
+  error_try(assert(!run_chunked(p, input, 50000 * 7, '\n', 4, &result)));
+  error_try(assert_unsigned_equal(0, next));
+  error_try(assert_unsigned_equal(40000 * 7 + 3, result.consumed));
+
+  // Empty input is still parsed.
+  struct parser *nonempty = and(ch('a'), many(ch('a')), eof);
+  error_try(assert(!run_chunked(nonempty, "", 0, '\n', 2, &result)));
+  error_try(assert_unsigned_equal(0, result.consumed));
+  error_try(assert(run_chunked(p, "", 0, '\n', 2, &result)));
+
+  parser_free(nonempty);
+  free(input);
+  parser_free(p);
+  return NULL;
+}
+
+struct record_check {
+  size_t *lengths;
+  size_t next;
+  bool in_order;
+};
+
 static bool
-parsed_iv(char *iv, void *total)
+check_record_length(char *record, void *check)
 {
-  (void)iv;
-  *(int *)total += 4;
+  struct record_check *c = check;
+  c->in_order = c->in_order && strlen(record) == c->lengths[c->next];
+  c->next += 1;
   return true;
 }
 
-new_test(test_roman_numeral)
+new_test(test_run_speculative)
 {
-  int total = 0;
-  error_try(check_parse("XVII", and(exe(many(ch('X')), parsed_x, &total),
-                                  exe(many(ch('V')), parsed_v, &total),
-                                  exe(many(ch('I')), parsed_i, &total),
-                                   eof), "XVII"));
-  error_try(assert_int_equal(17, total));
+  size_t n = 60000;
+  struct record_check check = {malloc(n * sizeof(size_t)), 0, true};
+  char *input = malloc(n * 6 + 1), *cur = input;
+  for (size_t i = 0; i < n; i += 1) {
+    check.lengths[i] = (i * 7) % 5 + 1;
+    memset(cur, 'a', check.lengths[i] - 1);
+    cur[check.lengths[i] - 1] = 'b';
+    cur += check.lengths[i];
+  }
+  struct parser *record = exe(and(many(ch('a')), ch('b')),
+                              check_record_length, &check);
+  struct parse_result result;
+
+  error_try(assert(run_speculative(record, input, cur - input, 4, &result)));
+  error_try(assert_unsigned_equal(cur - input, result.consumed));
+  error_try(assert_unsigned_equal(n, check.next));
+  error_try(assert(check.in_order));
+
+  free(check.lengths);
+  free(input);
+  parser_free(record);
   return NULL;
 }
 
-new_test(test_roman_numeral_2)
+/*
+ * Every chunk after the first starts on an odd offset, so every speculative
+ * parse is misaligned and must be re-parsed during stitching.
+ */
+new_test(test_run_speculative_misaligned)
 {
-  int total = 0;
+  size_t len = 400002, count = 0;
+  char *input = malloc(len);
+  memset(input, 'a', len);
+  struct parser *record = exe(and(ch('a'), ch('a')), count_match, &count);
+  struct parse_result result;
 
-  struct parser *parse_xs = exe(many(ch('X')), parsed_x, &total);
-  struct parser *parse_vs = exe(many(ch('V')), parsed_v, &total);
-  struct parser *parse_is = or(try(exe(str("IV"), parsed_iv, &total)),
-                       exe(many(ch('I')), parsed_i, &total));
-  struct parser *parse_roman = and(parse_xs, parse_vs, parse_is, eof);
+  error_try(assert(run_speculative(record, input, len, 4, &result)));
+  error_try(assert_unsigned_equal(len / 2, count));
 
-  error_try(check_parse("XVII", parse_roman, "XVII"));
-  error_try(assert_int_equal(17, total));
+  count = 0;
+  error_try(assert(!run_speculative(record, input, len - 1, 4, &result)));
+  error_try(assert_unsigned_equal(len - 2, result.consumed));
+  error_try(assert_unsigned_equal(0, count));
+
+  free(input);
+  parser_free(record);
   return NULL;
 }
 
-int
-value(char c)
+new_test(test_session_byte_by_byte)
 {
-  switch(c) {
-  case 'I':
-    return 1;
-  case 'V':
-    return 5;
-  case 'X':
-    return 10;
-  case 'L':
-    return 50;
-  case 'C':
-    return 100;
-  case 'D':
-    return 500;
-  case 'M':
-    return 1000;
-  default:
-    return -1;
+  size_t total = 0;
+  struct parser *p = roman_numeral(&total);
+  struct parser_session *s = parser_session_new(p);
+  const char *input = "MDCCXCVII";
+
+  for (const char *c = input; *c; c += 1) {
+    error_try(assert(parser_session_feed(s, c, 1) == PARSE_NEED_MORE));
   }
+  error_try(assert_int_equal(0, total));
+  error_try(assert(parser_session_finish(s) == PARSE_MATCH));
+  error_try(assert_int_equal(1797, total));
+  error_try(assert_string_equal("MDCCXCVII", (char *)parser_session_output(s)));
+
+  parser_session_free(s);
+  parser_free(p);
+  return NULL;
 }
 
-bool
-add_value(char *letter, void *total)
+new_test(test_session_early_outcome)
 {
-  *(size_t *)total += value(*letter);
-  return true;
+  struct parser *p = and(ch('a'), str("bc"));
+  struct parser_session *s = parser_session_new(p);
+  error_try(assert(parser_session_feed(s, "ab", 2) == PARSE_NEED_MORE));
+  error_try(assert(parser_session_feed(s, "cdef", 4) == PARSE_MATCH));
+  error_try(assert_string_equal("abc", (char *)parser_session_output(s)));
+  parser_session_free(s);
+
+  s = parser_session_new(p);
+  error_try(assert(parser_session_feed(s, "ax", 2) == PARSE_FAIL));
+  error_try(assert(parser_session_finish(s) == PARSE_FAIL));
+  error_try(assert_null((void *)parser_session_output(s)));
+  parser_session_free(s);
+
+  parser_free(p);
+  return NULL;
 }
 
-bool
-sub_value(char *letter, void *total)
+static struct parser *
+nested_and(size_t depth)
+{
+  struct parser *p = ch('a');
+  for (size_t i = 1; i < depth; i += 1) {
+    p = and(ch('a'), p);
+  }
+  return p;
+}
+
+new_test(test_iterative_engine_deep_grammar)
+{
+  size_t depth = 1000000;
+  char *input = malloc(depth + 1);
+  memset(input, 'a', depth);
+  input[depth] = '\0';
+  struct parser *p = nested_and(depth);
+  struct parse_context *ctx = parse_context_new();
+  parse_context_set_engine(ctx, PARSE_ENGINE_ITERATIVE);
+  const char *output = NULL;
+
+  error_try(assert(parse_context_run(ctx, p, input, depth, &output)));
+  error_try(assert_unsigned_equal(depth, strlen(output)));
+  error_try(assert(!parse_context_run(ctx, p, input, depth - 1, &output)));
+
+  parse_context_free(ctx);
+  parser_free(p);
+  free(input);
+  return NULL;
+}
+
+new_test(test_iterative_engine_context_reuse)
+{
+  size_t total = 0;
+  struct parser *p = roman_numeral(&total);
+  struct parse_context *ctx = parse_context_new();
+  parse_context_set_engine(ctx, PARSE_ENGINE_ITERATIVE);
+  const char *output = NULL;
+
+  error_try(assert(parse_context_run(ctx, p, "MDCCXCVII", 9, &output)));
+  error_try(assert_int_equal(1797, total));
+  total = 0;
+  error_try(assert(parse_context_run(ctx, p, "XCII", 4, &output)));
+  error_try(assert_int_equal(92, total));
+  error_try(assert(!parse_context_run(ctx, p, "IIX", 3, &output)));
+
+  parse_context_free(ctx);
+  parser_free(p);
+  return NULL;
+}
+
+new_test(test_session_suspends_in_str)
+{
+  struct parser *p = and(until(str("end")), str("end"), eof);
+  struct parser_session *s = parser_session_new(p);
+  error_try(assert(parser_session_feed(s, "abce", 4) == PARSE_NEED_MORE));
+  error_try(assert(parser_session_feed(s, "n", 1) == PARSE_NEED_MORE));
+  error_try(assert(parser_session_feed(s, "d", 1) == PARSE_NEED_MORE));
+  error_try(assert(parser_session_finish(s) == PARSE_MATCH));
+  error_try(assert_string_equal("abcend", (char *)parser_session_output(s)));
+  parser_session_free(s);
+  parser_free(p);
+  return NULL;
+}
+
+new_test(test_cut_commits_try)
+{
+  error_try(check_parse("ac", or(try(and(ch('a'), ch('b'))), str("ac")), "ac"));
+  return check_parse("ac", or(try(and(ch('a'), cut, ch('b'))), str("ac")), NULL);
+}
+
+new_test(test_cut_is_scoped_to_innermost_try)
+{
+  return check_parse("ac",
+                     or(try(and(try(and(ch('a'), cut)), ch('b'))), str("ac")),
+                     "ac");
+}
+
+new_test(test_cut_flushes_handlers)
+{
+  size_t count = 0;
+  char *output = NULL;
+  struct parser *p = and(many(and(exe(ch('a'), count_match, &count), cut)),
+                         ch('b'));
+  error_try(assert(!run(p, "aaac", &output)));
+  error_try(assert_unsigned_equal(3, count));
+
+  count = 0;
+  struct parse_context *ctx = parse_context_new();
+  parse_context_set_engine(ctx, PARSE_ENGINE_ITERATIVE);
+  error_try(assert(parse_context_run(ctx, p, "aab", 3, NULL)));
+  error_try(assert_unsigned_equal(2, count));
+  parse_context_free(ctx);
+
+  parser_free(p);
+  return NULL;
+}
+
+new_test(test_session_cut_bounds_memory)
+{
+  size_t count = 0;
+  struct parser *record = and(exe(many(digit()), count_match, &count),
+                              ch('\n'));
+  struct parser *p = and(many(and(try(record), cut)), eof);
+  struct parser_session *s = parser_session_new(p);
+  char *input = numbered_lines(10000);
+
+  for (size_t i = 0; i < 10000 * 7; i += 5) {
+    size_t n = 10000 * 7 - i < 5 ? 10000 * 7 - i : 5;
+    error_try(assert(parser_session_feed(s, input + i, n) == PARSE_NEED_MORE));
+    error_try(assert(parser_session_buffered(s) < 16));
+  }
+  error_try(assert(parser_session_finish(s) == PARSE_MATCH));
+  error_try(assert_unsigned_equal(10000, count));
+  error_try(assert_string_equal("", (char *)parser_session_output(s)));
+
+  free(input);
+  parser_session_free(s);
+  parser_free(p);
+  return NULL;
+}
+
+static bool
+append_letter(char *match, void *log)
 {
-  *(size_t *)total -= value(*letter);
+  strcat((char *)log, match);
   return true;
 }
 
-struct parser *
-pair(char a, char b, void *total)
+static struct parser *
+ordered_handlers(char *log)
 {
-  return and(exe(ch(a), sub_value, total),
-             exe(ch(b), add_value, total));
+  struct parser *a = exe(ch('a'), append_letter, log);
+  struct parser *b = exe(ch('b'), append_letter, log);
+  struct parser *c = exe(ch('c'), append_letter, log);
+  struct parser *bs = exe(and(b, many(exe(ch('b'), append_letter, log))),
+                          append_letter, log);
+  return and(many(or(try(and(a, ch('x'))), and(bs, optional(c)))), eof);
 }
 
-struct parser *
-single(char a, size_t *total)
+new_test(test_eager_handlers_keep_order)
 {
-  return optional(many(exe(ch(a), add_value, total)));
+  const char *inputs[] = {"ax", "bbc", "axbcaxb", "axaxbbbc"};
+  for (int engine = 0; engine < 2; engine += 1) {
+    struct parse_context *ctx = parse_context_new();
+    parse_context_set_engine(ctx, engine);
+    for (size_t i = 0; i < 4; i += 1) {
+      char deferred[64] = "", eager[64] = "";
+      struct parser *p = ordered_handlers(deferred);
+      struct parser *q = ordered_handlers(eager);
+      size_t len = strlen(inputs[i]);
+      parse_context_set_eager(ctx, false);
+      error_try(assert(parse_context_run(ctx, p, inputs[i], len, NULL)));
+      parse_context_set_eager(ctx, true);
+      error_try(assert(parse_context_run(ctx, q, inputs[i], len, NULL)));
+      error_try(assert_string_equal(deferred, eager));
+      parser_free(p);
+      parser_free(q);
+    }
+    parse_context_free(ctx);
+  }
+  return NULL;
 }
 
-struct parser *
-roman_numeral(size_t *total)
+new_test(test_eager_handlers_run_before_failure)
 {
-  struct parser *parse_m = single('M', total);
-  struct parser *parse_d = single('D', total);
-  struct parser *parse_c = or(try(pair('C', 'M', total)),
-                      try(pair('C', 'D', total)),
-                      single('C', total));
-  struct parser *parse_l = single('L', total);
-  struct parser *parse_x = or(try(pair('X', 'C', total)),
-                      try(pair('X', 'L', total)),
-                      single('X', total));
-  struct parser *parse_v = single('V', total);
-  struct parser *parse_i = or(try(pair('I', 'X', total)),
-                      try(pair('I', 'V', total)),
-                      single('I', total));
-  return and(parse_m, parse_d, parse_c, parse_l, parse_x,
-              parse_v, parse_i, eof);
+  size_t count = 0;
+  struct parser *p = and(exe(ch('a'), count_match, &count), ch('b'));
+  struct parse_context *ctx = parse_context_new();
+
+  error_try(assert(!parse_context_run(ctx, p, "ac", 2, NULL)));
+  error_try(assert_unsigned_equal(0, count));
+  parse_context_set_eager(ctx, true);
+  error_try(assert(!parse_context_run(ctx, p, "ac", 2, NULL)));
+  error_try(assert_unsigned_equal(1, count));
+
+  parse_context_free(ctx);
+  parser_free(p);
+  return NULL;
 }
 
-new_test(test_roman_numeral_3)
+new_test(test_eager_handlers_skip_rolled_back_matches)
+{
+  size_t count = 0;
+  struct parser *p = or(try(and(exe(ch('a'), count_match, &count), ch('b'))),
+                        str("ac"));
+  struct parse_context *ctx = parse_context_new();
+  parse_context_set_eager(ctx, true);
+
+  error_try(assert(parse_context_run(ctx, p, "ac", 2, NULL)));
+  error_try(assert_unsigned_equal(0, count));
+  error_try(assert(parse_context_run(ctx, p, "ab", 2, NULL)));
+  error_try(assert_unsigned_equal(1, count));
+
+  parse_context_free(ctx);
+  parser_free(p);
+  return NULL;
+}
+
+/*
+ * A small random grammar over the letters a and b, built the same way every
+ * time for the same seed.
+ */
+static struct parser *
+random_grammar(unsigned *seed, int depth)
+{
+  *seed = *seed * 1103515245 + 12345;
+  unsigned r = (*seed >> 16) % (depth > 0 ? 10 : 6);
+  switch (r) {
+  case 0: return blank;
+  case 1: return null;
+  case 2: return eof;
+  case 3: return ch('a');
+  case 4: return ch('b');
+  case 5: return str(*seed & 0x100 ? "ab" : "ba");
+  case 6: return many(random_grammar(seed, depth - 1));
+  case 7: return optional(random_grammar(seed, depth - 1));
+  case 8: {
+    struct parser *first = random_grammar(seed, depth - 1);
+    return or(first, random_grammar(seed, depth - 1));
+  }
+  default: {
+    struct parser *first = random_grammar(seed, depth - 1);
+    return and(first, random_grammar(seed, depth - 1));
+  }
+  }
+}
+
+new_test(test_compile_matches_interpreter)
+{
+  char input[8];
+  size_t compiled = 0;
+  for (unsigned grammar = 0; grammar < 1000; grammar += 1) {
+    unsigned seed = grammar, copy = grammar;
+    struct parser *p = random_grammar(&seed, 4);
+    struct parser *q = parser_compile(random_grammar(&copy, 4));
+    if (q->kind != PARSER_DFA) {
+      // Uncompiled parts may loop forever in the interpreter too.
+      parser_free(p);
+      parser_free(q);
+      continue;
+    }
+    compiled += 1;
+
+    // Every string over a, b and c of up to five letters.
+    for (size_t len = 0; len <= 5; len += 1) {
+      size_t count = 1;
+      for (size_t i = 0; i < len; i += 1) {
+        count *= 3;
+      }
+      for (size_t n = 0; n < count; n += 1) {
+        for (size_t i = 0, m = n; i < len; i += 1, m /= 3) {
+          input[i] = "abc"[m % 3];
+        }
+        input[len] = '\0';
+
+        struct parse_state expected, actual;
+        state_create(&expected, input);
+        state_create(&actual, input);
+        bool matched = parser_run(p, &expected);
+        error_try(assert(matched == parser_run(q, &actual)));
+        error_try(assert_unsigned_equal(expected.pos, actual.pos));
+        error_try(assert_string_equal(expected.output ? expected.output : "",
+                                      actual.output));
+        state_destroy(&expected);
+        state_destroy(&actual);
+      }
+    }
+    parser_free(p);
+    parser_free(q);
+  }
+  error_try(assert(compiled > 200));
+  return NULL;
+}
+
+new_test(test_compile_keeps_handlers)
+{
+  int total = 0;
+  struct parser *p = parser_compile(roman_numeral_simple(&total));
+
+  struct parser_and *top = (struct parser_and *)p;
+  struct parser_execute *xs = (struct parser_execute *)top->first;
+  error_try(assert(p->kind == PARSER_AND));
+  error_try(assert(xs->target->kind == PARSER_DFA));
+  error_try(check_parse("XXVII", p, "XXVII"));
+  error_try(assert_int_equal(27, total));
+  return NULL;
+}
+
+new_test(test_compile_skips_empty_loops)
+{
+  struct parser *p = parser_compile(and(many(optional(ch('a'))), ch('b')));
+  struct parser_and *top = (struct parser_and *)p;
+  error_try(assert(top->first->kind == PARSER_MANY));
+  parser_free(p);
+  return NULL;
+}
+
+static size_t static_records;
+
+/*
+ * The same grammar as a static const tree and built at runtime.
+ */
+static const struct parser *static_grammar = static_and(
+    static_many(static_or(static_try(static_and(static_ch('a'),
+                                                static_str("b"))),
+                          static_exe(static_ch('c'), count_match,
+                                     &static_records))),
+    static_optional(static_until(static_ch(';'))),
+    static_ch(';'),
+    static_eof);
+
+static struct parser *
+dynamic_grammar(size_t *count)
+{
+  return and(many(or(try(and(ch('a'), str("b"))),
+                     exe(ch('c'), count_match, count))),
+             optional(until(ch(';'))),
+             ch(';'),
+             eof);
+}
+
+new_test(test_static_grammar)
+{
+  const char *inputs[] = {";", "abcab;", "abx;", "cc;", "ab", "a;", "acd;"};
+  size_t count = 0;
+  struct parser *p = dynamic_grammar(&count);
+  struct parse_context *ctx = parse_context_new();
+  for (size_t i = 0; i < sizeof(inputs) / sizeof(inputs[0]); i += 1) {
+    error_try(check_engines_agree(inputs[i], (struct parser *)static_grammar));
+    const char *expected = NULL, *actual = NULL;
+    size_t len = strlen(inputs[i]);
+    static_records = count = 0;
+    bool matched = parse_context_run(ctx, p, inputs[i], len, &expected);
+    char *copy = matched ? strdup(expected) : NULL;
+    error_try(assert(matched == parse_context_run(ctx, static_grammar,
+                                                  inputs[i], len, &actual)));
+    if (matched) {
+      error_try(assert_string_equal(copy, (char *)actual));
+    }
+    error_try(assert_unsigned_equal(count, static_records));
+    free(copy);
+  }
+  parse_context_free(ctx);
+  parser_free(p);
+  return NULL;
+}
+
+/*
+ * Serializes p to a temporary file and loads it back, bound to the
+ * handlers of q.
+ */
+static struct parser *
+reload(const struct parser *p, const struct parser *q, char *path)
+{
+  struct parser_exe_binding exes[64];
+  strcpy(path, "/tmp/parse_test_XXXXXX");
+  int fd = mkstemp(path);
+  FILE *out = fdopen(fd, "w");
+  bool written = parser_serialize(p, out);
+  fclose(out);
+  size_t n = parser_exe_bindings(q, exes, 64);
+  return written ? parser_load_mmap(path, exes, n) : NULL;
+}
+
+new_test(test_serialize_roman_numeral)
+{
+  const char *inputs[] = {"MDCCXCVII", "XCII", "IIX", "", "MMXXIV", "CDXC"};
+  size_t expected = 0, actual = 0;
+  char path[32];
+  struct parser *p = roman_numeral(&expected);
+  struct parser *q = roman_numeral(&actual);
+  struct parser *loaded = reload(p, q, path);
+  struct parse_context *ctx = parse_context_new();
+  error_try(assert_not_null(loaded));
+
+  for (size_t i = 0; i < sizeof(inputs) / sizeof(inputs[0]); i += 1) {
+    size_t len = strlen(inputs[i]);
+    expected = actual = 0;
+    error_try(check_engines_agree(inputs[i], loaded));
+    bool matched = parse_context_run(ctx, p, inputs[i], len, NULL);
+    error_try(assert(matched == parse_context_run(ctx, loaded, inputs[i], len,
+                                                  NULL)));
+    error_try(assert_unsigned_equal(expected, actual));
+  }
+
+  unlink(path);
+  parse_context_free(ctx);
+  parser_free(p);
+  parser_free(q);
+  parser_free(loaded);
+  return NULL;
+}
+
+new_test(test_serialize_compiled)
+{
+  char path[32], input[8];
+  for (unsigned grammar = 0; grammar < 200; grammar += 1) {
+    unsigned seed = grammar;
+    struct parser *p = parser_compile(random_grammar(&seed, 4));
+    if (p->kind != PARSER_DFA) {
+      parser_free(p);
+      continue;
+    }
+    struct parser *loaded = reload(p, p, path);
+    error_try(assert_not_null(loaded));
+    for (size_t n = 0; n < 81; n += 1) {
+      for (size_t i = 0, m = n; i < 4; i += 1, m /= 3) {
+        input[i] = "abc"[m % 3];
+      }
+      input[4] = '\0';
+      struct parse_state expected, actual;
+      state_create(&expected, input);
+      state_create(&actual, input);
+      bool matched = parser_run(p, &expected);
+      error_try(assert(matched == parser_run(loaded, &actual)));
+      error_try(assert_unsigned_equal(expected.pos, actual.pos));
+      state_destroy(&expected);
+      state_destroy(&actual);
+    }
+    unlink(path);
+    parser_free(p);
+    parser_free(loaded);
+  }
+  return NULL;
+}
+
+/*
+ * A random grammar over a and b using every kind an image can hold, with
+ * handlers counting into handled. Loop bodies always consume, so the tree
+ * interpreter terminates.
+ */
+static struct parser *
+random_image_grammar(unsigned *seed, int depth, size_t *handled)
+{
+  *seed = *seed * 1103515245 + 12345;
+  unsigned bits = *seed >> 16;
+  unsigned r = bits % (depth > 0 ? 20 : 8);
+  struct parser *body = NULL;
+  if (r == 8 || r == 17 || r == 18) {
+    struct parser *first = bits & 0x1000 ? ch('a') : ch('b');
+    body = and(first, random_image_grammar(seed, depth - 1, handled));
+  }
+  switch (r) {
+  case 0: return blank;
+  case 1: return null;
+  case 2: return eof;
+  case 3: return cut;
+  case 4: return ch('a');
+  case 5: return ch('b');
+  case 6: return tok('a');
+  case 7: return str(bits & 0x100 ? "ab" : "ba");
+  case 8: return many(body);
+  case 9:
+    return optional(random_image_grammar(seed, depth - 1, handled));
+  case 10: return try(random_image_grammar(seed, depth - 1, handled));
+  case 11: return until(random_image_grammar(seed, depth - 1, handled));
+  case 12: {
+    struct parser *first = random_image_grammar(seed, depth - 1, handled);
+    return or(first, random_image_grammar(seed, depth - 1, handled));
+  }
+  case 13: {
+    struct parser *first = random_image_grammar(seed, depth - 1, handled);
+    return and(first, random_image_grammar(seed, depth - 1, handled));
+  }
+  case 14:
+    return exe(random_image_grammar(seed, depth - 1, handled), count_match,
+               handled);
+  case 15:
+    return parser_compile(random_image_grammar(seed, depth - 1, handled));
+  case 16: return memo(random_image_grammar(seed, depth - 1, handled));
+  case 17: {
+    size_t min = bits % 3;
+    return repeat(min, bits & 0x100 ? SIZE_MAX : min + bits / 3 % 3, body);
+  }
+  case 18: {
+    struct parser *sep = random_image_grammar(seed, depth - 1, handled);
+    return bits & 0x100 ? sep_end_by(body, sep) : sep_by(body, sep);
+  }
+  default: {
+    struct parser *target = random_image_grammar(seed, depth - 1, handled);
+    return bits & 0x100 ? not(target) : peek(target);
+  }
+  }
+}
+
+/*
+ * The set of kinds used anywhere in p, one bit per kind.
+ */
+static size_t
+grammar_kinds(const struct parser *p)
+{
+  struct parser *children[2];
+  size_t kinds = 1u << p->kind;
+  size_t n = parser_children(p, children);
+  for (size_t i = 0; i < n; i += 1) {
+    kinds |= grammar_kinds(children[i]);
+  }
+  return kinds;
+}
+
+new_test(test_image_matches_tree)
+{
+  char path[32], input[8];
+  size_t kinds = 0, handled = 0;
+  for (unsigned grammar = 0; grammar < 500; grammar += 1) {
+    unsigned seed = grammar;
+    struct parser *p = random_image_grammar(&seed, 4, &handled);
+    struct parser *loaded = reload(p, p, path);
+    error_try(assert_not_null(loaded));
+    kinds |= grammar_kinds(p);
+
+    // Every string over a and b of up to four letters.
+    for (size_t len = 0; len <= 4; len += 1) {
+      for (size_t n = 0; n < (size_t)1 << len; n += 1) {
+        for (size_t i = 0; i < len; i += 1) {
+          input[i] = "ab"[n >> i & 1];
+        }
+        input[len] = '\0';
+        struct parse_state expected, actual;
+        state_create(&expected, input);
+        state_create(&actual, input);
+        // Cuts run handlers early, so both runs must run the same ones.
+        handled = 0;
+        bool matched = parser_run(p, &expected);
+        size_t tree_handled = handled;
+        handled = 0;
+        bool loaded_matched = parser_run(loaded, &actual);
+        state_success_blank(&expected);
+        state_success_blank(&actual);
+        struct error *error = check_runs_agree("Tree and image", matched,
+                                               &expected, loaded_matched,
+                                               &actual);
+        state_destroy(&expected);
+        state_destroy(&actual);
+        error_try(error);
+        error_try(assert_unsigned_equal(tree_handled, handled));
+        error_try(check_engines_agree(input, p));
+        error_try(check_engines_agree(input, loaded));
+      }
+    }
+    unlink(path);
+    parser_free(p);
+    parser_free(loaded);
+  }
+  // Every kind an image can hold came up at least once.
+  for (enum parser_kind kind = PARSER_BLANK; kind <= PARSER_LOOKAHEAD;
+       kind += 1) {
+    if (kind != PARSER_PRATT) {
+      error_try(assert(kinds & 1u << kind));
+    }
+  }
+  return NULL;
+}
+
+new_test(test_load_rejects_bad_images)
+{
+  char path[32];
+  struct parser *p = and(many(ch('a')), str("bc"), eof);
+  struct parser *loaded = reload(p, p, path);
+  error_try(assert_not_null(loaded));
+  parser_free(loaded);
+
+  // Every truncation of a valid image is rejected.
+  FILE *in = fopen(path, "r");
+  char image[256];
+  size_t len = fread(image, 1, sizeof(image), in);
+  fclose(in);
+  for (size_t cut_len = 0; cut_len < len; cut_len += 1) {
+    FILE *out = fopen(path, "w");
+    fwrite(image, 1, cut_len, out);
+    fclose(out);
+    error_try(assert_null(parser_load_mmap(path, NULL, 0)));
+  }
+
+  // So is a child pointing back at its parent.
+  image[20 + 4] = 0;
+  FILE *out = fopen(path, "w");
+  fwrite(image, 1, len, out);
+  fclose(out);
+  error_try(assert_null(parser_load_mmap(path, NULL, 0)));
+
+  unlink(path);
+  error_try(assert_null(parser_load_mmap(path, NULL, 0)));
+  parser_free(p);
+  return NULL;
+}
+
+static void *
+metrics_worker(void *p)
+{
+  struct parse_context *ctx = parse_context_new();
+  for (int i = 0; i < 100; i += 1) {
+    parse_context_run(ctx, p, "XIV", 3, NULL);
+  }
+  parse_context_free(ctx);
+  return NULL;
+}
+
+new_test(test_metrics)
 {
   size_t total = 0;
-  error_try(check_parse("XCII", roman_numeral(&total), "XCII"));
-  error_try(assert_int_equal(92, total));
+  struct parser *p = roman_numeral(&total);
+  struct parse_context *ctx = parse_context_new();
+  struct parse_metrics before, after;
+  char *output;
+  parse_metrics_enable(true);
+  parse_metrics_snapshot(&before);
+
+  // One thread's runs, one run() and a thread that has exited by the time
+  // of the snapshot.
+  error_try(assert(parse_context_run(ctx, p, "MCMXCIV", 7, NULL)));
+  error_try(assert(!parse_context_run(ctx, p, "IIX", 3, NULL)));
+  error_try(assert(run(p, "XLII", &output)));
+  free(output);
+  pthread_t thread;
+  pthread_create(&thread, NULL, metrics_worker, p);
+  pthread_join(thread, NULL);
+  parse_metrics_enable(false);
+  error_try(assert(parse_context_run(ctx, p, "MCMXCIV", 7, NULL)));
+  parse_metrics_snapshot(&after);
+
+  error_try(assert_unsigned_equal(103, after.runs - before.runs));
+  error_try(assert_unsigned_equal(102, after.matched - before.matched));
+  error_try(assert_unsigned_equal(1, after.failed - before.failed));
+  error_try(assert_unsigned_equal(7 + 3 + 4 + 300, after.bytes - before.bytes));
+  // "CM", "XC" and "IV" each make the tries for the pairs before them
+  // rewind, and so does every "XIV".
+  error_try(assert(after.backtracks - before.backtracks >= 100));
+  uint64_t latencies = 0;
+  for (size_t i = 0; i < PARSE_METRICS_BUCKETS; i += 1) {
+    latencies += after.latency[i] - before.latency[i];
+    if (i > 0) {
+      error_try(assert(parse_metrics_bucket_limit(i) >
+                       parse_metrics_bucket_limit(i - 1)));
+    }
+  }
+  error_try(assert_unsigned_equal(103, latencies));
+  error_try(assert(parse_metrics_percentile(&after, 0.5) <=
+                   parse_metrics_percentile(&after, 0.99)));
+  error_try(assert(parse_metrics_percentile(&after, 0.5) > 0));
+
+  char buf[4096];
+  FILE *out = fmemopen(buf, sizeof(buf), "w");
+  error_try(assert(parse_metrics_write(&after, out)));
+  fclose(out);
+  error_try(assert(strstr(buf, "parse_run_latency_seconds{quantile=\"0.99\"}")));
+
+  // Nearest rank over one run in each of buckets 10, 20 and 30.
+  struct parse_metrics known;
+  memset(&known, 0, sizeof(known));
+  known.latency[10] = known.latency[20] = known.latency[30] = 1;
+  error_try(assert_unsigned_equal(parse_metrics_bucket_limit(10),
+                                  parse_metrics_percentile(&known, 0)));
+  error_try(assert_unsigned_equal(parse_metrics_bucket_limit(10),
+                                  parse_metrics_percentile(&known, 1.0 / 3)));
+  error_try(assert_unsigned_equal(parse_metrics_bucket_limit(20),
+                                  parse_metrics_percentile(&known, 0.5)));
+  error_try(assert_unsigned_equal(parse_metrics_bucket_limit(30),
+                                  parse_metrics_percentile(&known, 0.9)));
+  error_try(assert_unsigned_equal(parse_metrics_bucket_limit(30),
+                                  parse_metrics_percentile(&known, 1)));
+
+  parse_context_free(ctx);
+  parser_free(p);
   return NULL;
 }
 
-new_test(test_roman_numeral_4)
+static void *
+cache_worker(void *arg)
+{
+  void **args = arg;
+  struct parse_context *ctx = parse_context_new();
+  parse_context_set_cache(ctx, args[1]);
+  for (int i = 0; i < 1000; i += 1) {
+    parse_context_run(ctx, args[0], i % 2 ? "XXI" : "XX", i % 2 ? 3 : 2, NULL);
+  }
+  parse_context_free(ctx);
+  return NULL;
+}
+
+new_test(test_result_cache)
 {
   size_t total = 0;
-  error_try(check_parse("MDCCXCVII", roman_numeral(&total), "MDCCXCVII"));
-  error_try(assert_int_equal(1797, total));
+  struct parser *p = roman_numeral(&total);
+  struct parse_cache *cache = parse_cache_new(2, 16);
+  struct parse_context *ctx = parse_context_new();
+  struct parse_cache_stats stats;
+  const char *output;
+  parse_context_set_cache(ctx, cache);
+
+  // A hit replays the handlers and restores the output.
+  for (int i = 1; i <= 3; i += 1) {
+    error_try(assert(parse_context_run(ctx, p, "XIV", 3, &output)));
+    error_try(assert_string_equal("XIV", (char *)output));
+    error_try(assert_unsigned_equal(14 * i, total));
+  }
+  error_try(assert(!parse_context_run(ctx, p, "IIX", 3, NULL)));
+  error_try(assert(!parse_context_run(ctx, p, "IIX", 3, NULL)));
+  parse_cache_stats(cache, &stats);
+  error_try(assert_unsigned_equal(3, stats.hits));
+  error_try(assert_unsigned_equal(2, stats.misses));
+
+  // Both entries have been hit, so the hand clears both and comes round to
+  // evict "XIV"; "VI" is then the older and unreferenced.
+  error_try(assert(parse_context_run(ctx, p, "VI", 2, NULL)));
+  error_try(assert(!parse_context_run(ctx, p, "IIX", 3, NULL)));
+  error_try(assert(parse_context_run(ctx, p, "XIV", 3, NULL)));
+  parse_cache_stats(cache, &stats);
+  error_try(assert_unsigned_equal(4, stats.hits));
+  error_try(assert_unsigned_equal(2, stats.evictions));
+  error_try(assert_unsigned_equal(2, stats.entries));
+
+  // Long inputs and runs that commit early are not cached.
+  struct parser *committing = and(ch('a'), cut, ch('b'));
+  for (int i = 0; i < 2; i += 1) {
+    error_try(assert(parse_context_run(ctx, committing, "ab", 2, NULL)));
+    error_try(assert(parse_context_run(ctx, p, "MMMMMMMMMMMMMMMMM", 17, NULL)));
+  }
+  parse_cache_stats(cache, &stats);
+  error_try(assert_unsigned_equal(4, stats.hits));
+
+  // A grammar freed and another allocated, likely at the same address, do
+  // not share entries.
+  struct parser *first = ch('a');
+  error_try(assert(parse_context_run(ctx, first, "a", 1, NULL)));
+  parser_free(first);
+  struct parser *second = ch('b');
+  error_try(assert(!parse_context_run(ctx, second, "a", 1, NULL)));
+  parser_free(second);
+  parse_cache_stats(cache, &stats);
+  error_try(assert_unsigned_equal(4, stats.hits));
+  parse_context_free(ctx);
+
+  // Threads sharing a cache.
+  struct parser *plain = and(many(ch('X')), many(ch('I')), eof);
+  void *args[2] = {plain, cache};
+  pthread_t threads[4];
+  for (int t = 0; t < 4; t += 1) {
+    pthread_create(&threads[t], NULL, cache_worker, args);
+  }
+  for (int t = 0; t < 4; t += 1) {
+    pthread_join(threads[t], NULL);
+  }
+  struct parse_cache_stats after;
+  parse_cache_stats(cache, &after);
+  error_try(assert_unsigned_equal(4000, after.hits + after.misses -
+                                  stats.hits - stats.misses));
+  error_try(assert(after.hits - stats.hits >= 3990));
+  parser_free(plain);
+
+  parse_cache_free(cache);
+  parser_free(committing);
+  parser_free(p);
   return NULL;
 }
 
 static bool
-capture_string(char *capture, void *dest)
+add_length(char *match, void *total)
 {
-  // Gross
-  *((char **)dest) = malloc(strlen(capture) + 1);
-  strcpy(*((char **)dest), capture);
+  *(size_t *)total += strlen(match);
+  return true;
+}
+
+/*
+ * Runs p over the document's text with doc and afresh, and checks that both
+ * agree on the result, the output and what the handlers saw.
+ */
+static struct error *
+check_document(struct parse_document *doc, struct parse_context *ctx,
+               struct parser *p, size_t *total, bool expected)
+{
+  size_t len;
+  const char *text = parse_document_text(doc, &len);
+  const char *output;
+  struct parse_context *fresh = parse_context_new();
+  *total = 0;
+  bool matched = parse_context_run(fresh, p, text, len, &output);
+  size_t fresh_total = *total;
+  char *fresh_output = strdup(matched ? output : "");
+
+  *total = 0;
+  error_try(assert(matched == expected));
+  error_try(assert(parse_document_run(doc, ctx, p, &output) == matched));
+  error_try(assert_unsigned_equal(fresh_total, *total));
+  if (matched) {
+    error_try(assert_string_equal(fresh_output, (char *)output));
+  }
+  free(fresh_output);
+  parse_context_free(fresh);
+  return NULL;
+}
+
+new_test(test_incremental_reparse)
+{
+  size_t total = 0;
+  struct parser *item = memo(and(exe(and(ch('a'), many(ch('b'))),
+                                     add_length, &total),
+                                 ch(';')));
+  struct parser *line = memo(and(many(item), ch('\n')));
+  struct parser *p = and(many(try(line)), eof);
+
+  char text[100 * 13 + 1] = "";
+  for (int i = 0; i < 100; i += 1) {
+    strcat(text, "ab;abb;abbb;\n");
+  }
+
+  for (int mode = 0; mode < 2; mode += 1) {
+    struct parse_context *ctx = parse_context_new();
+    struct parse_document *doc = parse_document_new(text, strlen(text));
+    struct parse_document_stats before, stats;
+    parse_context_set_engine(ctx, mode ? PARSE_ENGINE_ITERATIVE
+                                       : PARSE_ENGINE_RECURSIVE);
+    error_try(check_document(doc, ctx, p, &total, true));
+    error_try(assert_unsigned_equal(900, total));
+    parse_document_stats(doc, &before);
+    error_try(assert_unsigned_equal(0, before.hits));
+
+    // Running again reuses every line.
+    error_try(check_document(doc, ctx, p, &total, true));
+    parse_document_stats(doc, &stats);
+    error_try(assert_unsigned_equal(before.misses, stats.misses));
+    error_try(assert_unsigned_equal(101, stats.hits));
+
+    // Lengthening the second item of line 50 invalidates only that item and
+    // that line; the rest are replayed, those after the edit moved along.
+    error_try(assert(parse_document_edit(doc, 50 * 13 + 4, 50 * 13 + 4,
+                                         "b", 1)));
+    parse_document_stats(doc, &before);
+    error_try(assert_unsigned_equal(2, before.invalidated));
+    error_try(check_document(doc, ctx, p, &total, true));
+    error_try(assert_unsigned_equal(901, total));
+    parse_document_stats(doc, &stats);
+    error_try(assert_unsigned_equal(2, stats.misses - before.misses));
+    error_try(assert_unsigned_equal(103, stats.hits - before.hits));
+    error_try(assert_unsigned_equal(before.entries + 2, stats.entries));
+
+    // Breaking and then repairing a line, and appending one.
+    error_try(assert(parse_document_edit(doc, 10 * 13, 10 * 13 + 1, "x", 1)));
+    error_try(check_document(doc, ctx, p, &total, false));
+    error_try(assert(parse_document_edit(doc, 10 * 13, 10 * 13 + 1, "a", 1)));
+    error_try(check_document(doc, ctx, p, &total, true));
+    size_t len;
+    parse_document_text(doc, &len);
+    error_try(assert(parse_document_edit(doc, len, len, "abbbbb;\n", 8)));
+    error_try(check_document(doc, ctx, p, &total, true));
+    error_try(assert_unsigned_equal(907, total));
+    error_try(assert(parse_document_edit(doc, 0, 13 * 2, "", 0)));
+    error_try(check_document(doc, ctx, p, &total, true));
+    error_try(assert_unsigned_equal(889, total));
+    error_try(assert(!parse_document_edit(doc, 5, 4, "", 0)));
+
+    parse_document_free(doc);
+    parse_context_free(ctx);
+  }
+  parser_free(p);
+
+  // A grammar freed and another allocated, likely at the same address, do
+  // not share entries.
+  struct parse_context *ctx = parse_context_new();
+  struct parse_document *doc = parse_document_new("a", 1);
+  struct parse_document_stats stats;
+  struct parser *first = memo(ch('a'));
+  error_try(assert(parse_document_run(doc, ctx, first, NULL)));
+  parser_free(first);
+  struct parser *second = memo(ch('b'));
+  error_try(assert(!parse_document_run(doc, ctx, second, NULL)));
+  parser_free(second);
+  parse_document_stats(doc, &stats);
+  error_try(assert_unsigned_equal(0, stats.hits));
+  parse_document_free(doc);
+  parse_context_free(ctx);
+  return NULL;
+}
+
+enum { TOK_LET = 1, TOK_IDENT, TOK_NUM, TOK_EQ, TOK_SEMI };
+
+static bool
+add_number(char *number, void *total)
+{
+  *(size_t *)total += atol(number);
   return true;
 }
 
+new_test(test_lexer_tokens)
+{
+  struct parse_lexer *lexer = parse_lexer_new();
+  parse_lexer_add(lexer, TOK_LET, and(ch('l'), ch('e'), ch('t')));
+  parse_lexer_add_class(lexer, TOK_IDENT, "abcdefghijklmnopqrstuvwxyz");
+  parse_lexer_add_class(lexer, TOK_NUM, "0123456789");
+  parse_lexer_add(lexer, TOK_EQ, ch('='));
+  parse_lexer_add_class(lexer, TOK_SEMI, ";");
+  // Compiles to a DFA that fails before reading anything.
+  parse_lexer_add(lexer, TOK_NUM, and(null, ch('l')));
+  error_try(assert(parse_lexer_add_class(lexer, PARSE_TOKEN_SKIP, " \n")));
+  // Kinds that do not fit in a byte are rejected.
+  error_try(assert(!parse_lexer_add(lexer, 256, ch('x'))));
+  error_try(assert(!parse_lexer_add_class(lexer, -2, "x")));
+
+  // "let" ties with an identifier and goes to the earlier rule; "letter" is
+  // longer as an identifier.
+  const char *input = "let x = 42;\nlet letter = 7;";
+  struct parse_tokens *tokens = parse_tokens_new();
+  error_try(assert(parse_lexer_run(lexer, input, strlen(input), tokens)));
+  error_try(assert_unsigned_equal(10, tokens->len));
+  const char kinds[] = {TOK_LET, TOK_IDENT, TOK_EQ, TOK_NUM, TOK_SEMI,
+                        TOK_LET, TOK_IDENT, TOK_EQ, TOK_NUM, TOK_SEMI};
+  error_try(assert(memcmp(kinds, tokens->kinds, 10) == 0));
+  error_try(assert_unsigned_equal(16, tokens->tokens[6].offset));
+  error_try(assert_unsigned_equal(6, tokens->tokens[6].len));
+
+  size_t total = 0;
+  struct parser *stmt = and(tok(TOK_LET), tok(TOK_IDENT), tok(TOK_EQ),
+                            exe(tok(TOK_NUM), add_number, &total),
+                            tok(TOK_SEMI));
+  struct parser *p = and(many(try(stmt)), eof);
+  for (int mode = 0; mode < 2; mode += 1) {
+    struct parse_context *ctx = parse_context_new();
+    const char *output;
+    parse_context_set_engine(ctx, mode ? PARSE_ENGINE_ITERATIVE
+                                       : PARSE_ENGINE_RECURSIVE);
+    total = 0;
+    error_try(assert(parse_context_run_tokens(ctx, p, tokens, &output)));
+    error_try(assert_string_equal("letx=42;letletter=7;", (char *)output));
+    error_try(assert_unsigned_equal(49, total));
+    parse_context_free(ctx);
+  }
+
+  struct parse_context *ctx = parse_context_new();
+  input = "let = 4;";
+  error_try(assert(parse_lexer_run(lexer, input, strlen(input), tokens)));
+  error_try(assert(!parse_context_run_tokens(ctx, p, tokens, NULL)));
+  input = "let x = 4#;";
+  error_try(assert(!parse_lexer_run(lexer, input, strlen(input), tokens)));
+  error_try(assert_unsigned_equal(9, tokens->end));
+
+  // Texts with the same token kinds are not confused by a cache.
+  struct parse_cache *cache = parse_cache_new(4, 16);
+  struct parser *ident = and(tok(TOK_IDENT), eof);
+  const char *output;
+  parse_context_set_cache(ctx, cache);
+  error_try(assert(parse_lexer_run(lexer, "foo", 3, tokens)));
+  error_try(assert(parse_context_run_tokens(ctx, ident, tokens, &output)));
+  error_try(assert_string_equal("foo", (char *)output));
+  error_try(assert(parse_lexer_run(lexer, "bar", 3, tokens)));
+  error_try(assert(parse_context_run_tokens(ctx, ident, tokens, &output)));
+  error_try(assert_string_equal("bar", (char *)output));
+  parse_context_free(ctx);
+  parse_cache_free(cache);
+  parser_free(ident);
+
+  parser_free(p);
+  parse_tokens_free(tokens);
+  parse_lexer_free(lexer);
+  return NULL;
+}
+
+struct eval_stack {
+  long values[64];
+  size_t len;
+};
+
+static bool
+eval_push(char *number, void *stack)
+{
+  struct eval_stack *s = stack;
+  s->values[s->len++] = atol(number);
+  return true;
+}
+
+static bool
+eval_apply(char *op, void *stack)
+{
+  struct eval_stack *s = stack;
+  long b = s->values[--s->len], a = s->values[s->len - 1], r = 1;
+  switch (*op) {
+  case '+': r = a + b; break;
+  case '-': r = a - b; break;
+  case '*': r = a * b; break;
+  case '^': for (long i = 0; i < b; i += 1) r *= a; break;
+  }
+  s->values[s->len - 1] = r;
+  return true;
+}
+
+new_test(test_pratt_expressions)
+{
+  static struct eval_stack stack;
+  struct parse_operator ops[] = {
+    {ch('+'), 1, PARSE_ASSOC_LEFT, eval_apply, &stack},
+    {ch('-'), 1, PARSE_ASSOC_LEFT, eval_apply, &stack},
+    {ch('*'), 2, PARSE_ASSOC_LEFT, eval_apply, &stack},
+    {ch('^'), 3, PARSE_ASSOC_RIGHT, eval_apply, &stack},
+  };
+  struct parser *number = and(digit(), many(digit()));
+  struct parser *p = and(pratt(exe(number, eval_push, &stack),
+                               ch('('), ch(')'), ops, 4),
+                         eof);
+
+  const char *inputs[] = {
+    "1+2*3", "2*3+4", "10-4-3", "2^3^2", "(1+2)*3", "2*((3+4)*5)", "((7))",
+  };
+  long values[] = {7, 10, 3, 512, 9, 70, 7};
+  for (int mode = 0; mode < 2; mode += 1) {
+    struct parse_context *ctx = parse_context_new();
+    const char *output;
+    parse_context_set_engine(ctx, mode ? PARSE_ENGINE_ITERATIVE
+                                       : PARSE_ENGINE_RECURSIVE);
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i += 1) {
+      stack.len = 0;
+      error_try(assert(parse_context_run(ctx, p, inputs[i], strlen(inputs[i]),
+                                         &output)));
+      error_try(assert_string_equal((char *)inputs[i], (char *)output));
+      error_try(assert_unsigned_equal(1, stack.len));
+      error_try(assert_unsigned_equal(values[i], stack.values[0]));
+    }
+    error_try(assert(!parse_context_run(ctx, p, "1+", 2, NULL)));
+    error_try(assert(!parse_context_run(ctx, p, "(1+2", 4, NULL)));
+    error_try(assert(!parse_context_run(ctx, p, "1+2)", 4, NULL)));
+    parse_context_free(ctx);
+  }
+
+  // A long chain is one pass over the input.
+  struct parse_context *ctx = parse_context_new();
+  size_t n = 100000;
+  char *input = malloc(2 * n);
+  for (size_t i = 0; i < n; i += 1) {
+    input[2 * i] = '1';
+    input[2 * i + 1] = i + 1 < n ? '+' : '\0';
+  }
+  stack.len = 0;
+  error_try(assert(parse_context_run(ctx, p, input, 2 * n - 1, NULL)));
+  error_try(assert_unsigned_equal(n, stack.values[0]));
+  parse_context_free(ctx);
+  free(input);
+  parser_free(p);
+  return NULL;
+}
+
+new_test(test_repeat_counts)
+{
+  error_try(check_parse("aaaa", count(3, ch('a')), "aaa"));
+  error_try(check_parse("aa", count(3, ch('a')), NULL));
+  error_try(check_parse("aaaa", repeat(2, 3, ch('a')), "aaa"));
+  error_try(check_parse("ab", repeat(2, 3, ch('a')), NULL));
+  error_try(check_parse("aab", many1(ch('a')), "aa"));
+  error_try(check_parse("b", many1(ch('a')), NULL));
+  // A step that fails part way is rolled back.
+  error_try(check_parse("ababa",
+                        and(many1(and(ch('a'), ch('b'))), ch('a'), eof),
+                        "ababa"));
+  error_try(check_parse("ababa", count(2, and(ch('a'), ch('b'))), "abab"));
+  // A nullable target does not loop.
+  error_try(check_parse("aa", and(many1(optional(ch('a'))), eof), "aa"));
+  return check_parse("", count(2, blank), "");
+}
+
+new_test(test_sep_by_items)
+{
+  error_try(check_parse("1,22,333",
+                        and(sep_by(many1(digit()), ch(',')), eof),
+                        "1,22,333"));
+  error_try(check_parse("", and(sep_by(ch('a'), ch(',')), eof), ""));
+  // A trailing separator is left for what follows, unless sep_end_by.
+  error_try(check_parse("a,a,", and(sep_by(ch('a'), ch(',')), ch(','), eof),
+                        "a,a,"));
+  error_try(check_parse("a,a,", and(sep_end_by(ch('a'), ch(',')), eof),
+                        "a,a,"));
+  error_try(check_parse("[1,2]",
+                        between(ch('['), sep_by(digit(), ch(',')), ch(']')),
+                        "[1,2]"));
+  // A cut() in an item commits it.
+  error_try(check_parse("ab,c",
+                        and(sep_by(and(ch('a'), cut, ch('b')), ch(',')),
+                            str(",c")),
+                        "ab,c"));
+  return check_parse("ab,a",
+                     and(sep_by(and(ch('a'), cut, ch('b')), ch(',')),
+                         str(",a")),
+                     NULL);
+}
+
+new_test(test_repetition_images)
+{
+  const char *inputs[] = {"[1,22]", "[]", "[1,]", "[1,2,3]", "[12345]"};
+  char path[32];
+  struct parser *p = and(
+      between(ch('['), sep_end_by(repeat(1, 4, digit()), ch(',')), ch(']')),
+      eof);
+  struct parser *loaded = reload(p, p, path);
+  error_try(assert_not_null(loaded));
+  for (size_t i = 0; i < sizeof(inputs) / sizeof(inputs[0]); i += 1) {
+    struct parse_state expected, actual;
+    state_create(&expected, inputs[i]);
+    state_create(&actual, inputs[i]);
+    bool matched = parser_run(p, &expected);
+    error_try(assert(matched == (i < 4)));
+    error_try(assert(matched == parser_run(loaded, &actual)));
+    error_try(assert_unsigned_equal(expected.pos, actual.pos));
+    state_destroy(&expected);
+    state_destroy(&actual);
+  }
+  unlink(path);
+  parser_free(loaded);
+  parser_free(p);
+
+  // Steps that pass a cut() commit as they finish, so a session can drop
+  // what came before.
+  size_t count = 0;
+  struct parser *record = and(exe(many1(digit()), count_match, &count),
+                              ch('\n'), cut);
+  p = and(many1(record), eof);
+  struct parser_session *s = parser_session_new(p);
+  char *input = numbered_lines(1000);
+  for (size_t i = 0; i < 1000 * 7; i += 5) {
+    error_try(assert(parser_session_feed(s, input + i, 5) == PARSE_NEED_MORE));
+    error_try(assert(parser_session_buffered(s) < 16));
+  }
+  error_try(assert(parser_session_finish(s) == PARSE_MATCH));
+  error_try(assert_unsigned_equal(1000, count));
+  free(input);
+  parser_session_free(s);
+  parser_free(p);
+  return NULL;
+}
+
 static struct parser *
-delim_parser(char left, char right, char **inner)
+ident_char()
 {
-  return and(ch(left),
-              exe(until(ch(right)),
-                  capture_string,
-                  inner),
-              ch(right));
+  return or(or(ch('a'), ch('f'), ch('i'), ch('y')), digit());
 }
 
-new_test(test_delims)
+new_test(test_lookahead)
 {
-  char *inner = NULL;
-  error_try(check_parse("{test}", delim_parser('{', '}', &inner), "{test}"));
-  error_try(assert_string_equal("test", inner));
+  error_try(check_parse("if x", and(str("if"), not(ident_char())), "if"));
+  error_try(check_parse("iffy", and(str("if"), not(ident_char())), NULL));
+  error_try(check_parse("if", and(str("if"), not(ident_char()), eof), "if"));
+  error_try(check_parse("ab", and(peek(str("ab")), ch('a')), "a"));
+  error_try(check_parse("ac", and(peek(str("ab")), ch('a')), NULL));
+  // Nothing the predicate matched is kept.
+  size_t count = 0;
+  struct parser *p = and(peek(exe(and(ch('a'), cut), count_match, &count)),
+                         not(and(ch('a'), cut, ch('c'))),
+                         ch('a'));
+  char *output = NULL;
+  error_try(assert(run(p, "ab", &output)));
+  error_try(assert_string_equal("a", output));
+  error_try(assert_unsigned_equal(0, count));
+  free(output);
+
+  char path[32];
+  struct parser *loaded = reload(p, p, path);
+  error_try(assert_not_null(loaded));
+  struct parse_state state;
+  state_create(&state, "ab");
+  error_try(assert(parser_run(loaded, &state)));
+  error_try(assert_unsigned_equal(1, state.pos));
+  error_try(assert_unsigned_equal(0, state.num_outputs));
+  state_destroy(&state);
+  unlink(path);
+  parser_free(loaded);
+  return check_parse("ab", p, "a");
+}
+
+struct counting_allocator {
+  size_t allocations;
+  size_t frees;
+};
+
+static void *
+counting_malloc(void *ctx, size_t size)
+{
+  ((struct counting_allocator *)ctx)->allocations += 1;
+  return malloc(size);
+}
+
+static void *
+counting_realloc(void *ctx, void *p, size_t size)
+{
+  ((struct counting_allocator *)ctx)->allocations += 1;
+  return realloc(p, size);
+}
+
+static void
+counting_free(void *ctx, void *p)
+{
+  ((struct counting_allocator *)ctx)->frees += 1;
+  free(p);
+}
+
+new_test(test_allocator)
+{
+  static struct counting_allocator counts;
+  struct parse_allocator allocator = {
+    counting_malloc, counting_realloc, counting_free, &counts,
+  };
+  struct parse_alloc_stats before, stats;
+  parse_set_allocator(&allocator);
+  parse_alloc_stats(&before);
+
+  size_t total = 0;
+  struct parser *p = roman_numeral(&total);
+  struct parse_context *ctx = parse_context_new();
+  error_try(assert(parse_context_run(ctx, p, "MMMDCCCLXXXVIII", 15, NULL)));
+
+  // Once its buffers have grown, a context parses without allocating.
+  parse_alloc_stats(&stats);
+  size_t allocations = stats.allocations;
+  for (int i = 0; i < 10; i += 1) {
+    error_try(assert(parse_context_run(ctx, p, "MCMXCIV", 7, NULL)));
+  }
+  parse_alloc_stats(&stats);
+  error_try(assert_unsigned_equal(allocations, stats.allocations));
+  error_try(assert(stats.peak_bytes >= stats.live_bytes));
+  error_try(assert(stats.live_bytes > before.live_bytes));
+
+  parse_context_free(ctx);
+  parser_free(p);
+  parse_set_allocator(NULL);
+
+  // Everything went through the allocator and was given back.
+  parse_alloc_stats(&stats);
+  error_try(assert_unsigned_equal(counts.allocations,
+                                  stats.allocations - before.allocations));
+  error_try(assert_unsigned_equal(counts.frees, stats.frees - before.frees));
+  error_try(assert_unsigned_equal(before.live_bytes, stats.live_bytes));
+  return NULL;
+}
+
+new_test(test_perf_counters)
+{
+  // Hardware counters are often unavailable (virtual machines, containers,
+  // perf_event_paranoid), in which case there is nothing to measure.
+  struct parse_perf *perf = parse_perf_open();
+  if (perf == NULL) {
+    return NULL;
+  }
+  size_t total = 0, runs;
+  struct parser *p = roman_numeral(&total);
+  struct parse_context *ctx = parse_context_new();
+  parse_context_set_perf(ctx, perf);
+#ifdef PARSER_PROFILE
+  struct parse_profile *profile = parse_profile_new();
+  parse_profile_set_perf(profile, perf);
+  parse_context_set_profile(ctx, profile);
+#endif
+  for (int i = 0; i < 100; i += 1) {
+    error_try(assert(parse_context_run(ctx, p, "MCMXCIV", 7, NULL)));
+  }
+  const struct parse_perf_counts *sum = parse_perf_total(perf, &runs);
+  const struct parse_perf_counts *last = parse_perf_last_run(perf);
+  error_try(assert_unsigned_equal(100, runs));
+  for (size_t i = 0; i < PARSE_PERF_COUNTERS; i += 1) {
+    error_try(assert(last->values[i] <= sum->values[i]));
+  }
+  if (parse_perf_available(perf, PARSE_PERF_INSTRUCTIONS)) {
+    error_try(assert(last->values[PARSE_PERF_INSTRUCTIONS] > 0));
+#ifdef PARSER_PROFILE
+    // The root's counts include all of its descendants'.
+    const struct parse_node_stats *root = parse_profile_node(profile, p);
+    struct parser *children[2];
+    size_t n = parser_children(p, children);
+    for (size_t k = 0; k < n; k += 1) {
+      const struct parse_node_stats *child =
+        parse_profile_node(profile, children[k]);
+      error_try(assert(child->perf.values[PARSE_PERF_INSTRUCTIONS] <=
+                       root->perf.values[PARSE_PERF_INSTRUCTIONS]));
+    }
+    error_try(assert(root->perf.values[PARSE_PERF_INSTRUCTIONS] <=
+                     sum->values[PARSE_PERF_INSTRUCTIONS]));
+#endif
+  }
+
+#ifdef PARSER_PROFILE
+  parse_profile_free(profile);
+#endif
+  parse_context_free(ctx);
+  parse_perf_close(perf);
+  parser_free(p);
+  return NULL;
+}
+
+#ifdef PARSER_PROFILE
+new_test(test_profile_counts)
+{
+  struct parser *a = ch('a');
+  struct parser *attempt = try(and(a, ch('b')));
+  struct parser *p = and(many(or(attempt, ch('c'))), eof);
+  struct parse_profile *profiles[2];
+  for (int engine = 0; engine < 2; engine += 1) {
+    struct parse_context *ctx = parse_context_new();
+    parse_context_set_engine(ctx, engine);
+    profiles[engine] = parse_profile_new();
+    parse_context_set_profile(ctx, profiles[engine]);
+    error_try(assert(parse_context_run(ctx, p, "abcab", 5, NULL)));
+    error_try(assert(parse_context_run(ctx, p, "cc", 2, NULL)));
+    error_try(assert(!parse_context_run(ctx, p, "abac", 4, NULL)));
+    parse_context_free(ctx);
+  }
+
+  // The try runs once per record and once more at the end of each
+  // repetition, and rolls back the "a" it read in front of the last "c".
+  const struct parse_node_stats *stats = parse_profile_node(profiles[0],
+                                                            attempt);
+  error_try(assert_unsigned_equal(9, stats->invocations));
+  error_try(assert_unsigned_equal(3, stats->successes));
+  error_try(assert_unsigned_equal(6, stats->failures));
+  error_try(assert_unsigned_equal(6, stats->consumed));
+  error_try(assert_unsigned_equal(1, stats->rewinds));
+  stats = parse_profile_node(profiles[0], a);
+  error_try(assert_unsigned_equal(4, stats->successes));
+  error_try(assert_unsigned_equal(5, stats->failures));
+  stats = parse_profile_node(profiles[0], p);
+  error_try(assert_unsigned_equal(2, stats->successes));
+  error_try(assert_unsigned_equal(1, stats->failures));
+
+  // Both engines count the same.
+  size_t len;
+  struct parser_index *nodes = parser_index(p, &len);
+  for (size_t i = 0; i < len; i += 1) {
+    error_try(assert(memcmp(parse_profile_node(profiles[0], nodes[i].p),
+                            parse_profile_node(profiles[1], nodes[i].p),
+                            sizeof(struct parse_node_stats)) == 0));
+  }
+  parse_free(nodes);
+
+  char dump[2048], line[128];
+  FILE *out = fmemopen(dump, sizeof(dump), "w");
+  error_try(assert(parse_profile_dump(profiles[0], p, out)));
+  fclose(out);
+  snprintf(line, sizeof(line), "\n%10d %10d %10d %10d %10d  %6stry\n",
+           9, 3, 6, 6, 1, "");
+  error_try(assert(strstr(dump, line) != NULL));
+
+  parse_profile_free(profiles[0]);
+  parse_profile_free(profiles[1]);
+  parser_free(p);
+  return NULL;
+}
+
+new_test(test_trace_export)
+{
+  struct parser *p = and(or(try(and(ch('a'), ch('b'))), ch('a')), eof);
+  char folded[2][1024], chrome[4096];
+  for (int engine = 0; engine < 2; engine += 1) {
+    struct parse_context *ctx = parse_context_new();
+    struct parse_trace *trace = parse_trace_new();
+    parse_context_set_engine(ctx, engine);
+    parse_context_set_trace(ctx, trace);
+    error_try(assert(parse_context_run(ctx, p, "a", 1, NULL)));
+    error_try(assert_unsigned_equal(16, parse_trace_len(trace)));
+
+    // Keep only the stacks; the times vary.
+    char buf[1024], *out = folded[engine];
+    FILE *f = fmemopen(buf, sizeof(buf), "w");
+    error_try(assert(parse_trace_write_folded(trace, f)));
+    fclose(f);
+    for (char *line = strtok(buf, "\n"); line; line = strtok(NULL, "\n")) {
+      *strrchr(line, ' ') = '\0';
+      out += sprintf(out, "%s\n", line);
+    }
+
+    f = fmemopen(chrome, sizeof(chrome), "w");
+    error_try(assert(parse_trace_write_chrome(trace, f)));
+    fclose(f);
+    parse_trace_free(trace);
+    parse_context_free(ctx);
+  }
+
+  error_try(assert_string_equal(
+    "and\n"
+    "and;or\n"
+    "and;or;try\n"
+    "and;or;try;and\n"
+    "and;or;try;and;ch('a')\n"
+    "and;or;try;and;ch('b')\n"
+    "and;or;ch('a')\n"
+    "and;eof\n",
+    folded[0]));
+  error_try(assert_string_equal(folded[0], folded[1]));
+  error_try(assert(strstr(chrome, "{\"name\":\"ch('b')\",\"ph\":\"B\"")));
+  error_try(assert(strstr(chrome, "\"args\":{\"pos\":1,\"matched\":false}")));
+
+  parser_free(p);
   return NULL;
 }
+#endif
@@ -7,13 +7,7 @@
  * succeeding only if both succeed.
  */
 
-struct parser_and {
-  struct parser parser;
-  struct parser *first;
-  struct parser *second;
-};
-
-static bool
+bool
 parser_run_and(const struct parser *p, struct parse_state *state)
 {
   bool first = parser_run(((struct parser_and *)p)->first, state);
@@ -27,21 +21,23 @@ parser_run_and(const struct parser *p, struct parse_state *state)
   return true;
 }
 
-static void
-parser_free_and(struct parser *p)
-{
-  parser_free(((struct parser_and *)p)->first);
-  parser_free(((struct parser_and *)p)->second);
-}
-
 struct parser *
 parser_create_and(struct parser *first, struct parser *second)
 {
-  struct parser_and *parser = malloc(sizeof(struct parser_and));
+  struct parser_and *parser = parse_malloc(sizeof(struct parser_and));
   parser_set_defaults(&parser->parser);
-  parser->parser.free = parser_free_and;
+  parser->parser.kind = PARSER_AND;
   parser->parser.run = parser_run_and;
   parser->first = first;
   parser->second = second;
   return (struct parser *)parser;
 }
+
+struct parser *
+parser_create_between(
+    struct parser *open,
+    struct parser *target,
+    struct parser *close)
+{
+  return parser_create_and(open, parser_create_and(target, close));
+}
@@ -6,11 +6,7 @@
  * Blank parser, will consume no input and always succeed.
  */
 
-struct parser_blank {
-  struct parser parser;
-};
-
-static bool
+bool
 parser_run_blank(const struct parser *p, struct parse_state *state)
 {
   (void)p;
@@ -20,8 +16,9 @@ parser_run_blank(const struct parser *p, struct parse_state *state)
 struct parser *
 parser_create_blank()
 {
-  struct parser_blank *parser = malloc(sizeof(struct parser_blank));
+  struct parser_blank *parser = parse_malloc(sizeof(struct parser_blank));
   parser_set_defaults(&parser->parser);
+  parser->parser.kind = PARSER_BLANK;
   parser->parser.run = parser_run_blank;
   return (struct parser *)parser;
 }
@@ -7,12 +7,7 @@
  * from the input.
  */
 
-struct parser_char {
-  struct parser parser;
-  char c;
-};
-
-static bool
+bool
 parser_run_char(const struct parser *p, struct parse_state *state)
 {
   char b, c = ((struct parser_char *)p)->c;
@@ -25,8 +20,9 @@ parser_run_char(const struct parser *p, struct parse_state *state)
 struct parser *
 parser_create_char(char c)
 {
-  struct parser_char *parser = malloc(sizeof(struct parser_char));
+  struct parser_char *parser = parse_malloc(sizeof(struct parser_char));
   parser_set_defaults(&parser->parser);
+  parser->parser.kind = PARSER_CHAR;
   parser->parser.run = parser_run_char;
   parser->c = c;
   return (struct parser *)parser;
@@ -0,0 +1,31 @@
+#include "parser/parser_internal.h"
+#include "parse.h"
+#include "state.h"
+
+/**
+ * Cut, consumes no input and always succeeds. Inside a try() it stops that
+ * try from rolling back. Outside of any try() or until() nothing before the
+ * cut can be rewound any more, so pending handlers are run and the consumed
+ * input is released.
+ */
+
+bool
+parser_run_cut(const struct parser *p, struct parse_state *state)
+{
+  (void)p;
+  state->cuts += 1;
+  if (state->backtrack_depth == 0) {
+    state_commit(state);
+  }
+  return state_success_blank(state);
+}
+
+struct parser *
+parser_create_cut()
+{
+  struct parser_cut *parser = parse_malloc(sizeof(struct parser_cut));
+  parser_set_defaults(&parser->parser);
+  parser->parser.kind = PARSER_CUT;
+  parser->parser.run = parser_run_cut;
+  return (struct parser *)parser;
+}
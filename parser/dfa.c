@@ -0,0 +1,651 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "parser/parser_internal.h"
+#include "parse.h"
+#include "state.h"
+
+/**
+ * Compilation of regular subtrees to table driven DFAs.
+ *
+ * blank, null, eof, ch, str, many, optional, or and and never rewind the
+ * input, so running a tree built only from them is a single left to right
+ * pass in which every byte is looked at, then either consumed or not, and
+ * the next step depends only on that and on where in the tree execution is.
+ * That makes the interpreter itself a finite automaton over bytes: its
+ * configuration at each read is the stack of active nodes together with the
+ * str() index and, for each optional(), whether anything has been consumed
+ * since it started.
+ *
+ * The compiler enumerates those configurations by simulating exactly the
+ * transitions of the run functions, so the DFA gives the same result, the
+ * same end position and the same output as the tree it replaces on every
+ * input, ordered choice and partial str() matches included. The DFA is then
+ * minimised by partition refinement. Subtrees whose simulation does not
+ * terminate (many() over something that can match without consuming) or
+ * that need more than DFA_MAX_STATES states are left to the interpreter.
+ */
+
+#define DFA_MAX_STATES 4096
+#define SIM_NONE -1
+#define SIM_END 256
+
+static bool
+parser_run_dfa(const struct parser *p, struct parse_state *state)
+{
+  const struct parser_dfa *dfa = (const struct parser_dfa *)p;
+  const uint32_t *table = dfa->table;
+  const uint8_t *input = (const uint8_t *)state->input;
+  size_t start = state->pos, pos = start, len = state->input_len;
+  uint32_t s = dfa->start;
+
+  while (s > DFA_MATCH) {
+    uint32_t c;
+    if (pos < len) {
+      c = dfa->classes[input[pos]];
+    } else {
+      state->starved |= state->partial;
+      c = dfa->num_classes;
+    }
+    uint32_t next = table[s * (dfa->num_classes + 1) + c];
+    pos += (next & DFA_CONSUME) != 0;
+    s = next & ~DFA_CONSUME;
+  }
+
+  state_output_append_n(state, state->input + start, pos - start);
+  state->pos = pos;
+  // Nothing past the final position was read.
+  state_examine(state);
+  return s == DFA_MATCH;
+}
+
+static void
+parser_free_dfa(struct parser *p)
+{
+  parse_free(((struct parser_dfa *)p)->table);
+}
+
+/**
+ * Simulation of the run functions. Frames are compared bytewise when
+ * interning configurations, so unused fields are kept zero.
+ */
+
+struct sim_frame {
+  const struct parser *p;
+  uint32_t phase;
+  uint32_t n;
+  uint32_t moved;
+  uint32_t pad;
+};
+
+struct sim {
+  struct sim_frame *frames;
+  size_t len;
+  size_t cap;
+  bool ret;
+  size_t step_limit;
+};
+
+enum sim_result {
+  SIM_READ,
+  SIM_DONE,
+  SIM_LOOP,
+};
+
+static void
+sim_push(struct sim *m, const struct parser *p)
+{
+  if (m->len == m->cap) {
+    m->cap = m->cap ? m->cap * 2 : 16;
+    m->frames = parse_realloc(m->frames, m->cap * sizeof(struct sim_frame));
+  }
+  memset(&m->frames[m->len], 0, sizeof(struct sim_frame));
+  m->frames[m->len++].p = p;
+}
+
+static void
+sim_consume(struct sim *m, bool *consumed)
+{
+  *consumed = true;
+  for (size_t i = 0; i < m->len; i += 1) {
+    if (m->frames[i].p->kind == PARSER_OPTIONAL) {
+      m->frames[i].moved = 1;
+    }
+  }
+}
+
+/**
+ * Run the machine. If sym is not SIM_NONE it is the byte under the cursor
+ * and the first read examines it; after a byte has been consumed (or with no
+ * sym at all) the machine stops at the next read with SIM_READ.
+ */
+static enum sim_result
+sim_run(struct sim *m, int sym, bool *consumed)
+{
+  bool have = sym != SIM_NONE;
+  *consumed = false;
+  for (size_t steps = 0; m->len > 0; steps += 1) {
+    if (steps > m->step_limit) {
+      return SIM_LOOP;
+    }
+    struct sim_frame *f = &m->frames[m->len - 1];
+    const struct parser *p = f->p;
+
+    switch (p->kind) {
+    case PARSER_BLANK:
+      m->ret = true;
+      break;
+
+    case PARSER_NULL:
+      m->ret = false;
+      break;
+
+    case PARSER_EOF:
+      if (!have) {
+        return SIM_READ;
+      }
+      m->ret = sym == SIM_END;
+      break;
+
+    case PARSER_CHAR:
+      if (!have) {
+        return SIM_READ;
+      }
+      m->ret = sym == (uint8_t)((struct parser_char *)p)->c;
+      if (m->ret) {
+        sim_consume(m, consumed);
+        have = false;
+      }
+      break;
+
+    case PARSER_STR: {
+      const char *lit = ((struct parser_str *)p)->literal;
+      if (lit[f->n] == '\0') {
+        m->ret = true;
+        break;
+      }
+      if (!have) {
+        return SIM_READ;
+      }
+      if (sym == SIM_END) {
+        m->ret = true;
+        break;
+      }
+      if (sym != (uint8_t)lit[f->n]) {
+        m->ret = false;
+        break;
+      }
+      sim_consume(m, consumed);
+      have = false;
+      f->n += 1;
+      continue;
+    }
+
+    case PARSER_MANY:
+      if (f->phase == 0 || m->ret) {
+        f->phase = 1;
+        sim_push(m, ((struct parser_many *)p)->target);
+        continue;
+      }
+      m->ret = true;
+      break;
+
+    case PARSER_OPTIONAL:
+      if (f->phase == 0) {
+        f->phase = 1;
+        sim_push(m, ((struct parser_optional *)p)->target);
+        continue;
+      }
+      m->ret = m->ret || !f->moved;
+      break;
+
+    case PARSER_OR:
+      if (f->phase == 0) {
+        f->phase = 1;
+        sim_push(m, ((struct parser_or *)p)->first);
+        continue;
+      }
+      if (f->phase == 1 && !m->ret) {
+        f->phase = 2;
+        sim_push(m, ((struct parser_or *)p)->second);
+        continue;
+      }
+      break;
+
+    case PARSER_AND:
+      if (f->phase == 0) {
+        f->phase = 1;
+        sim_push(m, ((struct parser_and *)p)->first);
+        continue;
+      }
+      if (f->phase == 1 && m->ret) {
+        f->phase = 2;
+        sim_push(m, ((struct parser_and *)p)->second);
+        continue;
+      }
+      break;
+
+    default:
+      return SIM_LOOP;
+    }
+    m->len -= 1;
+  }
+  return SIM_DONE;
+}
+
+/**
+ * Interned configurations. State ids 0 and 1 are DFA_FAIL and DFA_MATCH.
+ */
+
+struct dfa_builder {
+  struct sim_frame **keys;
+  size_t *key_lens;
+  size_t num_states;
+  size_t cap;
+  uint32_t *buckets;
+  size_t num_buckets;
+};
+
+static uint64_t
+dfa_hash(const struct sim_frame *frames, size_t len)
+{
+  const uint8_t *bytes = (const uint8_t *)frames;
+  uint64_t h = 14695981039346656037ull;
+  for (size_t i = 0; i < len * sizeof(struct sim_frame); i += 1) {
+    h = (h ^ bytes[i]) * 1099511628211ull;
+  }
+  return h;
+}
+
+static void dfa_rehash(struct dfa_builder *b);
+
+static uint32_t
+dfa_intern(struct dfa_builder *b, const struct sim_frame *frames, size_t len)
+{
+  size_t mask = b->num_buckets - 1;
+  for (size_t i = dfa_hash(frames, len) & mask; ; i = (i + 1) & mask) {
+    uint32_t id = b->buckets[i];
+    if (id == 0) {
+      break;
+    }
+    if (b->key_lens[id] == len
+        && memcmp(b->keys[id], frames, len * sizeof(struct sim_frame)) == 0) {
+      return id;
+    }
+  }
+
+  if (b->num_states == b->cap) {
+    b->cap *= 2;
+    b->keys = parse_realloc(b->keys, b->cap * sizeof(struct sim_frame *));
+    b->key_lens = parse_realloc(b->key_lens, b->cap * sizeof(size_t));
+  }
+  uint32_t id = b->num_states++;
+  b->keys[id] = parse_malloc(len * sizeof(struct sim_frame));
+  memcpy(b->keys[id], frames, len * sizeof(struct sim_frame));
+  b->key_lens[id] = len;
+  if (b->num_states * 2 > b->num_buckets) {
+    dfa_rehash(b);
+  } else {
+    for (size_t i = dfa_hash(frames, len) & mask; ; i = (i + 1) & mask) {
+      if (b->buckets[i] == 0) {
+        b->buckets[i] = id;
+        break;
+      }
+    }
+  }
+  return id;
+}
+
+static void
+dfa_rehash(struct dfa_builder *b)
+{
+  parse_free(b->buckets);
+  b->num_buckets = b->num_buckets ? b->num_buckets * 2 : 64;
+  b->buckets = parse_calloc(b->num_buckets, sizeof(uint32_t));
+  size_t mask = b->num_buckets - 1;
+  for (uint32_t id = 2; id < b->num_states; id += 1) {
+    size_t i = dfa_hash(b->keys[id], b->key_lens[id]) & mask;
+    while (b->buckets[i] != 0) {
+      i = (i + 1) & mask;
+    }
+    b->buckets[i] = id;
+  }
+}
+
+static void
+dfa_builder_destroy(struct dfa_builder *b)
+{
+  for (size_t id = 2; id < b->num_states; id += 1) {
+    parse_free(b->keys[id]);
+  }
+  parse_free(b->keys);
+  parse_free(b->key_lens);
+  parse_free(b->buckets);
+}
+
+/**
+ * Group bytes into classes: one per byte that appears in a ch() or str() of
+ * the subtree and one for everything else. Returns the number of classes and
+ * a representative byte for each.
+ */
+static uint32_t
+dfa_classes(const struct parser *root, uint8_t *classes, int *reps)
+{
+  bool used[256] = {false};
+  size_t len = 1, cap = 16;
+  const struct parser **stack = parse_malloc(cap * sizeof(struct parser *));
+  stack[0] = root;
+  while (len > 0) {
+    const struct parser *p = stack[--len];
+    if (p->kind == PARSER_CHAR) {
+      used[(uint8_t)((struct parser_char *)p)->c] = true;
+    } else if (p->kind == PARSER_STR) {
+      for (const char *c = ((struct parser_str *)p)->literal; *c; c += 1) {
+        used[(uint8_t)*c] = true;
+      }
+    }
+    if (len + 2 > cap) {
+      cap *= 2;
+      stack = parse_realloc(stack, cap * sizeof(struct parser *));
+    }
+    len += parser_children(p, (struct parser **)stack + len);
+  }
+  parse_free(stack);
+
+  uint32_t n = 0;
+  int other = -1;
+  for (int c = 0; c < 256; c += 1) {
+    if (!used[c] && other < 0) {
+      other = c;
+      reps[n++] = c;
+    }
+  }
+  for (int c = 0; c < 256; c += 1) {
+    if (used[c]) {
+      classes[c] = n;
+      reps[n++] = c;
+    } else {
+      classes[c] = 0;
+    }
+  }
+  return n;
+}
+
+/**
+ * Write the signature of state s to sig: for every class, the block the
+ * transition leads to and its consume flag. Returns a hash of the signature
+ * and s's own block.
+ */
+static uint64_t
+dfa_signature(const uint32_t *table, const uint32_t *block, uint32_t s,
+              uint32_t width, uint32_t *sig)
+{
+  uint64_t h = (14695981039346656037ull ^ block[s]) * 1099511628211ull;
+  for (uint32_t c = 0; c < width && s >= 2; c += 1) {
+    uint32_t e = table[s * width + c];
+    sig[c] = block[e & ~DFA_CONSUME] | (e & DFA_CONSUME);
+    h = (h ^ sig[c]) * 1099511628211ull;
+  }
+  return h;
+}
+
+/**
+ * Moore partition refinement over the non-final states. Rewrites table in
+ * place to the minimal automaton and returns its number of states. Each
+ * round finds a state's new block through a hash table keyed on its block
+ * and signature, so a round costs O(states * width).
+ */
+static uint32_t
+dfa_minimise(uint32_t *table, uint32_t num_states, uint32_t width,
+             uint32_t *start)
+{
+  uint32_t *block = parse_malloc(num_states * sizeof(uint32_t));
+  uint32_t *next_block = parse_malloc(num_states * sizeof(uint32_t));
+  uint32_t *sig = parse_malloc(2 * width * sizeof(uint32_t));
+  uint32_t *first = parse_malloc(num_states * sizeof(uint32_t));
+  uint64_t *first_hash = parse_malloc(num_states * sizeof(uint64_t));
+  size_t num_slots = 64;
+  while (num_slots < 2 * (size_t)num_states) {
+    num_slots *= 2;
+  }
+  uint32_t *slots = parse_malloc(num_slots * sizeof(uint32_t));
+  size_t mask = num_slots - 1;
+  uint32_t num_blocks = num_states > 2 ? 3 : num_states;
+  for (uint32_t s = 0; s < num_states; s += 1) {
+    block[s] = s < 2 ? s : 2;
+  }
+
+  for (;;) {
+    // Two states stay together only if every class leads to the same block
+    // with the same consume flag. first[b] is the first state in new block b,
+    // and slots holds new block numbers plus one.
+    uint32_t count = 0;
+    memset(slots, 0, num_slots * sizeof(uint32_t));
+    for (uint32_t s = 0; s < num_states; s += 1) {
+      uint64_t h = dfa_signature(table, block, s, width, sig);
+      uint32_t b;
+      for (size_t i = (h >> 32) & mask; ; i = (i + 1) & mask) {
+        if (slots[i] == 0) {
+          b = count++;
+          first[b] = s;
+          first_hash[b] = h;
+          slots[i] = b + 1;
+          break;
+        }
+        b = slots[i] - 1;
+        uint32_t t = first[b];
+        if (first_hash[b] == h && block[t] == block[s]) {
+          dfa_signature(table, block, t, width, sig + width);
+          if (s < 2
+              || memcmp(sig, sig + width, width * sizeof(uint32_t)) == 0) {
+            break;
+          }
+        }
+      }
+      next_block[s] = b;
+    }
+    bool stable = count == num_blocks;
+    memcpy(block, next_block, num_states * sizeof(uint32_t));
+    num_blocks = count;
+    if (stable) {
+      break;
+    }
+  }
+
+  // States 0 and 1 are always first in their blocks, so blocks 0 and 1 are
+  // still DFA_FAIL and DFA_MATCH.
+  for (uint32_t b = 2; b < num_blocks; b += 1) {
+    uint32_t s = first[b];
+    for (uint32_t c = 0; c < width; c += 1) {
+      uint32_t e = table[s * width + c];
+      table[b * width + c] = block[e & ~DFA_CONSUME] | (e & DFA_CONSUME);
+    }
+  }
+  *start = block[*start];
+
+  parse_free(block);
+  parse_free(next_block);
+  parse_free(sig);
+  parse_free(first);
+  parse_free(first_hash);
+  parse_free(slots);
+  return num_blocks;
+}
+
+/**
+ * Build a DFA node equivalent to root, or return NULL if root cannot be
+ * compiled.
+ */
+static struct parser_dfa *
+dfa_build(const struct parser *root, size_t num_nodes)
+{
+  struct parser_dfa *dfa = parse_calloc(1, sizeof(struct parser_dfa));
+  int reps[257];
+  dfa->num_classes = dfa_classes(root, dfa->classes, reps);
+  reps[dfa->num_classes] = SIM_END;
+  uint32_t width = dfa->num_classes + 1;
+
+  struct dfa_builder b;
+  memset(&b, 0, sizeof(b));
+  b.cap = 64;
+  b.num_states = 2;
+  b.keys = parse_calloc(b.cap, sizeof(struct sim_frame *));
+  b.key_lens = parse_calloc(b.cap, sizeof(size_t));
+  dfa_rehash(&b);
+
+  struct sim m;
+  memset(&m, 0, sizeof(m));
+  m.step_limit = 64 * num_nodes + 64;
+  bool consumed, ok = true;
+
+  sim_push(&m, root);
+  switch (sim_run(&m, SIM_NONE, &consumed)) {
+  case SIM_READ:
+    dfa->start = dfa_intern(&b, m.frames, m.len);
+    break;
+  case SIM_DONE:
+    dfa->start = m.ret ? DFA_MATCH : DFA_FAIL;
+    break;
+  default:
+    ok = false;
+  }
+
+  size_t table_cap = 0;
+  for (uint32_t s = 2; ok && s < b.num_states; s += 1) {
+    if (b.num_states > DFA_MAX_STATES) {
+      ok = false;
+      break;
+    }
+    if (b.num_states * width > table_cap) {
+      table_cap = 2 * b.num_states * width;
+      dfa->table = parse_realloc(dfa->table, table_cap * sizeof(uint32_t));
+    }
+    for (uint32_t c = 0; ok && c < width; c += 1) {
+      m.len = 0;
+      for (size_t i = 0; i < b.key_lens[s]; i += 1) {
+        sim_push(&m, NULL);
+        m.frames[i] = b.keys[s][i];
+      }
+      uint32_t next;
+      switch (sim_run(&m, reps[c], &consumed)) {
+      case SIM_READ:
+        next = dfa_intern(&b, m.frames, m.len);
+        break;
+      case SIM_DONE:
+        next = m.ret ? DFA_MATCH : DFA_FAIL;
+        break;
+      default:
+        ok = false;
+        next = DFA_FAIL;
+      }
+      dfa->table[s * width + c] = next | (consumed ? DFA_CONSUME : 0);
+    }
+  }
+
+  if (ok) {
+    dfa->num_states = b.num_states;
+    if (dfa->num_states > 2) {
+      dfa->num_states = dfa_minimise(dfa->table, b.num_states, width,
+                                     &dfa->start);
+    }
+    dfa->table = parse_realloc(
+        dfa->table, (dfa->num_states * width + 1) * sizeof(uint32_t));
+    // Rows 0 and 1 stand for the final states and are never stepped from.
+    memset(dfa->table, 0, 2 * width * sizeof(uint32_t));
+  }
+
+  parse_free(m.frames);
+  dfa_builder_destroy(&b);
+  if (!ok) {
+    parse_free(dfa->table);
+    parse_free(dfa);
+    return NULL;
+  }
+  parser_set_defaults(&dfa->parser);
+  dfa->parser.kind = PARSER_DFA;
+  dfa->parser.run = parser_run_dfa;
+  dfa->parser.free = parser_free_dfa;
+  return dfa;
+}
+
+static bool
+dfa_regular_kind(enum parser_kind kind)
+{
+  switch (kind) {
+  case PARSER_BLANK:
+  case PARSER_NULL:
+  case PARSER_EOF:
+  case PARSER_CHAR:
+  case PARSER_STR:
+  case PARSER_MANY:
+  case PARSER_OPTIONAL:
+  case PARSER_OR:
+  case PARSER_AND:
+    return true;
+  default:
+    return false;
+  }
+}
+
+struct compile_node {
+  struct parser **slot;
+  size_t parent;
+  size_t size;
+  bool regular;
+};
+
+/**
+ * Replace every maximal regular subtree of more than one node with a DFA.
+ * Takes ownership of p and returns the new root.
+ */
+struct parser *
+parser_compile(struct parser *p)
+{
+  struct parser *root = p;
+  size_t len = 0, cap = 64;
+  struct compile_node *nodes = parse_malloc(cap * sizeof(struct compile_node));
+  nodes[len++] = (struct compile_node){&root, SIZE_MAX, 1, true};
+
+  // Pre-order, so every node's children come after it.
+  for (size_t i = 0; i < len; i += 1) {
+    struct parser **slots[2];
+    size_t n = parser_child_slots(*nodes[i].slot, slots);
+    if (len + n > cap) {
+      cap *= 2;
+      nodes = parse_realloc(nodes, cap * sizeof(struct compile_node));
+    }
+    for (size_t k = 0; k < n; k += 1) {
+      nodes[len++] = (struct compile_node){slots[k], i, 1, true};
+    }
+  }
+
+  for (size_t i = len; i-- > 0; ) {
+    struct compile_node *node = &nodes[i];
+    node->regular = node->regular && dfa_regular_kind((*node->slot)->kind);
+    if (node->parent != SIZE_MAX) {
+      nodes[node->parent].regular &= node->regular;
+      nodes[node->parent].size += node->size;
+    }
+  }
+
+  for (size_t i = 0; i < len; i += 1) {
+    struct compile_node *node = &nodes[i];
+    bool parent_regular = node->parent != SIZE_MAX
+      && nodes[node->parent].regular;
+    if (!node->regular || parent_regular || node->size < 2) {
+      continue;
+    }
+    struct parser_dfa *dfa = dfa_build(*node->slot, node->size);
+    if (dfa != NULL) {
+      parser_free(*node->slot);
+      *node->slot = &dfa->parser;
+    } else {
+      // Leave this subtree alone, but let its children be tried.
+      node->regular = false;
+    }
+  }
+
+  parse_free(nodes);
+  return root;
+}
@@ -0,0 +1,436 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "parser/engine.h"
+#include "parser/parser_internal.h"
+#include "state.h"
+
+/**
+ * Each frame starts in phase 0. A node that needs a child pushes it and bumps
+ * its own phase; when the child's frame is popped the parent runs again with
+ * the child's result in e->ret. The transitions mirror the recursive run
+ * functions in this directory exactly, quirks included.
+ */
+
+void
+engine_create(struct engine *e)
+{
+  e->frames = NULL;
+  e->len = 0;
+  e->cap = 0;
+  e->ret = false;
+}
+
+void
+engine_destroy(struct engine *e)
+{
+  parse_free(e->frames);
+}
+
+static struct engine_frame *
+engine_push(struct engine *e, const struct parser *p)
+{
+  if (e->len == e->cap) {
+    e->cap = e->cap ? e->cap * 2 : 64;
+    e->frames = parse_realloc(e->frames, e->cap * sizeof(struct engine_frame));
+  }
+  struct engine_frame *f = &e->frames[e->len++];
+  f->p = p;
+  f->phase = 0;
+#ifdef PARSER_PROFILE
+  f->observed = false;
+#endif
+  return f;
+}
+
+void
+engine_start(struct engine *e, const struct parser *p)
+{
+  e->len = 0;
+  e->ret = false;
+  engine_push(e, p);
+}
+
+enum engine_status
+engine_resume(struct engine *e, struct parse_state *state)
+{
+  while (e->len > 0) {
+    struct engine_frame *f = &e->frames[e->len - 1];
+    const struct parser *p = f->p;
+#ifdef PARSER_PROFILE
+    if ((state->profile || state->trace) && !f->observed) {
+      f->observed = true;
+      profile_enter(state, p, &f->profile);
+    }
+#endif
+
+    switch (p->kind) {
+    case PARSER_BLANK:
+      e->ret = state_success_blank(state);
+      break;
+
+    case PARSER_NULL:
+      e->ret = false;
+      break;
+
+    case PARSER_EOF:
+      state_examine(state);
+      if (state->pos == state->input_len && state->partial) {
+        return ENGINE_SUSPENDED;
+      }
+      e->ret = state->pos == state->input_len && state_success_blank(state);
+      break;
+
+    case PARSER_CHAR:
+      state_examine(state);
+      if (state->pos < state->input_len) {
+        char c = state->input[state->pos];
+        e->ret = c == ((struct parser_char *)p)->c && state_success(state, c);
+      } else if (state->partial) {
+        return ENGINE_SUSPENDED;
+      } else {
+        e->ret = false;
+      }
+      break;
+
+    case PARSER_TOKEN:
+      state_examine(state);
+      if (state->pos < state->input_len) {
+        e->ret = (uint8_t)state->input[state->pos]
+          == ((struct parser_token *)p)->kind && state_success_token(state);
+      } else if (state->partial) {
+        return ENGINE_SUSPENDED;
+      } else {
+        e->ret = false;
+      }
+      break;
+
+    case PARSER_STR: {
+      const char *str = ((struct parser_str *)p)->literal;
+      if (f->phase == 0) {
+        f->n = 0;
+        f->phase = 1;
+      }
+      e->ret = true;
+      while (str[f->n]) {
+        state_examine(state);
+        if (state->pos >= state->input_len) {
+          if (state->partial) {
+            return ENGINE_SUSPENDED;
+          }
+          break;
+        }
+        char c = state->input[state->pos];
+        if (c != str[f->n]) {
+          e->ret = false;
+          break;
+        }
+        state_success(state, c);
+        f->n += 1;
+      }
+      break;
+    }
+
+    case PARSER_MANY:
+      if (f->phase == 0) {
+        state_success_blank(state);
+        f->phase = 1;
+        engine_push(e, ((struct parser_many *)p)->target);
+        continue;
+      }
+      if (e->ret) {
+        engine_push(e, ((struct parser_many *)p)->target);
+        continue;
+      }
+      e->ret = true;
+      break;
+
+    case PARSER_OPTIONAL:
+      if (f->phase == 0) {
+        f->n = state->pos;
+        f->phase = 1;
+        engine_push(e, ((struct parser_optional *)p)->target);
+        continue;
+      }
+      if (!e->ret && f->n != state->pos) {
+        e->ret = false;
+      } else {
+        e->ret = state_success_blank(state);
+      }
+      break;
+
+    case PARSER_TRY:
+      if (f->phase == 0) {
+        f->n = state->cuts;
+        state_checkpoint(state, &f->cp);
+        state->backtrack_depth += 1;
+        f->phase = 1;
+        engine_push(e, ((struct parser_try *)p)->target);
+        continue;
+      }
+      state->backtrack_depth -= 1;
+      if (!e->ret && state->cuts == f->n) {
+        state_restore(state, &f->cp);
+      }
+      state->cuts = f->n;
+      break;
+
+    case PARSER_UNTIL:
+      if (f->phase == 1) {
+        state->backtrack_depth -= 1;
+        state->cuts = f->n;
+        state_restore(state, &f->cp);
+        if (e->ret) {
+          break;
+        }
+        state_success(state, state->input[state->pos]);
+      }
+      state_examine(state);
+      if (state->pos == state->input_len) {
+        if (state->partial) {
+          f->phase = 0;
+          return ENGINE_SUSPENDED;
+        }
+        e->ret = state_success_blank(state);
+        break;
+      }
+      f->n = state->cuts;
+      state_checkpoint(state, &f->cp);
+      state->backtrack_depth += 1;
+      f->phase = 1;
+      engine_push(e, ((struct parser_until *)p)->target);
+      continue;
+
+    case PARSER_OR:
+      if (f->phase == 0) {
+        f->phase = 1;
+        engine_push(e, ((struct parser_or *)p)->first);
+        continue;
+      }
+      if (f->phase == 1 && !e->ret) {
+        f->phase = 2;
+        engine_push(e, ((struct parser_or *)p)->second);
+        continue;
+      }
+      break;
+
+    case PARSER_AND:
+      if (f->phase == 0) {
+        f->phase = 1;
+        engine_push(e, ((struct parser_and *)p)->first);
+        continue;
+      }
+      if (f->phase == 1 && e->ret) {
+        f->phase = 2;
+        engine_push(e, ((struct parser_and *)p)->second);
+        continue;
+      }
+      break;
+
+    case PARSER_EXECUTE: {
+      struct parser_execute *exe = (struct parser_execute *)p;
+      if (f->phase == 0) {
+        f->n = state->output_len;
+        state->capture_depth += 1;
+        f->phase = 1;
+        engine_push(e, exe->target);
+        continue;
+      }
+      state->capture_depth -= 1;
+      if (e->ret) {
+        state_success_blank(state);
+        state_add_handler_n(state, exe->handle, state->output + f->n,
+                            state->output_len - f->n, exe->extra);
+      } else {
+        state_output_truncate(state, f->n);
+      }
+      break;
+    }
+
+    case PARSER_MEMO:
+      if (f->phase == 0) {
+        bool matched;
+        if (state->document == NULL || state->partial) {
+          f->phase = 2;
+        } else if (memo_lookup(state->document, p, state, &matched)) {
+          e->ret = matched;
+          break;
+        } else {
+          memo_begin(state, &f->memoized);
+          f->phase = 1;
+        }
+        engine_push(e, ((struct parser_memo *)p)->target);
+        continue;
+      }
+      if (f->phase == 1) {
+        memo_end(state, p, &f->memoized, e->ret);
+      }
+      break;
+
+    case PARSER_REPEAT: {
+      const struct parser_repeat *r = (const struct parser_repeat *)p;
+      if (f->phase == 0) {
+        f->count = 0;
+      } else {
+        if (!r->atomic && !repeat_step_end(state, f->n, e->ret, &f->cp)) {
+          e->ret = false;
+          break;
+        }
+        if (!e->ret) {
+          e->ret = f->count >= r->min && state_success_blank(state);
+          break;
+        }
+        f->count += 1;
+        if (!r->atomic && state->pos == f->cp.pos) {
+          e->ret = state_success_blank(state);
+          break;
+        }
+        if (f->count == 1 && r->min > 1) {
+          repeat_reserve(state, &f->cp, r->min - 1);
+        }
+      }
+      if (f->count == r->max) {
+        e->ret = f->count >= r->min && state_success_blank(state);
+        break;
+      }
+      if (!r->atomic) {
+        f->n = repeat_step_begin(state, &f->cp);
+      } else if (f->count == 0) {
+        state_checkpoint(state, &f->cp);
+      }
+      f->phase = 1;
+      engine_push(e, r->target);
+      continue;
+    }
+
+    case PARSER_SEP_BY: {
+      // Phase 1 follows the first item, 2 a separator and 3 a later item.
+      const struct parser_sep_by *s = (const struct parser_sep_by *)p;
+      if (f->phase == 0) {
+        f->n = repeat_step_begin(state, &f->cp);
+        f->phase = 1;
+        engine_push(e, s->target);
+        continue;
+      }
+      if (f->phase == 2) {
+        if (!e->ret) {
+          e->ret = repeat_step_end(state, f->n, false, &f->cp)
+            && state_success_blank(state);
+          break;
+        }
+        if (s->end) {
+          repeat_step_end(state, f->n, true, &f->cp);
+          f->n = repeat_step_begin(state, &f->cp);
+        }
+        f->phase = 3;
+        engine_push(e, s->target);
+        continue;
+      }
+      if (!repeat_step_end(state, f->n, e->ret, &f->cp)) {
+        e->ret = false;
+        break;
+      }
+      if (!e->ret || (f->phase == 3 && state->pos == f->count)) {
+        e->ret = state_success_blank(state);
+        break;
+      }
+      f->count = state->pos;
+      f->n = repeat_step_begin(state, &f->cp);
+      f->phase = 2;
+      engine_push(e, s->sep);
+      continue;
+    }
+
+    case PARSER_LOOKAHEAD:
+      if (f->phase == 0) {
+        f->n = state->cuts;
+        state_checkpoint(state, &f->cp);
+        state->backtrack_depth += 1;
+        f->phase = 1;
+        engine_push(e, ((struct parser_lookahead *)p)->target);
+        continue;
+      }
+      state->backtrack_depth -= 1;
+      state->cuts = f->n;
+      state_restore(state, &f->cp);
+      e->ret = e->ret != ((struct parser_lookahead *)p)->negate
+        && state_success_blank(state);
+      break;
+
+    case PARSER_CUT:
+      state->cuts += 1;
+      if (state->backtrack_depth == 0) {
+        state_commit(state);
+      }
+      e->ret = state_success_blank(state);
+      break;
+
+    default:
+      // Nodes the engine does not know about run through their own run
+      // function. If they run out of partial input they are rolled back and
+      // re-run from the start once more input is available, so nothing they
+      // do can be committed until they finish.
+      state_checkpoint(state, &f->cp);
+      state->backtrack_depth += state->partial;
+#ifdef PARSER_PROFILE
+      // The frame already counts this node.
+      e->ret = p->run ? (p->run)(p, state) : true;
+#else
+      e->ret = parser_run(p, state);
+#endif
+      state->backtrack_depth -= state->partial;
+      if (state->starved) {
+        state->starved = false;
+        state_restore(state, &f->cp);
+        return ENGINE_SUSPENDED;
+      }
+      break;
+    }
+
+#ifdef PARSER_PROFILE
+    if (f->observed) {
+      profile_exit(state, p, &f->profile, e->ret);
+    }
+#endif
+    e->len -= 1;
+  }
+  return e->ret ? ENGINE_MATCH : ENGINE_FAIL;
+}
+
+void
+engine_rebase(struct engine *e, size_t input_shift, size_t output_shift)
+{
+  for (size_t i = 0; i < e->len; i += 1) {
+    struct engine_frame *f = &e->frames[i];
+#ifdef PARSER_PROFILE
+    f->profile.start -= input_shift;
+#endif
+    switch (f->p->kind) {
+    case PARSER_OPTIONAL:
+      f->n -= input_shift;
+      break;
+    case PARSER_EXECUTE:
+      f->n -= output_shift;
+      break;
+    case PARSER_SEP_BY:
+      f->count -= input_shift;
+      // fall through
+    case PARSER_TRY:
+    case PARSER_UNTIL:
+    case PARSER_REPEAT:
+    case PARSER_LOOKAHEAD:
+      f->cp.pos -= input_shift;
+      f->cp.output_len -= output_shift;
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+bool
+engine_run(struct engine *e, const struct parser *p, struct parse_state *state)
+{
+  engine_start(e, p);
+  return engine_resume(e, state) == ENGINE_MATCH;
+}
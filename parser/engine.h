@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "parser/parser_internal.h"
+#include "state.h"
+
+/**
+ * Iterative execution engine. Instead of recursing through each node's run
+ * function, the engine keeps one frame per active node on a heap allocated
+ * stack, so grammar depth is bounded by memory rather than by the C stack.
+ * The stack keeps its capacity between runs.
+ *
+ * When the state is partial the engine suspends, rather than fails, at the
+ * first read past the end of the input; more input can then be made
+ * available and engine_resume picks up exactly where it stopped.
+ */
+
+struct engine_frame {
+  const struct parser *p;
+  unsigned phase;
+  /* str index, optional start position, exe output start or the cut count
+   * a try() or repetition step started with */
+  size_t n;
+  /* repeat() steps taken, or where the current sep_by() step started */
+  size_t count;
+  struct parse_checkpoint cp;
+  /* memo() bookkeeping while the target runs */
+  struct memo_frame memoized;
+#ifdef PARSER_PROFILE
+  /* Whether the node's entry has been profiled or traced */
+  bool observed;
+  struct profile_frame profile;
+#endif
+};
+
+struct engine {
+  struct engine_frame *frames;
+  size_t len;
+  size_t cap;
+  /* Result of the most recently finished node */
+  bool ret;
+};
+
+enum engine_status {
+  ENGINE_MATCH,
+  ENGINE_FAIL,
+  ENGINE_SUSPENDED,
+};
+
+void engine_create(struct engine *e);
+
+void engine_destroy(struct engine *e);
+
+/**
+ * Discard any suspended run and prepare to run p from the top.
+ */
+void engine_start(struct engine *e, const struct parser *p);
+
+enum engine_status engine_resume(struct engine *e, struct parse_state *state);
+
+/**
+ * Adjust a suspended run after the first input_shift bytes of input and
+ * output_shift bytes of output have been dropped. Positions recorded before
+ * the drop (an optional() that started before a cut, say) are shifted with
+ * unsigned wraparound, which keeps the comparisons made on them correct.
+ */
+void engine_rebase(struct engine *e, size_t input_shift, size_t output_shift);
+
+/**
+ * Run p to completion. Equivalent to parser_run(p, state) on a state that is
+ * not partial.
+ */
+bool engine_run(struct engine *e, const struct parser *p, struct parse_state *state);
@@ -6,11 +6,7 @@
  * EOF parser, will only pass if EOF.
  */
 
-struct parser_eof {
-  struct parser parser;
-};
-
-static bool
+bool
 parser_run_eof(const struct parser *p, struct parse_state *state)
 {
   (void)p;
@@ -24,8 +20,9 @@ parser_run_eof(const struct parser *p, struct parse_state *state)
 struct parser *
 parser_create_eof()
 {
-  struct parser_eof *parser = malloc(sizeof(struct parser_eof));
+  struct parser_eof *parser = parse_malloc(sizeof(struct parser_eof));
   parser_set_defaults(&parser->parser);
+  parser->parser.kind = PARSER_EOF;
   parser->parser.run = parser_run_eof;
   return (struct parser *)parser;
 }
@@ -0,0 +1,49 @@
+#include "parser/parser_internal.h"
+#include "parse.h"
+#include "state.h"
+
+/**
+ * Lookahead. Runs the target from a checkpoint and always restores it, so
+ * nothing the target did is kept whether or not it matched. The target runs
+ * as though inside a try(): a cut() in it commits nothing.
+ */
+
+bool
+parser_run_lookahead(const struct parser *p, struct parse_state *state)
+{
+  const struct parser_lookahead *l = (const struct parser_lookahead *)p;
+  struct parse_checkpoint cp;
+  size_t cuts = state->cuts;
+  state_checkpoint(state, &cp);
+  state->backtrack_depth += 1;
+  bool success = parser_run(l->target, state);
+  state->backtrack_depth -= 1;
+  state->cuts = cuts;
+  state_restore(state, &cp);
+  return success != l->negate && state_success_blank(state);
+}
+
+static struct parser *
+lookahead_create(struct parser *target, bool negate)
+{
+  struct parser_lookahead *parser =
+    parse_malloc(sizeof(struct parser_lookahead));
+  parser_set_defaults(&parser->parser);
+  parser->parser.kind = PARSER_LOOKAHEAD;
+  parser->parser.run = parser_run_lookahead;
+  parser->target = target;
+  parser->negate = negate;
+  return (struct parser *)parser;
+}
+
+struct parser *
+parser_create_peek(struct parser *target)
+{
+  return lookahead_create(target, false);
+}
+
+struct parser *
+parser_create_not(struct parser *target)
+{
+  return lookahead_create(target, true);
+}
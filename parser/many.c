@@ -7,12 +7,7 @@
  * possible.
  */
 
-struct parser_many {
-  struct parser parser;
-  struct parser *target;
-};
-
-static bool
+bool
 parser_run_many(const struct parser *p, struct parse_state *state)
 {
   state_success_blank(state);
@@ -24,18 +19,12 @@ parser_run_many(const struct parser *p, struct parse_state *state)
   return true;
 }
 
-static void
-parser_free_many(struct parser *p)
-{
-  parser_free(((struct parser_many *)p)->target);
-}
-
 struct parser *
 parser_create_many(struct parser *target)
 {
-  struct parser_many *parser = malloc(sizeof(struct parser_many));
+  struct parser_many *parser = parse_malloc(sizeof(struct parser_many));
   parser_set_defaults(&parser->parser);
-  parser->parser.free = parser_free_many;
+  parser->parser.kind = PARSER_MANY;
   parser->parser.run = parser_run_many;
   parser->target = target;
   return (struct parser *)parser;
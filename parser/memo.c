@@ -0,0 +1,37 @@
+#include "parser/parser_internal.h"
+#include "parse.h"
+#include "state.h"
+
+/**
+ * Memoize a parser in the attached document, if any. Without a document, or
+ * on partial input, the target simply runs.
+ */
+
+bool
+parser_run_memo(const struct parser *p, struct parse_state *state)
+{
+  struct parser *target = ((struct parser_memo *)p)->target;
+  if (state->document == NULL || state->partial) {
+    return parser_run(target, state);
+  }
+  bool success;
+  if (memo_lookup(state->document, p, state, &success)) {
+    return success;
+  }
+  struct memo_frame frame;
+  memo_begin(state, &frame);
+  success = parser_run(target, state);
+  memo_end(state, p, &frame, success);
+  return success;
+}
+
+struct parser *
+parser_create_memo(struct parser *target)
+{
+  struct parser_memo *parser = parse_malloc(sizeof(struct parser_memo));
+  parser_set_defaults(&parser->parser);
+  parser->parser.kind = PARSER_MEMO;
+  parser->parser.run = parser_run_memo;
+  parser->target = target;
+  return (struct parser *)parser;
+}
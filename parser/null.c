@@ -6,11 +6,7 @@
  * Null parser, will consume no input and always succeed.
  */
 
-struct parser_null {
-  struct parser parser;
-};
-
-static bool
+bool
 parser_run_null(const struct parser *p, struct parse_state *state)
 {
   (void)p;
@@ -21,8 +17,9 @@ parser_run_null(const struct parser *p, struct parse_state *state)
 struct parser *
 parser_create_null()
 {
-  struct parser_null *parser = malloc(sizeof(struct parser_null));
+  struct parser_null *parser = parse_malloc(sizeof(struct parser_null));
   parser_set_defaults(&parser->parser);
+  parser->parser.kind = PARSER_NULL;
   parser->parser.run = parser_run_null;
   return (struct parser *)parser;
 }
@@ -6,12 +6,7 @@
  * This parser fails if and only if the given parser fails and consumes input.
  */
 
-struct parser_optional {
-  struct parser parser;
-  struct parser *target;
-};
-
-static bool
+bool
 parser_run_optional(const struct parser *p, struct parse_state *state)
 {
   size_t _pos = state->pos;
@@ -23,18 +18,12 @@ parser_run_optional(const struct parser *p, struct parse_state *state)
   return true;
 }
 
-static void
-parser_free_optional(struct parser *p)
-{
-  parser_free(((struct parser_optional *)p)->target);
-}
-
 struct parser *
 parser_create_optional(struct parser *target)
 {
-  struct parser_optional *parser = malloc(sizeof(struct parser_optional));
+  struct parser_optional *parser = parse_malloc(sizeof(struct parser_optional));
   parser_set_defaults(&parser->parser);
-  parser->parser.free = parser_free_optional;
+  parser->parser.kind = PARSER_OPTIONAL;
   parser->parser.run = parser_run_optional;
   parser->target = target;
   return (struct parser *)parser;
@@ -7,13 +7,7 @@
  * succeeding if either succeed.
  */
 
-struct parser_or {
-  struct parser parser;
-  struct parser *first;
-  struct parser *second;
-};
-
-static bool
+bool
 parser_run_or(const struct parser *p, struct parse_state *state)
 {
   bool first = parser_run(((struct parser_or *)p)->first, state);
@@ -27,18 +21,12 @@ parser_run_or(const struct parser *p, struct parse_state *state)
   return false;
 }
 
-static void parser_free_or(struct parser *p)
-{
-  parser_free(((struct parser_or *)p)->first);
-  parser_free(((struct parser_or *)p)->second);
-}
-
 struct parser *
 parser_create_or(struct parser *first, struct parser *second)
 {
-  struct parser_or *parser = malloc(sizeof(struct parser_or));
+  struct parser_or *parser = parse_malloc(sizeof(struct parser_or));
   parser_set_defaults(&parser->parser);
-  parser->parser.free = parser_free_or;
+  parser->parser.kind = PARSER_OR;
   parser->parser.run = parser_run_or;
   parser->first = first;
   parser->second = second;
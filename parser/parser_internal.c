@@ -1,3 +1,6 @@
+#include <ctype.h>
+#include <stdio.h>
+
 #include "parser/parser_internal.h"
 #include "parse.h"
 #include "state.h"
@@ -9,7 +12,7 @@
 static void
 parser_free_default(struct parser *p)
 {
-  free(p);
+  parse_free(p);
 }
 
 /**
@@ -18,22 +21,172 @@ parser_free_default(struct parser *p)
 bool
 parser_run(const struct parser *p, struct parse_state *state)
 {
+#ifdef PARSER_PROFILE
+  if (state->profile || state->trace) {
+    return parser_run_profiled(p, state);
+  }
+#endif
   if (p->run)
     return (p->run)(p, state);
   return true;
 }
 
+size_t
+parser_child_slots(struct parser *p, struct parser ***slots)
+{
+  switch (p->kind) {
+  case PARSER_MANY:
+  case PARSER_OPTIONAL:
+  case PARSER_TRY:
+  case PARSER_UNTIL:
+  case PARSER_MEMO:
+  case PARSER_REPEAT:
+  case PARSER_LOOKAHEAD:
+    slots[0] = &((struct parser_many *)p)->target;
+    return 1;
+  case PARSER_EXECUTE:
+    slots[0] = &((struct parser_execute *)p)->target;
+    return 1;
+  case PARSER_OR:
+  case PARSER_AND:
+  case PARSER_SEP_BY:
+    slots[0] = &((struct parser_and *)p)->first;
+    slots[1] = &((struct parser_and *)p)->second;
+    return 2;
+  default:
+    return 0;
+  }
+}
+
+size_t
+parser_children(const struct parser *p, struct parser **children)
+{
+  struct parser **slots[2];
+  size_t n = parser_child_slots((struct parser *)p, slots);
+  for (size_t i = 0; i < n; i += 1) {
+    children[i] = *slots[i];
+  }
+  return n;
+}
+
+static const char *
+parser_kind_name(enum parser_kind kind)
+{
+  switch (kind) {
+  case PARSER_BLANK: return "blank";
+  case PARSER_NULL: return "null";
+  case PARSER_EOF: return "eof";
+  case PARSER_CHAR: return "ch";
+  case PARSER_STR: return "str";
+  case PARSER_MANY: return "many";
+  case PARSER_OPTIONAL: return "optional";
+  case PARSER_TRY: return "try";
+  case PARSER_UNTIL: return "until";
+  case PARSER_OR: return "or";
+  case PARSER_AND: return "and";
+  case PARSER_EXECUTE: return "exe";
+  case PARSER_CUT: return "cut";
+  case PARSER_DFA: return "dfa";
+  case PARSER_MEMO: return "memo";
+  case PARSER_TOKEN: return "tok";
+  case PARSER_PRATT: return "pratt";
+  case PARSER_REPEAT: return "repeat";
+  case PARSER_SEP_BY: return "sep_by";
+  case PARSER_LOOKAHEAD: return "peek";
+  default: return "other";
+  }
+}
+
+void
+parser_describe(const struct parser *p, char *buf, size_t n)
+{
+  const char *name = parser_kind_name(p->kind);
+  if (p->kind == PARSER_CHAR) {
+    unsigned char c = ((const struct parser_char *)p)->c;
+    if (isprint(c) && c != '\'' && c != '\\') {
+      snprintf(buf, n, "ch('%c')", c);
+    } else {
+      snprintf(buf, n, "ch('\\x%02x')", c);
+    }
+  } else if (p->kind == PARSER_STR) {
+    snprintf(buf, n, "str(\"%s\")", ((const struct parser_str *)p)->literal);
+  } else if (p->kind == PARSER_TOKEN) {
+    snprintf(buf, n, "tok(%u)", ((const struct parser_token *)p)->kind);
+  } else if (p->kind == PARSER_DFA) {
+    snprintf(buf, n, "dfa(%u states)",
+             ((const struct parser_dfa *)p)->num_states);
+  } else if (p->kind == PARSER_REPEAT) {
+    const struct parser_repeat *r = (const struct parser_repeat *)p;
+    if (r->max == SIZE_MAX) {
+      snprintf(buf, n, "repeat(%zu..)", r->min);
+    } else {
+      snprintf(buf, n, "repeat(%zu..%zu)", r->min, r->max);
+    }
+  } else if (p->kind == PARSER_SEP_BY && ((const struct parser_sep_by *)p)->end) {
+    snprintf(buf, n, "sep_end_by");
+  } else if (p->kind == PARSER_LOOKAHEAD
+             && ((const struct parser_lookahead *)p)->negate) {
+    snprintf(buf, n, "not");
+  } else {
+    snprintf(buf, n, "%s", name);
+  }
+}
+
+struct parser_index *
+parser_index(const struct parser *p, size_t *len)
+{
+  size_t cap = 16, exes = 0;
+  struct parser_index *nodes = parse_malloc(cap * sizeof(struct parser_index));
+  nodes[0].p = p;
+  *len = 1;
+  for (size_t i = 0; i < *len; i += 1) {
+    struct parser *children[2];
+    size_t n = parser_children(nodes[i].p, children);
+    if (*len + n > cap) {
+      cap *= 2;
+      nodes = parse_realloc(nodes, cap * sizeof(struct parser_index));
+    }
+    for (size_t k = 0; k < n; k += 1) {
+      nodes[i].children[k] = *len;
+      nodes[(*len)++].p = children[k];
+    }
+    if (nodes[i].p->kind == PARSER_EXECUTE) {
+      nodes[i].exe_index = exes++;
+    }
+  }
+  return nodes;
+}
+
+/**
+ * Frees the tree with an explicit stack so that grammar depth is not limited
+ * by the C stack.
+ */
 void
 parser_free(struct parser *p)
 {
-  if (p->free)
-    (p->free)(p);
-  parser_free_default(p);
+  size_t len = 1, cap = 16;
+  struct parser **stack = parse_malloc(cap * sizeof(struct parser *));
+  stack[0] = p;
+  while (len > 0) {
+    struct parser *top = stack[--len];
+    if (len + 2 > cap) {
+      cap *= 2;
+      stack = parse_realloc(stack, cap * sizeof(struct parser *));
+    }
+    len += parser_children(top, stack + len);
+    if (top->free)
+      (top->free)(top);
+    parser_free_default(top);
+  }
+  parse_free(stack);
 }
 
 void
 parser_set_defaults(struct parser *p)
 {
+  static uint64_t next_id = 0;
   p->free = NULL;
   p->run = NULL;
+  p->kind = PARSER_OTHER;
+  p->id = __atomic_add_fetch(&next_id, 1, __ATOMIC_RELAXED);
 }
@@ -1,14 +1,383 @@
+#pragma once
+
 #include <stdbool.h>
+#include <stdint.h>
 
+#include "alloc.h"
 #include "state.h"
 
+/**
+ * Node kinds. The engines switch on the kind of the built-in combinators;
+ * PARSER_OTHER nodes are only ever executed through their run function.
+ */
+enum parser_kind {
+  PARSER_OTHER,
+  PARSER_BLANK,
+  PARSER_NULL,
+  PARSER_EOF,
+  PARSER_CHAR,
+  PARSER_STR,
+  PARSER_MANY,
+  PARSER_OPTIONAL,
+  PARSER_TRY,
+  PARSER_UNTIL,
+  PARSER_OR,
+  PARSER_AND,
+  PARSER_EXECUTE,
+  PARSER_CUT,
+  PARSER_DFA,
+  PARSER_MEMO,
+  PARSER_TOKEN,
+  PARSER_PRATT,
+  PARSER_REPEAT,
+  PARSER_SEP_BY,
+  PARSER_LOOKAHEAD,
+};
+
 struct parser {
   bool (*run)(const struct parser*, struct parse_state*);
   void (*free)(struct parser*);
+  enum parser_kind kind;
+  /* Never reused, unlike the node's address, so that a result cache cannot
+   * mistake a new grammar for a freed one; 0 for static nodes, which are
+   * never freed */
+  uint64_t id;
 };
 
 typedef bool (*parser_run_fn)(const struct parser*, struct parse_state*, char **o);
 typedef void (*parser_free_fn)(struct parser*);
 
+struct parser_blank {
+  struct parser parser;
+};
+
+struct parser_null {
+  struct parser parser;
+};
+
+struct parser_eof {
+  struct parser parser;
+};
+
+struct parser_cut {
+  struct parser parser;
+};
+
+struct parser_char {
+  struct parser parser;
+  char c;
+};
+
+struct parser_token {
+  struct parser parser;
+  uint8_t kind;
+};
+
+struct parser_str {
+  struct parser parser;
+  const char *literal;
+};
+
+struct parser_many {
+  struct parser parser;
+  struct parser *target;
+};
+
+struct parser_optional {
+  struct parser parser;
+  struct parser *target;
+};
+
+struct parser_try {
+  struct parser parser;
+  struct parser *target;
+};
+
+struct parser_until {
+  struct parser parser;
+  struct parser *target;
+};
+
+struct parser_or {
+  struct parser parser;
+  struct parser *first;
+  struct parser *second;
+};
+
+struct parser_and {
+  struct parser parser;
+  struct parser *first;
+  struct parser *second;
+};
+
+struct parser_execute {
+  struct parser parser;
+  struct parser *target;
+  bool (*handle)(char *, void *);
+  void *extra;
+};
+
+struct parser_memo {
+  struct parser parser;
+  struct parser *target;
+};
+
+/**
+ * max is SIZE_MAX for no limit. atomic is set when target can only fail
+ * without having consumed or output anything, so that steps need no
+ * checkpoint.
+ */
+struct parser_repeat {
+  struct parser parser;
+  struct parser *target;
+  size_t min;
+  size_t max;
+  bool atomic;
+};
+
+/**
+ * end is set for sep_end_by(), which allows a separator after the last item.
+ */
+struct parser_sep_by {
+  struct parser parser;
+  struct parser *target;
+  struct parser *sep;
+  bool end;
+};
+
+/**
+ * negate is set for not(), which matches where the target does not.
+ */
+struct parser_lookahead {
+  struct parser parser;
+  struct parser *target;
+  bool negate;
+};
+
+/**
+ * Owns its atom, brackets and operators itself: they are not children as far
+ * as parser_children is concerned, so the node runs only through its run
+ * function and cannot be emitted or serialized.
+ */
+struct parser_pratt {
+  struct parser parser;
+  struct parser *atom;
+  struct parser *open;
+  struct parser *close;
+  struct parse_operator *ops;
+  size_t num_ops;
+};
+
+/**
+ * A regular subtree compiled by parser_compile. classes maps each byte to a
+ * byte class, with num_classes standing for the end of input. Each table
+ * entry is the next state, with DFA_CONSUME set if the byte is consumed.
+ * States DFA_FAIL and DFA_MATCH are final.
+ */
+#define DFA_FAIL 0
+#define DFA_MATCH 1
+#define DFA_CONSUME 0x80000000u
+
+struct parser_dfa {
+  struct parser parser;
+  uint8_t classes[256];
+  uint32_t num_classes;
+  uint32_t num_states;
+  uint32_t start;
+  uint32_t *table;
+};
+
 void parser_set_defaults(struct parser *);
 bool parser_run(const struct parser *, struct parse_state *);
+
+/**
+ * parser_run with state->profile or state->trace attached: run p, add to its
+ * counters and record its enter and exit. Only called in builds with
+ * PARSER_PROFILE.
+ */
+bool parser_run_profiled(const struct parser *p, struct parse_state *state);
+
+/**
+ * What profile_enter saves about a running node for profile_exit: its
+ * counters, those of the node that was running before it, and the input
+ * position and hardware counts it started at.
+ */
+struct profile_frame {
+  struct parse_node_stats *stats;
+  struct parse_node_stats *outer;
+  size_t start;
+  struct parse_perf_counts perf;
+};
+
+/**
+ * Bracket one run of p for the attached profile and trace. Every
+ * profile_enter must be matched by a profile_exit with the same frame.
+ */
+void profile_enter(struct parse_state *state, const struct parser *p,
+                   struct profile_frame *frame);
+void profile_exit(struct parse_state *state, const struct parser *p,
+                  struct profile_frame *frame, bool success);
+
+/**
+ * Bracket a run for the metrics in metrics.h: metrics_start returns a start
+ * time, or 0 if metrics are off, which metrics_record then ignores.
+ */
+uint64_t metrics_start();
+void metrics_record(uint64_t start, bool matched, size_t bytes,
+                    size_t backtracks);
+
+struct parse_cache;
+
+/**
+ * Look state's input up in cache. On a hit, set *matched and, if it matched,
+ * restore the position, output and handler log the run left; returns
+ * whether it was a hit. cache_insert stores the result of a run that has
+ * not yet executed its handlers.
+ */
+bool cache_lookup(struct parse_cache *cache, const struct parser *p,
+                  struct parse_state *state, bool *matched);
+void cache_insert(struct parse_cache *cache, const struct parser *p,
+                  const struct parse_state *state, bool matched);
+
+/**
+ * What memo_begin saves about a memo() node that is about to run its target,
+ * for memo_end: the checkpoint it started at and the counters its entry is
+ * recorded relative to.
+ */
+struct memo_frame {
+  struct parse_checkpoint cp;
+  size_t examined;
+  size_t cuts;
+  size_t commits;
+};
+
+/**
+ * Look p up at the current position in doc. On a hit, replay what its run
+ * did to the state, set *matched and return true. Otherwise run the target
+ * between memo_begin and memo_end, which records the result in
+ * state->document.
+ */
+bool memo_lookup(struct parse_document *doc, const struct parser *p,
+                 struct parse_state *state, bool *matched);
+void memo_begin(struct parse_state *state, struct memo_frame *frame);
+void memo_end(struct parse_state *state, const struct parser *p,
+              const struct memo_frame *frame, bool matched);
+
+/**
+ * Bracket one step of a repetition, which runs as though inside a try():
+ * repeat_step_begin takes cp and returns the cut count to pass to
+ * repeat_step_end. A step that fails without passing a cut() is rolled back
+ * to cp; one that passed a cut() is committed, and repeat_step_end returns
+ * false if it failed, which fails the whole repetition.
+ */
+static inline size_t
+repeat_step_begin(struct parse_state *state, struct parse_checkpoint *cp)
+{
+  state_checkpoint(state, cp);
+  state->backtrack_depth += 1;
+  return state->cuts;
+}
+
+static inline bool
+repeat_step_end(struct parse_state *state, size_t cuts, bool success,
+                const struct parse_checkpoint *cp)
+{
+  state->backtrack_depth -= 1;
+  if (state->cuts == cuts) {
+    if (!success) {
+      state_restore(state, cp);
+    }
+    return true;
+  }
+  // The cut() was deferred while the step could still be rolled back.
+  if (success && state->backtrack_depth == 0) {
+    state_commit(state);
+  }
+  return success;
+}
+
+/**
+ * Make room in the output for steps more steps like the one that started at
+ * cp and just finished, if the input holds enough for them.
+ */
+void repeat_reserve(struct parse_state *state, const struct parse_checkpoint *cp,
+                    size_t steps);
+
+/**
+ * Add the counts accumulated since start to perf's run totals.
+ */
+void perf_record_run(struct parse_perf *perf,
+                     const struct parse_perf_counts *start);
+
+enum trace_event_type {
+  TRACE_ENTER,
+  TRACE_MATCH,
+  TRACE_FAIL,
+};
+
+/**
+ * Append an event for p at input position pos to trace.
+ */
+void trace_event(struct parse_trace *trace, const struct parser *p,
+                 size_t pos, enum trace_event_type type);
+
+/**
+ * Run functions of the built-in combinators, exported so that parse_static.h
+ * can lay out nodes at compile time.
+ */
+bool parser_run_blank(const struct parser *, struct parse_state *);
+bool parser_run_null(const struct parser *, struct parse_state *);
+bool parser_run_eof(const struct parser *, struct parse_state *);
+bool parser_run_cut(const struct parser *, struct parse_state *);
+bool parser_run_char(const struct parser *, struct parse_state *);
+bool parser_run_str(const struct parser *, struct parse_state *);
+bool parser_run_many(const struct parser *, struct parse_state *);
+bool parser_run_optional(const struct parser *, struct parse_state *);
+bool parser_run_try(const struct parser *, struct parse_state *);
+bool parser_run_until(const struct parser *, struct parse_state *);
+bool parser_run_or(const struct parser *, struct parse_state *);
+bool parser_run_and(const struct parser *, struct parse_state *);
+bool parser_run_execute(const struct parser *, struct parse_state *);
+bool parser_run_memo(const struct parser *, struct parse_state *);
+bool parser_run_token(const struct parser *, struct parse_state *);
+bool parser_run_pratt(const struct parser *, struct parse_state *);
+bool parser_run_repeat(const struct parser *, struct parse_state *);
+bool parser_run_sep_by(const struct parser *, struct parse_state *);
+bool parser_run_lookahead(const struct parser *, struct parse_state *);
+
+/**
+ * Store the direct children of p in children (which must have room for two)
+ * and return how many there are. Nodes that own children are freed by
+ * parser_free through this rather than recursively, so that arbitrarily deep
+ * grammars can be released.
+ */
+size_t parser_children(const struct parser *p, struct parser **children);
+
+/**
+ * Like parser_children, but returns the addresses of the child pointers so
+ * that a child can be replaced in place.
+ */
+size_t parser_child_slots(struct parser *p, struct parser ***slots);
+
+/**
+ * Write a short description of p, such as ch('a') or many, to buf (of size
+ * n, truncating as snprintf does).
+ */
+void parser_describe(const struct parser *p, char *buf, size_t n);
+
+/**
+ * A node of a tree numbered in breadth-first order, as used by the code
+ * generator and the serializer. children holds the indices of the node's
+ * children and exe_index, for exe() nodes, the node's position among them.
+ */
+struct parser_index {
+  const struct parser *p;
+  size_t children[2];
+  size_t exe_index;
+};
+
+/**
+ * Number every node of p. Returns a malloc'd array of *len entries with p
+ * first.
+ */
+struct parser_index *parser_index(const struct parser *p, size_t *len);
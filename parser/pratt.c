@@ -0,0 +1,193 @@
+#include <string.h>
+
+#include "parser/parser_internal.h"
+#include "parse.h"
+#include "state.h"
+
+/**
+ * Operator precedence parsing with an explicit operator stack (the
+ * shunting-yard algorithm), so that neither long chains of right
+ * associative operators nor deep nesting use the C stack. Each stack entry
+ * is a pending operator, with the output range of the text it matched, or
+ * the mark of an open group.
+ */
+
+#define PRATT_GROUP SIZE_MAX
+
+struct pratt_entry {
+  size_t op;
+  size_t start;
+  size_t end;
+};
+
+struct pratt_stack {
+  struct pratt_entry *entries;
+  size_t len;
+  size_t cap;
+  struct pratt_entry inline_entries[16];
+};
+
+static void
+pratt_push(struct pratt_stack *stack, struct pratt_entry entry)
+{
+  if (stack->len == stack->cap) {
+    stack->cap *= 2;
+    if (stack->entries == stack->inline_entries) {
+      stack->entries = parse_malloc(stack->cap * sizeof(struct pratt_entry));
+      memcpy(stack->entries, stack->inline_entries,
+             stack->len * sizeof(struct pratt_entry));
+    } else {
+      stack->entries = parse_realloc(
+          stack->entries, stack->cap * sizeof(struct pratt_entry));
+    }
+  }
+  stack->entries[stack->len++] = entry;
+}
+
+/**
+ * Pop the top operator and record its handler, now that both operands have
+ * been parsed.
+ */
+static void
+pratt_reduce(const struct parser_pratt *pratt, struct pratt_stack *stack,
+             struct parse_state *state)
+{
+  struct pratt_entry top = stack->entries[--stack->len];
+  const struct parse_operator *op = &pratt->ops[top.op];
+  if (op->handle) {
+    state_add_handler_n(state, op->handle, state->output + top.start,
+                        top.end - top.start, op->extra);
+  }
+}
+
+/**
+ * Run p, rolling back if it does not match. This is a lookahead of one
+ * token, not backtracking over a parsed operand.
+ */
+static bool
+pratt_probe(const struct parser *p, struct parse_state *state)
+{
+  struct parse_checkpoint cp;
+  state_checkpoint(state, &cp);
+  if (parser_run(p, state)) {
+    return true;
+  }
+  state_restore(state, &cp);
+  return false;
+}
+
+static bool
+pratt_parse(const struct parser_pratt *pratt, struct pratt_stack *stack,
+            struct parse_state *state)
+{
+  size_t groups = 0;
+  for (;;) {
+    // An operand: any number of opening brackets, then an atom.
+    while (pratt->open && pratt->close && pratt_probe(pratt->open, state)) {
+      pratt_push(stack, (struct pratt_entry){PRATT_GROUP, 0, 0});
+      groups += 1;
+    }
+    if (!parser_run(pratt->atom, state)) {
+      return false;
+    }
+
+    // Closing brackets, each finishing the operators inside it.
+    while (groups > 0 && pratt_probe(pratt->close, state)) {
+      while (stack->entries[stack->len - 1].op != PRATT_GROUP) {
+        pratt_reduce(pratt, stack, state);
+      }
+      stack->len -= 1;
+      groups -= 1;
+    }
+
+    size_t i, start = state->output_len;
+    for (i = 0; i < pratt->num_ops; i += 1) {
+      if (pratt_probe(pratt->ops[i].op, state)) {
+        break;
+      }
+    }
+    if (i == pratt->num_ops) {
+      break;
+    }
+
+    // Finish every operator on the stack that binds at least as tightly.
+    const struct parse_operator *op = &pratt->ops[i];
+    while (stack->len > 0) {
+      size_t top_op = stack->entries[stack->len - 1].op;
+      if (top_op == PRATT_GROUP) {
+        break;
+      }
+      const struct parse_operator *top = &pratt->ops[top_op];
+      if (top->precedence < op->precedence ||
+          (top->precedence == op->precedence &&
+           op->assoc == PARSE_ASSOC_RIGHT)) {
+        break;
+      }
+      pratt_reduce(pratt, stack, state);
+    }
+    pratt_push(stack, (struct pratt_entry){i, start, state->output_len});
+  }
+
+  if (groups > 0) {
+    return false;
+  }
+  while (stack->len > 0) {
+    pratt_reduce(pratt, stack, state);
+  }
+  return state_success_blank(state);
+}
+
+bool
+parser_run_pratt(const struct parser *p, struct parse_state *state)
+{
+  struct pratt_stack stack;
+  stack.entries = stack.inline_entries;
+  stack.len = 0;
+  stack.cap = sizeof(stack.inline_entries) / sizeof(struct pratt_entry);
+  bool success = pratt_parse((const struct parser_pratt *)p, &stack, state);
+  if (stack.entries != stack.inline_entries) {
+    parse_free(stack.entries);
+  }
+  return success;
+}
+
+static void
+parser_free_pratt(struct parser *p)
+{
+  struct parser_pratt *pratt = (struct parser_pratt *)p;
+  parser_free(pratt->atom);
+  if (pratt->open) {
+    parser_free(pratt->open);
+  }
+  if (pratt->close) {
+    parser_free(pratt->close);
+  }
+  for (size_t i = 0; i < pratt->num_ops; i += 1) {
+    parser_free(pratt->ops[i].op);
+  }
+  parse_free(pratt->ops);
+}
+
+struct parser *
+parser_create_pratt(
+    struct parser *atom,
+    struct parser *open,
+    struct parser *close,
+    const struct parse_operator *ops,
+    size_t num_ops)
+{
+  struct parser_pratt *parser = parse_malloc(sizeof(struct parser_pratt));
+  parser_set_defaults(&parser->parser);
+  parser->parser.kind = PARSER_PRATT;
+  parser->parser.run = parser_run_pratt;
+  parser->parser.free = parser_free_pratt;
+  parser->atom = atom;
+  parser->open = open;
+  parser->close = close;
+  parser->ops = parse_malloc(num_ops * sizeof(struct parse_operator));
+  if (num_ops) {
+    memcpy(parser->ops, ops, num_ops * sizeof(struct parse_operator));
+  }
+  parser->num_ops = num_ops;
+  return (struct parser *)parser;
+}
@@ -0,0 +1,93 @@
+#include <stdint.h>
+
+#include "parser/parser_internal.h"
+#include "parse.h"
+#include "state.h"
+
+/**
+ * Bounded repetition, which also serves count() and many1(). Each step is
+ * bracketed by a checkpoint rather than wrapped in a try() node, so a failed
+ * step is undone without any copying and the repetition ends where the last
+ * whole step did.
+ */
+
+void
+repeat_reserve(struct parse_state *state, const struct parse_checkpoint *cp,
+               size_t steps)
+{
+  size_t consumed = state->pos - cp->pos;
+  size_t produced = state->output_len - cp->output_len;
+  if (consumed > 0 && steps <= (state->input_len - state->pos) / consumed) {
+    state_output_reserve(state, steps * produced);
+  }
+}
+
+/**
+ * Whether p fails without leaving anything behind and consumes input when it
+ * matches: single bytes and choices between them.
+ */
+static bool
+repeat_atomic(const struct parser *p)
+{
+  switch (p->kind) {
+  case PARSER_CHAR:
+  case PARSER_TOKEN:
+    return true;
+  case PARSER_OR:
+    return repeat_atomic(((const struct parser_or *)p)->first)
+      && repeat_atomic(((const struct parser_or *)p)->second);
+  default:
+    return false;
+  }
+}
+
+bool
+parser_run_repeat(const struct parser *p, struct parse_state *state)
+{
+  const struct parser_repeat *r = (const struct parser_repeat *)p;
+  struct parse_checkpoint cp;
+  size_t n = 0;
+  if (r->atomic) {
+    state_checkpoint(state, &cp);
+    while (n < r->max && parser_run(r->target, state)) {
+      n += 1;
+      if (n == 1 && r->min > 1) {
+        repeat_reserve(state, &cp, r->min - 1);
+      }
+    }
+    return n >= r->min && state_success_blank(state);
+  }
+  while (n < r->max) {
+    size_t cuts = repeat_step_begin(state, &cp);
+    bool success = parser_run(r->target, state);
+    if (!repeat_step_end(state, cuts, success, &cp)) {
+      return false;
+    }
+    if (!success) {
+      break;
+    }
+    n += 1;
+    if (state->pos == cp.pos) {
+      // Every further step would match the same nothing.
+      return state_success_blank(state);
+    }
+    if (n == 1 && r->min > 1) {
+      repeat_reserve(state, &cp, r->min - 1);
+    }
+  }
+  return n >= r->min && state_success_blank(state);
+}
+
+struct parser *
+parser_create_repeat(size_t min, size_t max, struct parser *target)
+{
+  struct parser_repeat *parser = parse_malloc(sizeof(struct parser_repeat));
+  parser_set_defaults(&parser->parser);
+  parser->parser.kind = PARSER_REPEAT;
+  parser->parser.run = parser_run_repeat;
+  parser->target = target;
+  parser->min = min;
+  parser->max = max;
+  parser->atomic = repeat_atomic(target);
+  return (struct parser *)parser;
+}
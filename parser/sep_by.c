@@ -0,0 +1,63 @@
+#include "parser/parser_internal.h"
+#include "parse.h"
+#include "state.h"
+
+/**
+ * Items separated by a separator. A separator and the item after it form one
+ * step, so a separator that is not followed by an item is rolled back; in
+ * sep_end_by() they are separate steps and a final separator is kept.
+ */
+
+bool
+parser_run_sep_by(const struct parser *p, struct parse_state *state)
+{
+  const struct parser_sep_by *s = (const struct parser_sep_by *)p;
+  struct parse_checkpoint cp;
+  size_t cuts = repeat_step_begin(state, &cp);
+  bool success = parser_run(s->target, state);
+  if (!repeat_step_end(state, cuts, success, &cp)) {
+    return false;
+  }
+  while (success) {
+    size_t start = state->pos;
+    cuts = repeat_step_begin(state, &cp);
+    success = parser_run(s->sep, state);
+    if (success && s->end) {
+      repeat_step_end(state, cuts, true, &cp);
+      cuts = repeat_step_begin(state, &cp);
+    }
+    success = success && parser_run(s->target, state);
+    if (!repeat_step_end(state, cuts, success, &cp)) {
+      return false;
+    }
+    if (state->pos == start) {
+      break;
+    }
+  }
+  return state_success_blank(state);
+}
+
+static struct parser *
+sep_by_create(struct parser *target, struct parser *sep, bool end)
+{
+  struct parser_sep_by *parser = parse_malloc(sizeof(struct parser_sep_by));
+  parser_set_defaults(&parser->parser);
+  parser->parser.kind = PARSER_SEP_BY;
+  parser->parser.run = parser_run_sep_by;
+  parser->target = target;
+  parser->sep = sep;
+  parser->end = end;
+  return (struct parser *)parser;
+}
+
+struct parser *
+parser_create_sep_by(struct parser *target, struct parser *sep)
+{
+  return sep_by_create(target, sep, false);
+}
+
+struct parser *
+parser_create_sep_end_by(struct parser *target, struct parser *sep)
+{
+  return sep_by_create(target, sep, true);
+}
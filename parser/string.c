@@ -8,15 +8,10 @@
  * Parse a specified string.
  */
 
-struct parser_str {
-  struct parser parser;
-  char *str;
-};
-
-static bool
+bool
 parser_run_str(const struct parser *p, struct parse_state *state)
 {
-  char *str = ((struct parser_str *)p)->str;
+  const char *str = ((struct parser_str *)p)->literal;
   char cur;
   while (*str && state_getc(state, &cur)) {
     if (cur != *(str++)) {
@@ -30,16 +25,17 @@ parser_run_str(const struct parser *p, struct parse_state *state)
 static void
 parser_free_str(struct parser *p)
 {
-  free(((struct parser_str *)p)->str);
+  parse_free((char *)((struct parser_str *)p)->literal);
 }
 
 struct parser *
 parser_create_str(char *str)
 {
-  struct parser_str *parser = malloc(sizeof(struct parser_str));
+  struct parser_str *parser = parse_malloc(sizeof(struct parser_str));
   parser_set_defaults(&parser->parser);
+  parser->parser.kind = PARSER_STR;
   parser->parser.free = parser_free_str;
   parser->parser.run = parser_run_str;
-  parser->str = strdup(str);
+  parser->literal = parse_strdup(str);
   return (struct parser *)parser;
 }
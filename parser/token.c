@@ -0,0 +1,29 @@
+#include "parser/parser_internal.h"
+#include "parse.h"
+#include "state.h"
+
+/**
+ * Single token parser. Compares the kind of the next token, and on a match
+ * outputs the token's text.
+ */
+
+bool
+parser_run_token(const struct parser *p, struct parse_state *state)
+{
+  char b;
+  if (state_getc(state, &b) && (uint8_t)b == ((struct parser_token *)p)->kind) {
+    return state_success_token(state);
+  }
+  return false;
+}
+
+struct parser *
+parser_create_token(uint8_t kind)
+{
+  struct parser_token *parser = parse_malloc(sizeof(struct parser_token));
+  parser_set_defaults(&parser->parser);
+  parser->parser.kind = PARSER_TOKEN;
+  parser->parser.run = parser_run_token;
+  parser->kind = kind;
+  return (struct parser *)parser;
+}
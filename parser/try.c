@@ -4,40 +4,31 @@
 
 /**
  * Try to apply a given parser, rolling back input if a parsing error occurs.
+ * A cut() inside the target commits the try: it will no longer roll back.
  */
 
-struct parser_try {
-  struct parser parser;
-  struct parser *target;
-};
-
-static bool
+bool
 parser_run_try(const struct parser *p, struct parse_state *state)
 {
-  struct parse_state _state;
-  state_copy(&_state, state);
+  struct parse_checkpoint cp;
+  size_t cuts = state->cuts;
+  state_checkpoint(state, &cp);
+  state->backtrack_depth += 1;
   bool success = parser_run(((struct parser_try *)p)->target, state);
-  if (!success) {
-    state_destroy(state);
-    *state = _state;
-  } else {
-    state_destroy(&_state);
+  state->backtrack_depth -= 1;
+  if (!success && state->cuts == cuts) {
+    state_restore(state, &cp);
   }
+  state->cuts = cuts;
   return success;
 }
 
-static void
-parser_free_try(struct parser *p)
-{
-  parser_free(((struct parser_try *)p)->target);
-}
-
 struct parser *
 parser_create_try(struct parser *target)
 {
-  struct parser_try *parser = malloc(sizeof(struct parser_try));
+  struct parser_try *parser = parse_malloc(sizeof(struct parser_try));
   parser_set_defaults(&parser->parser);
-  parser->parser.free = parser_free_try;
+  parser->parser.kind = PARSER_TRY;
   parser->parser.run = parser_run_try;
   parser->target = target;
   return (struct parser *)parser;
@@ -7,20 +7,18 @@
  * Until to apply a given parser, rolling back input if a parsing error occurs.
  */
 
-struct parser_until {
-  struct parser parser;
-  struct parser *target;
-};
-
-static bool
+bool
 parser_run_until(const struct parser *p, struct parse_state *state)
 {
-  struct parse_state _state;
+  struct parse_checkpoint cp;
+  size_t cuts = state->cuts;
   while(!state_finished(state)) {
-    state_copy(&_state, state);
+    state_checkpoint(state, &cp);
+    state->backtrack_depth += 1;
     bool success = parser_run(((struct parser_until *)p)->target, state);
-    state_destroy(state);
-    *state = _state;
+    state->backtrack_depth -= 1;
+    state->cuts = cuts;
+    state_restore(state, &cp);
     if (!success) {
       // Advance one character
       char b;
@@ -34,18 +32,12 @@ parser_run_until(const struct parser *p, struct parse_state *state)
   return true;
 }
 
-static void
-parser_free_until(struct parser *p)
-{
-  parser_free(((struct parser_until *)p)->target);
-}
-
 struct parser *
 parser_create_until(struct parser *target)
 {
-  struct parser_until *parser = malloc(sizeof(struct parser_until));
+  struct parser_until *parser = parse_malloc(sizeof(struct parser_until));
   parser_set_defaults(&parser->parser);
-  parser->parser.free = parser_free_until;
+  parser->parser.kind = PARSER_UNTIL;
   parser->parser.run = parser_run_until;
   parser->target = target;
   return (struct parser *)parser;
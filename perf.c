@@ -0,0 +1,147 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "parser/parser_internal.h"
+#include "context.h"
+#include "parse.h"
+#include "profile.h"
+
+/**
+ * The counters that open are put in one perf_event group, so that a single
+ * read returns all of them, taken at the same instant. slot maps each counter
+ * to its position in the group, or -1 if it could not be opened.
+ */
+
+struct parse_perf {
+  int fds[PARSE_PERF_COUNTERS];
+  int slot[PARSE_PERF_COUNTERS];
+  size_t len;
+  struct parse_perf_counts last;
+  struct parse_perf_counts total;
+  size_t runs;
+};
+
+#ifdef __linux__
+static const uint64_t perf_configs[PARSE_PERF_COUNTERS] = {
+  [PARSE_PERF_CYCLES] = PERF_COUNT_HW_CPU_CYCLES,
+  [PARSE_PERF_INSTRUCTIONS] = PERF_COUNT_HW_INSTRUCTIONS,
+  [PARSE_PERF_BRANCH_MISSES] = PERF_COUNT_HW_BRANCH_MISSES,
+  [PARSE_PERF_CACHE_MISSES] = PERF_COUNT_HW_CACHE_MISSES,
+};
+
+static int
+perf_event_open(uint64_t config, int group)
+{
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = config;
+  attr.disabled = group < 0;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_GROUP;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+#endif
+
+struct parse_perf *
+parse_perf_open()
+{
+#ifdef __linux__
+  struct parse_perf *perf = parse_calloc(1, sizeof(struct parse_perf));
+  for (size_t i = 0; i < PARSE_PERF_COUNTERS; i += 1) {
+    int fd = perf_event_open(perf_configs[i], perf->len ? perf->fds[0] : -1);
+    perf->slot[i] = -1;
+    if (fd >= 0) {
+      perf->slot[i] = perf->len;
+      perf->fds[perf->len++] = fd;
+    }
+  }
+  if (perf->len == 0) {
+    parse_free(perf);
+    return NULL;
+  }
+  ioctl(perf->fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  return perf;
+#else
+  return NULL;
+#endif
+}
+
+void
+parse_perf_close(struct parse_perf *perf)
+{
+#ifdef __linux__
+  for (size_t i = 0; i < perf->len; i += 1) {
+    close(perf->fds[i]);
+  }
+#endif
+  parse_free(perf);
+}
+
+bool
+parse_perf_available(const struct parse_perf *perf,
+                     enum parse_perf_counter counter)
+{
+  return perf->slot[counter] >= 0;
+}
+
+void
+parse_perf_read(const struct parse_perf *perf, struct parse_perf_counts *out)
+{
+  uint64_t group[1 + PARSE_PERF_COUNTERS];
+  memset(out, 0, sizeof(struct parse_perf_counts));
+#ifdef __linux__
+  ssize_t want = (1 + perf->len) * sizeof(uint64_t);
+  if (read(perf->fds[0], group, want) != want) {
+    return;
+  }
+#endif
+  for (size_t i = 0; i < PARSE_PERF_COUNTERS; i += 1) {
+    if (perf->slot[i] >= 0) {
+      out->values[i] = group[1 + perf->slot[i]];
+    }
+  }
+}
+
+void
+parse_context_set_perf(struct parse_context *ctx, struct parse_perf *perf)
+{
+  ctx->perf = perf;
+}
+
+void
+perf_record_run(struct parse_perf *perf, const struct parse_perf_counts *start)
+{
+  parse_perf_read(perf, &perf->last);
+  for (size_t i = 0; i < PARSE_PERF_COUNTERS; i += 1) {
+    perf->last.values[i] -= start->values[i];
+    perf->total.values[i] += perf->last.values[i];
+  }
+  perf->runs += 1;
+}
+
+const struct parse_perf_counts *
+parse_perf_last_run(const struct parse_perf *perf)
+{
+  return &perf->last;
+}
+
+const struct parse_perf_counts *
+parse_perf_total(const struct parse_perf *perf, size_t *runs)
+{
+  if (runs) {
+    *runs = perf->runs;
+  }
+  return &perf->total;
+}
@@ -0,0 +1,236 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "parser/parser_internal.h"
+#include "context.h"
+#include "parse.h"
+#include "profile.h"
+#include "state.h"
+
+/**
+ * Node counters are kept in an open-addressing table keyed by node address.
+ * Each node's counters are allocated separately so that pointers to them,
+ * which the state and the iterative engine hold while a node runs, survive
+ * the table growing.
+ */
+
+struct profile_entry {
+  const struct parser *p;
+  struct parse_node_stats *stats;
+};
+
+struct parse_profile {
+  struct profile_entry *entries;
+  size_t len;
+  size_t cap;
+  struct parse_perf *perf;
+};
+
+struct parse_profile *
+parse_profile_new()
+{
+  struct parse_profile *profile = parse_malloc(sizeof(struct parse_profile));
+  profile->len = 0;
+  profile->cap = 64;
+  profile->entries = parse_calloc(profile->cap, sizeof(struct profile_entry));
+  profile->perf = NULL;
+  return profile;
+}
+
+void
+parse_profile_free(struct parse_profile *profile)
+{
+  for (size_t i = 0; i < profile->cap; i += 1) {
+    parse_free(profile->entries[i].stats);
+  }
+  parse_free(profile->entries);
+  parse_free(profile);
+}
+
+void
+parse_context_set_profile(
+    struct parse_context *ctx,
+    struct parse_profile *profile)
+{
+  ctx->state.profile = profile;
+}
+
+void
+parse_profile_set_perf(struct parse_profile *profile, struct parse_perf *perf)
+{
+  profile->perf = perf;
+}
+
+static size_t
+profile_slot(const struct profile_entry *entries, size_t cap,
+             const struct parser *p)
+{
+  size_t i = ((uintptr_t)p >> 4) * 0x9e3779b97f4a7c15ull & (cap - 1);
+  while (entries[i].p != NULL && entries[i].p != p) {
+    i = (i + 1) & (cap - 1);
+  }
+  return i;
+}
+
+static void
+profile_grow(struct parse_profile *profile)
+{
+  size_t cap = profile->cap * 2;
+  struct profile_entry *entries =
+    parse_calloc(cap, sizeof(struct profile_entry));
+  for (size_t i = 0; i < profile->cap; i += 1) {
+    if (profile->entries[i].p != NULL) {
+      entries[profile_slot(entries, cap, profile->entries[i].p)] =
+        profile->entries[i];
+    }
+  }
+  parse_free(profile->entries);
+  profile->entries = entries;
+  profile->cap = cap;
+}
+
+/**
+ * The counters for p, created on first use. The returned pointer stays valid
+ * until the profile is freed.
+ */
+static struct parse_node_stats *
+profile_stats(struct parse_profile *profile, const struct parser *p)
+{
+  size_t i = profile_slot(profile->entries, profile->cap, p);
+  if (profile->entries[i].p == NULL) {
+    if (2 * (profile->len + 1) > profile->cap) {
+      profile_grow(profile);
+      i = profile_slot(profile->entries, profile->cap, p);
+    }
+    profile->entries[i].p = p;
+    profile->entries[i].stats =
+      parse_calloc(1, sizeof(struct parse_node_stats));
+    profile->len += 1;
+  }
+  return profile->entries[i].stats;
+}
+
+const struct parse_node_stats *
+parse_profile_node(const struct parse_profile *profile, const struct parser *p)
+{
+  return profile->entries[profile_slot(profile->entries, profile->cap, p)]
+    .stats;
+}
+
+void
+profile_enter(struct parse_state *state, const struct parser *p,
+              struct profile_frame *frame)
+{
+  frame->stats = NULL;
+  frame->outer = state->profiling;
+  frame->start = state->pos;
+  if (state->profile) {
+    frame->stats = profile_stats(state->profile, p);
+    state->profiling = frame->stats;
+    if (state->profile->perf) {
+      parse_perf_read(state->profile->perf, &frame->perf);
+    }
+  }
+  if (state->trace) {
+    trace_event(state->trace, p, frame->start, TRACE_ENTER);
+  }
+}
+
+void
+profile_exit(struct parse_state *state, const struct parser *p,
+             struct profile_frame *frame, bool success)
+{
+  struct parse_node_stats *stats = frame->stats;
+  if (stats) {
+    stats->invocations += 1;
+    stats->successes += success;
+    stats->failures += !success;
+    if (state->pos > frame->start) {
+      stats->consumed += state->pos - frame->start;
+    }
+    if (state->profile->perf) {
+      struct parse_perf_counts now;
+      parse_perf_read(state->profile->perf, &now);
+      for (size_t i = 0; i < PARSE_PERF_COUNTERS; i += 1) {
+        stats->perf.values[i] += now.values[i] - frame->perf.values[i];
+      }
+    }
+  }
+  if (state->trace) {
+    trace_event(state->trace, p, state->pos,
+                success ? TRACE_MATCH : TRACE_FAIL);
+  }
+  state->profiling = frame->outer;
+}
+
+bool
+parser_run_profiled(const struct parser *p, struct parse_state *state)
+{
+  struct profile_frame frame;
+  profile_enter(state, p, &frame);
+  bool success = p->run ? (p->run)(p, state) : true;
+  profile_exit(state, p, &frame, success);
+  return success;
+}
+
+bool
+parse_profile_dump(
+    const struct parse_profile *profile,
+    const struct parser *p,
+    FILE *out)
+{
+  static const struct parse_node_stats none;
+  struct frame {
+    const struct parser *p;
+    size_t depth;
+  };
+  size_t len = 1, cap = 16;
+  struct frame *stack = parse_malloc(cap * sizeof(struct frame));
+  stack[0] = (struct frame){p, 0};
+
+  fprintf(out, "%10s %10s %10s %10s %10s",
+          "calls", "matched", "failed", "consumed", "rewinds");
+  if (profile->perf) {
+    fprintf(out, " %12s %12s %12s %12s",
+            "cycles", "instructions", "br-misses", "cache-misses");
+  }
+  fprintf(out, "  node\n");
+  while (len > 0) {
+    struct frame top = stack[--len];
+    const struct parse_node_stats *stats = parse_profile_node(profile, top.p);
+    char label[64];
+    if (stats == NULL) {
+      stats = &none;
+    }
+    parser_describe(top.p, label, sizeof(label));
+    fprintf(out, "%10llu %10llu %10llu %10llu %10llu",
+            (unsigned long long)stats->invocations,
+            (unsigned long long)stats->successes,
+            (unsigned long long)stats->failures,
+            (unsigned long long)stats->consumed,
+            (unsigned long long)stats->rewinds);
+    for (size_t i = 0; profile->perf && i < PARSE_PERF_COUNTERS; i += 1) {
+      if (parse_perf_available(profile->perf, i)) {
+        fprintf(out, " %12llu", (unsigned long long)stats->perf.values[i]);
+      } else {
+        fprintf(out, " %12s", "-");
+      }
+    }
+    fprintf(out, "  %*s%s\n", (int)(2 * top.depth), "", label);
+
+    // Push children in reverse so that they print first to last.
+    struct parser *children[2];
+    size_t n = parser_children(top.p, children);
+    if (len + n > cap) {
+      cap *= 2;
+      stack = parse_realloc(stack, cap * sizeof(struct frame));
+    }
+    for (size_t k = n; k-- > 0; ) {
+      stack[len++] = (struct frame){children[k], top.depth + 1};
+    }
+  }
+  parse_free(stack);
+  return !ferror(out);
+}
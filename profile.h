@@ -0,0 +1,192 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct parser;
+struct parse_context;
+
+/**
+ * Hardware events counted by a parse_perf.
+ */
+enum parse_perf_counter {
+  PARSE_PERF_CYCLES,
+  PARSE_PERF_INSTRUCTIONS,
+  PARSE_PERF_BRANCH_MISSES,
+  PARSE_PERF_CACHE_MISSES,
+  PARSE_PERF_COUNTERS,
+};
+
+struct parse_perf_counts {
+  uint64_t values[PARSE_PERF_COUNTERS];
+};
+
+/**
+ * Per-node execution counters. consumed is the total number of input bytes
+ * the node advanced over, rewinds the number of times the node (a try() or
+ * until(), normally) moved the input position back.
+ */
+struct parse_node_stats {
+  uint64_t invocations;
+  uint64_t successes;
+  uint64_t failures;
+  uint64_t consumed;
+  uint64_t rewinds;
+  /* Hardware events while the node ran, children included, if the profile
+   * has a parse_perf */
+  struct parse_perf_counts perf;
+};
+
+/**
+ * Collects parse_node_stats for every node run through a context that the
+ * profile is attached to. Counters are only gathered in builds with
+ * PARSER_PROFILE defined (the debug build); otherwise the hooks compile to
+ * nothing and every counter stays zero. A profile may be attached to
+ * several contexts in turn but not to two at once.
+ */
+struct parse_profile;
+
+struct parse_profile *
+parse_profile_new();
+
+void
+parse_profile_free(struct parse_profile *profile);
+
+/**
+ * Attach profile to ctx, or detach with NULL.
+ */
+void
+parse_context_set_profile(
+    struct parse_context *ctx,
+    struct parse_profile *profile);
+
+/**
+ * The counters of node p, or NULL if p has not run.
+ */
+const struct parse_node_stats *
+parse_profile_node(const struct parse_profile *profile, const struct parser *p);
+
+/**
+ * Print the tree rooted at p, one node per line and indented by depth, with
+ * each node's counters.
+ */
+bool
+parse_profile_dump(
+    const struct parse_profile *profile,
+    const struct parser *p,
+    FILE *out);
+
+/**
+ * Hardware performance counters for the calling thread, counting user-space
+ * events only. parse_perf_open returns NULL when none of the counters can be
+ * opened: on systems other than Linux, without a PMU (as in many virtual
+ * machines), or when perf_event_paranoid forbids it. Individual counters may
+ * still be missing from an open parse_perf; those read as zero.
+ *
+ * Attached to a context, a parse_perf accumulates the events of each
+ * parse_context_run, handlers included. Attached to a profile, it also
+ * attributes events to individual nodes, at the cost of reading the counters
+ * on every node entry and exit; this needs PARSER_PROFILE. A parse_perf
+ * counts the thread that opened it and must only be used on that thread.
+ */
+struct parse_perf;
+
+struct parse_perf *
+parse_perf_open();
+
+void
+parse_perf_close(struct parse_perf *perf);
+
+bool
+parse_perf_available(const struct parse_perf *perf,
+                     enum parse_perf_counter counter);
+
+/**
+ * The counts since the parse_perf was opened.
+ */
+void
+parse_perf_read(const struct parse_perf *perf, struct parse_perf_counts *out);
+
+/**
+ * Attach perf to ctx, or detach with NULL.
+ */
+void
+parse_context_set_perf(struct parse_context *ctx, struct parse_perf *perf);
+
+/**
+ * Attach perf to profile, or detach with NULL.
+ */
+void
+parse_profile_set_perf(struct parse_profile *profile, struct parse_perf *perf);
+
+/**
+ * The events of the most recent run and the totals over every run since the
+ * parse_perf was opened, with the number of runs.
+ */
+const struct parse_perf_counts *
+parse_perf_last_run(const struct parse_perf *perf);
+
+const struct parse_perf_counts *
+parse_perf_total(const struct parse_perf *perf, size_t *runs);
+
+/**
+ * Records an enter and an exit event, with the input position and a
+ * timestamp, for every node run through a context that the trace is attached
+ * to. Like profiles, traces are only gathered in builds with PARSER_PROFILE.
+ * Events accumulate over every run until the trace is cleared. Positions are
+ * offsets into the input as the state saw it, so for sessions they are
+ * relative to the unconsumed part of the stream.
+ */
+struct parse_trace;
+
+struct parse_trace *
+parse_trace_new();
+
+void
+parse_trace_free(struct parse_trace *trace);
+
+/**
+ * Drop every recorded event.
+ */
+void
+parse_trace_clear(struct parse_trace *trace);
+
+/**
+ * The number of events recorded, counting enters and exits separately.
+ */
+size_t
+parse_trace_len(const struct parse_trace *trace);
+
+/**
+ * Attach trace to ctx, or detach with NULL. A context may have both a
+ * profile and a trace attached.
+ */
+void
+parse_context_set_trace(struct parse_context *ctx, struct parse_trace *trace);
+
+/**
+ * Write the trace as folded stacks for flamegraph.pl: one line per distinct
+ * call path, such as "and;many;try;ch('a') 1520", giving the nanoseconds
+ * spent in that node itself, excluding its children. Semicolons in labels are
+ * written as commas.
+ */
+bool
+parse_trace_write_folded(const struct parse_trace *trace, FILE *out);
+
+/**
+ * Write the trace in the Chrome trace event format, as loaded by
+ * chrome://tracing and Perfetto. Each event carries the input position in
+ * its args, and exits whether the node matched.
+ */
+bool
+parse_trace_write_chrome(const struct parse_trace *trace, FILE *out);
+
+#ifdef __cplusplus
+}
+#endif
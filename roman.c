@@ -0,0 +1,123 @@
+#include <stdbool.h>
+#include <string.h>
+
+#include "parse.h"
+#include "roman.h"
+
+static bool
+parsed_x(char *xs, void *total)
+{
+  *(int *)total += 10 * strlen(xs);
+  return true;
+}
+
+static bool
+parsed_v(char *vs, void *total)
+{
+  *(int *)total += 5 * strlen(vs);
+  return true;
+}
+
+static bool
+parsed_i(char *is, void *total)
+{
+  *(int *)total += strlen(is);
+  return true;
+}
+
+static bool
+parsed_iv(char *iv, void *total)
+{
+  (void)iv;
+  *(int *)total += 4;
+  return true;
+}
+
+struct parser *
+roman_numeral_basic(int *total)
+{
+  return and(exe(many(ch('X')), parsed_x, total),
+             exe(many(ch('V')), parsed_v, total),
+             exe(many(ch('I')), parsed_i, total),
+             eof);
+}
+
+struct parser *
+roman_numeral_simple(int *total)
+{
+  struct parser *parse_xs = exe(many(ch('X')), parsed_x, total);
+  struct parser *parse_vs = exe(many(ch('V')), parsed_v, total);
+  struct parser *parse_is = or(try(exe(str("IV"), parsed_iv, total)),
+                       exe(many(ch('I')), parsed_i, total));
+  return and(parse_xs, parse_vs, parse_is, eof);
+}
+
+static int
+value(char c)
+{
+  switch(c) {
+  case 'I':
+    return 1;
+  case 'V':
+    return 5;
+  case 'X':
+    return 10;
+  case 'L':
+    return 50;
+  case 'C':
+    return 100;
+  case 'D':
+    return 500;
+  case 'M':
+    return 1000;
+  default:
+    return -1;
+  }
+}
+
+static bool
+add_value(char *letter, void *total)
+{
+  *(size_t *)total += value(*letter);
+  return true;
+}
+
+static bool
+sub_value(char *letter, void *total)
+{
+  *(size_t *)total -= value(*letter);
+  return true;
+}
+
+static struct parser *
+pair(char a, char b, void *total)
+{
+  return and(exe(ch(a), sub_value, total),
+             exe(ch(b), add_value, total));
+}
+
+static struct parser *
+single(char a, size_t *total)
+{
+  return optional(many(exe(ch(a), add_value, total)));
+}
+
+struct parser *
+roman_numeral(size_t *total)
+{
+  struct parser *parse_m = single('M', total);
+  struct parser *parse_d = single('D', total);
+  struct parser *parse_c = or(try(pair('C', 'M', total)),
+                      try(pair('C', 'D', total)),
+                      single('C', total));
+  struct parser *parse_l = single('L', total);
+  struct parser *parse_x = or(try(pair('X', 'C', total)),
+                      try(pair('X', 'L', total)),
+                      single('X', total));
+  struct parser *parse_v = single('V', total);
+  struct parser *parse_i = or(try(pair('I', 'X', total)),
+                      try(pair('I', 'V', total)),
+                      single('I', total));
+  return and(parse_m, parse_d, parse_c, parse_l, parse_x,
+              parse_v, parse_i, eof);
+}
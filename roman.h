@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stddef.h>
+
+struct parser;
+
+/**
+ * Roman numeral grammars shared by the tests. Each adds the value of the
+ * numeral it matches to total through its exe() handlers.
+ */
+
+/**
+ * X*V*I* followed by the end of input.
+ */
+struct parser *roman_numeral_basic(int *total);
+
+/**
+ * Like roman_numeral_basic, but also accepts IV in place of the I's.
+ */
+struct parser *roman_numeral_simple(int *total);
+
+/**
+ * Any numeral written with M, D, C, L, X, V and I, including the
+ * subtractive pairs.
+ */
+struct parser *roman_numeral(size_t *total);
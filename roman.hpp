@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+
+#include "parse.hpp"
+
+/**
+ * roman_numeral from roman.c written with parse.hpp, for comparing the two
+ * front ends.
+ */
+
+inline int
+roman_value(char c)
+{
+  switch (c) {
+  case 'I': return 1;
+  case 'V': return 5;
+  case 'X': return 10;
+  case 'L': return 50;
+  case 'C': return 100;
+  case 'D': return 500;
+  case 'M': return 1000;
+  default: return -1;
+  }
+}
+
+inline auto
+roman_numeral_hpp(std::size_t &total)
+{
+  using namespace parse;
+  auto add = [&total](char *letter) {
+    total += roman_value(*letter);
+    return true;
+  };
+  auto sub = [&total](char *letter) {
+    total -= roman_value(*letter);
+    return true;
+  };
+  auto single = [add](char a) { return optional(many(exe(ch(a), add))); };
+  auto pair = [add, sub](char a, char b) {
+    return seq(exe(ch(a), sub), exe(ch(b), add));
+  };
+  return seq(single('M'), single('D'),
+             alt(try_(pair('C', 'M')), try_(pair('C', 'D')), single('C')),
+             single('L'),
+             alt(try_(pair('X', 'C')), try_(pair('X', 'L')), single('X')),
+             single('V'),
+             alt(try_(pair('I', 'X')), try_(pair('I', 'V')), single('I')),
+             eof());
+}
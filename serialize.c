@@ -0,0 +1,581 @@
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "parser/parser_internal.h"
+#include "parse.h"
+#include "state.h"
+
+/**
+ * Flat grammar images. An image is a header, an array of fixed-size nodes
+ * numbered as by parser_index, and a data section holding str() literals
+ * and DFA tables. Nodes refer to each other by index and to data by offset,
+ * so an image works wherever it is mapped and is interpreted in place:
+ * loading is a single mmap and its pages are shared by every process that
+ * maps the same file. Images use the host's byte order.
+ */
+
+#define FLAT_MAGIC "SPCG"
+#define FLAT_VERSION 1
+
+struct flat_header {
+  char magic[4];
+  uint32_t version;
+  uint32_t num_nodes;
+  uint32_t num_exes;
+  uint32_t data_len;
+};
+
+/**
+ * CHAR keeps its character in c. STR keeps the offset and length of its
+ * literal in a and b, DFA the offset of a struct flat_dfa in a. Every other
+ * kind keeps its children in a and b, EXECUTE its exe() index in b, REPEAT
+ * the offset of a struct flat_repeat in b, SEP_BY whether it is
+ * sep_end_by() in c and LOOKAHEAD whether it is not() in c.
+ */
+struct flat_node {
+  uint8_t kind;
+  char c;
+  uint16_t unused;
+  uint32_t a;
+  uint32_t b;
+};
+
+/**
+ * Followed by classes[256] and then the rows of states 2 and up.
+ */
+struct flat_dfa {
+  uint32_t num_classes;
+  uint32_t num_states;
+  uint32_t start;
+};
+
+/**
+ * max is UINT32_MAX for no limit.
+ */
+struct flat_repeat {
+  uint32_t min;
+  uint32_t max;
+};
+
+struct parser_flat {
+  struct parser parser;
+  void *map;
+  size_t map_len;
+  const struct flat_node *nodes;
+  const uint8_t *data;
+  struct parser_exe_binding *exes;
+};
+
+static size_t
+flat_align(size_t n)
+{
+  return (n + 3) & ~(size_t)3;
+}
+
+static size_t
+flat_dfa_size(uint32_t num_classes, uint32_t num_states)
+{
+  size_t rows = num_states > 2 ? num_states - 2 : 0;
+  return sizeof(struct flat_dfa) + 256
+    + rows * (num_classes + 1) * sizeof(uint32_t);
+}
+
+bool
+parser_serialize(const struct parser *p, FILE *out)
+{
+  size_t len, exes = 0, data_len = 0;
+  struct parser_index *index = parser_index(p, &len);
+  struct flat_node *nodes = parse_calloc(len, sizeof(struct flat_node));
+  bool success = true;
+
+  // Lay out the nodes and size the data section.
+  for (size_t i = 0; i < len && success; i += 1) {
+    const struct parser *node = index[i].p;
+    struct flat_node *flat = &nodes[i];
+    flat->kind = node->kind;
+    flat->a = index[i].children[0];
+    flat->b = index[i].children[1];
+    switch (node->kind) {
+    case PARSER_CHAR:
+      flat->c = ((const struct parser_char *)node)->c;
+      break;
+    case PARSER_TOKEN:
+      flat->c = ((const struct parser_token *)node)->kind;
+      break;
+    case PARSER_STR: {
+      const char *literal = ((const struct parser_str *)node)->literal;
+      flat->a = data_len;
+      flat->b = strlen(literal);
+      data_len = flat_align(data_len + flat->b);
+      break;
+    }
+    case PARSER_DFA: {
+      const struct parser_dfa *dfa = (const struct parser_dfa *)node;
+      flat->a = data_len;
+      data_len += flat_dfa_size(dfa->num_classes, dfa->num_states);
+      break;
+    }
+    case PARSER_EXECUTE:
+      flat->b = exes++;
+      break;
+    case PARSER_REPEAT: {
+      const struct parser_repeat *r = (const struct parser_repeat *)node;
+      success = r->min < UINT32_MAX
+        && (r->max < UINT32_MAX || r->max == SIZE_MAX);
+      flat->b = data_len;
+      data_len += sizeof(struct flat_repeat);
+      break;
+    }
+    case PARSER_SEP_BY:
+      flat->c = ((const struct parser_sep_by *)node)->end;
+      break;
+    case PARSER_LOOKAHEAD:
+      flat->c = ((const struct parser_lookahead *)node)->negate;
+      break;
+    case PARSER_OTHER:
+    case PARSER_PRATT:
+      success = false;
+      break;
+    default:
+      break;
+    }
+  }
+
+  struct flat_header header;
+  memcpy(header.magic, FLAT_MAGIC, 4);
+  header.version = FLAT_VERSION;
+  header.num_nodes = len;
+  header.num_exes = exes;
+  header.data_len = data_len;
+  success = success
+    && fwrite(&header, sizeof(header), 1, out) == 1
+    && fwrite(nodes, sizeof(struct flat_node), len, out) == len;
+
+  // Then the data, in the same order.
+  static const char zeros[4];
+  for (size_t i = 0; i < len && success; i += 1) {
+    const struct parser *node = index[i].p;
+    if (node->kind == PARSER_STR) {
+      size_t n = nodes[i].b;
+      success = fwrite(((const struct parser_str *)node)->literal, 1, n, out)
+        == n && fwrite(zeros, 1, flat_align(n) - n, out) == flat_align(n) - n;
+    } else if (node->kind == PARSER_DFA) {
+      const struct parser_dfa *dfa = (const struct parser_dfa *)node;
+      struct flat_dfa head = {dfa->num_classes, dfa->num_states, dfa->start};
+      size_t width = dfa->num_classes + 1;
+      size_t rows = dfa->num_states > 2 ? dfa->num_states - 2 : 0;
+      success = fwrite(&head, sizeof(head), 1, out) == 1
+        && fwrite(dfa->classes, 1, 256, out) == 256
+        && fwrite(dfa->table + 2 * width, sizeof(uint32_t), rows * width, out)
+           == rows * width;
+    } else if (node->kind == PARSER_REPEAT) {
+      const struct parser_repeat *r = (const struct parser_repeat *)node;
+      struct flat_repeat counts = {
+        r->min, r->max == SIZE_MAX ? UINT32_MAX : r->max};
+      success = fwrite(&counts, sizeof(counts), 1, out) == 1;
+    }
+  }
+
+  parse_free(index);
+  parse_free(nodes);
+  return success && !ferror(out);
+}
+
+static bool flat_run(const struct parser_flat *g, uint32_t i,
+                     struct parse_state *state);
+
+static bool
+flat_run_dfa(const struct parser_flat *g, const struct flat_node *node,
+             struct parse_state *state)
+{
+  const struct flat_dfa *dfa = (const struct flat_dfa *)(g->data + node->a);
+  const uint8_t *classes = (const uint8_t *)(dfa + 1);
+  const uint32_t *table = (const uint32_t *)(classes + 256);
+  const uint8_t *input = (const uint8_t *)state->input;
+  uint32_t width = dfa->num_classes + 1;
+  size_t start = state->pos, pos = start, len = state->input_len;
+  uint32_t s = dfa->start;
+
+  while (s > DFA_MATCH) {
+    uint32_t c = dfa->num_classes;
+    if (pos < len) {
+      c = classes[input[pos]];
+    } else {
+      state->starved |= state->partial;
+    }
+    uint32_t next = table[(s - 2) * width + c];
+    pos += (next & DFA_CONSUME) != 0;
+    s = next & ~DFA_CONSUME;
+  }
+
+  state_output_append_n(state, state->input + start, pos - start);
+  state->pos = pos;
+  state_examine(state);
+  return s == DFA_MATCH;
+}
+
+/**
+ * The run function of each kind, over flat nodes.
+ */
+static bool
+flat_run(const struct parser_flat *g, uint32_t i, struct parse_state *state)
+{
+  const struct flat_node *node = &g->nodes[i];
+  switch (node->kind) {
+  case PARSER_BLANK:
+    return state_success_blank(state);
+
+  case PARSER_NULL:
+    return false;
+
+  case PARSER_EOF:
+    if (state_finished(state)) {
+      return state_success_blank(state);
+    }
+    return false;
+
+  case PARSER_CUT:
+    state->cuts += 1;
+    if (state->backtrack_depth == 0) {
+      state_commit(state);
+    }
+    return state_success_blank(state);
+
+  case PARSER_CHAR: {
+    char b;
+    if (state_getc(state, &b) && b == node->c) {
+      return state_success(state, b);
+    }
+    return false;
+  }
+
+  case PARSER_TOKEN: {
+    char b;
+    if (state_getc(state, &b) && b == node->c) {
+      return state_success_token(state);
+    }
+    return false;
+  }
+
+  case PARSER_STR: {
+    const char *literal = (const char *)g->data + node->a;
+    char cur;
+    for (uint32_t k = 0; k < node->b && state_getc(state, &cur); k += 1) {
+      if (cur != literal[k]) {
+        return false;
+      }
+      state_success(state, cur);
+    }
+    return true;
+  }
+
+  case PARSER_MANY:
+    state_success_blank(state);
+    while (flat_run(g, node->a, state)) {
+    }
+    return true;
+
+  case PARSER_OPTIONAL: {
+    size_t pos = state->pos;
+    if (!flat_run(g, node->a, state) && pos != state->pos) {
+      return false;
+    }
+    return state_success_blank(state);
+  }
+
+  case PARSER_TRY: {
+    struct parse_checkpoint cp;
+    size_t cuts = state->cuts;
+    state_checkpoint(state, &cp);
+    state->backtrack_depth += 1;
+    bool success = flat_run(g, node->a, state);
+    state->backtrack_depth -= 1;
+    if (!success && state->cuts == cuts) {
+      state_restore(state, &cp);
+    }
+    state->cuts = cuts;
+    return success;
+  }
+
+  case PARSER_UNTIL: {
+    struct parse_checkpoint cp;
+    size_t cuts = state->cuts;
+    while (!state_finished(state)) {
+      state_checkpoint(state, &cp);
+      state->backtrack_depth += 1;
+      bool success = flat_run(g, node->a, state);
+      state->backtrack_depth -= 1;
+      state->cuts = cuts;
+      state_restore(state, &cp);
+      if (success) {
+        return true;
+      }
+      state_success(state, state->input[state->pos]);
+    }
+    return state_success_blank(state);
+  }
+
+  case PARSER_REPEAT: {
+    const struct flat_repeat *r =
+      (const struct flat_repeat *)(g->data + node->b);
+    size_t max = r->max == UINT32_MAX ? SIZE_MAX : r->max;
+    struct parse_checkpoint cp;
+    size_t n = 0;
+    while (n < max) {
+      size_t cuts = repeat_step_begin(state, &cp);
+      bool success = flat_run(g, node->a, state);
+      if (!repeat_step_end(state, cuts, success, &cp)) {
+        return false;
+      }
+      if (!success) {
+        break;
+      }
+      n += 1;
+      if (state->pos == cp.pos) {
+        return state_success_blank(state);
+      }
+      if (n == 1 && r->min > 1) {
+        repeat_reserve(state, &cp, r->min - 1);
+      }
+    }
+    return n >= r->min && state_success_blank(state);
+  }
+
+  case PARSER_SEP_BY: {
+    struct parse_checkpoint cp;
+    size_t cuts = repeat_step_begin(state, &cp);
+    bool success = flat_run(g, node->a, state);
+    if (!repeat_step_end(state, cuts, success, &cp)) {
+      return false;
+    }
+    while (success) {
+      size_t start = state->pos;
+      cuts = repeat_step_begin(state, &cp);
+      success = flat_run(g, node->b, state);
+      if (success && node->c) {
+        repeat_step_end(state, cuts, true, &cp);
+        cuts = repeat_step_begin(state, &cp);
+      }
+      success = success && flat_run(g, node->a, state);
+      if (!repeat_step_end(state, cuts, success, &cp)) {
+        return false;
+      }
+      if (state->pos == start) {
+        break;
+      }
+    }
+    return state_success_blank(state);
+  }
+
+  case PARSER_LOOKAHEAD: {
+    struct parse_checkpoint cp;
+    size_t cuts = state->cuts;
+    state_checkpoint(state, &cp);
+    state->backtrack_depth += 1;
+    bool success = flat_run(g, node->a, state);
+    state->backtrack_depth -= 1;
+    state->cuts = cuts;
+    state_restore(state, &cp);
+    return success != (node->c != 0) && state_success_blank(state);
+  }
+
+  case PARSER_OR:
+    return flat_run(g, node->a, state) || flat_run(g, node->b, state);
+
+  case PARSER_AND:
+    return flat_run(g, node->a, state) && flat_run(g, node->b, state);
+
+  case PARSER_EXECUTE: {
+    const struct parser_exe_binding *exe = &g->exes[node->b];
+    size_t start = state->output_len;
+    state->capture_depth += 1;
+    bool success = flat_run(g, node->a, state);
+    state->capture_depth -= 1;
+    if (!success) {
+      state_output_truncate(state, start);
+      return false;
+    }
+    state_success_blank(state);
+    state_add_handler_n(state, exe->handle, state->output + start,
+                        state->output_len - start, exe->extra);
+    return true;
+  }
+
+  case PARSER_DFA:
+    return flat_run_dfa(g, node, state);
+
+  case PARSER_MEMO:
+    return flat_run(g, node->a, state);
+
+  default:
+    return false;
+  }
+}
+
+static bool
+parser_run_flat(const struct parser *p, struct parse_state *state)
+{
+  return flat_run((const struct parser_flat *)p, 0, state);
+}
+
+static void
+parser_free_flat(struct parser *p)
+{
+  struct parser_flat *g = (struct parser_flat *)p;
+  munmap(g->map, g->map_len);
+  parse_free(g->exes);
+}
+
+/**
+ * Check everything the interpreter relies on, so that a damaged or hostile
+ * file is rejected instead of read out of bounds. Children must come after
+ * their parents, which also rules out cycles.
+ */
+static bool
+flat_validate(const uint8_t *map, size_t len)
+{
+  const struct flat_header *header = (const struct flat_header *)map;
+  if (len < sizeof(*header) || memcmp(header->magic, FLAT_MAGIC, 4) != 0
+      || header->version != FLAT_VERSION || header->num_nodes == 0) {
+    return false;
+  }
+  size_t nodes_len = (size_t)header->num_nodes * sizeof(struct flat_node);
+  if (len - sizeof(*header) < nodes_len
+      || len - sizeof(*header) - nodes_len != header->data_len) {
+    return false;
+  }
+
+  const struct flat_node *nodes = (const struct flat_node *)(header + 1);
+  const uint8_t *data = (const uint8_t *)(nodes + header->num_nodes);
+  size_t data_len = header->data_len;
+  for (uint32_t i = 0; i < header->num_nodes; i += 1) {
+    const struct flat_node *node = &nodes[i];
+    bool children = false, second = false;
+    switch (node->kind) {
+    case PARSER_BLANK:
+    case PARSER_NULL:
+    case PARSER_EOF:
+    case PARSER_CUT:
+    case PARSER_CHAR:
+    case PARSER_TOKEN:
+      break;
+    case PARSER_STR:
+      if (node->a > data_len || node->b > data_len - node->a) {
+        return false;
+      }
+      break;
+    case PARSER_DFA: {
+      if (node->a % 4 != 0 || node->a > data_len
+          || data_len - node->a < sizeof(struct flat_dfa)) {
+        return false;
+      }
+      const struct flat_dfa *dfa = (const struct flat_dfa *)(data + node->a);
+      const uint8_t *classes = (const uint8_t *)(dfa + 1);
+      if (dfa->num_classes > 256 || dfa->num_states < 2
+          || dfa->start >= dfa->num_states
+          || data_len - node->a < flat_dfa_size(dfa->num_classes,
+                                                dfa->num_states)) {
+        return false;
+      }
+      for (size_t c = 0; c < 256; c += 1) {
+        if (classes[c] >= dfa->num_classes) {
+          return false;
+        }
+      }
+      const uint32_t *table = (const uint32_t *)(classes + 256);
+      size_t entries = (size_t)(dfa->num_states - 2) * (dfa->num_classes + 1);
+      for (size_t e = 0; e < entries; e += 1) {
+        if ((table[e] & ~DFA_CONSUME) >= dfa->num_states) {
+          return false;
+        }
+      }
+      break;
+    }
+    case PARSER_EXECUTE:
+      children = true;
+      if (node->b >= header->num_exes) {
+        return false;
+      }
+      break;
+    case PARSER_MANY:
+    case PARSER_OPTIONAL:
+    case PARSER_TRY:
+    case PARSER_UNTIL:
+    case PARSER_MEMO:
+    case PARSER_LOOKAHEAD:
+      children = true;
+      break;
+    case PARSER_REPEAT:
+      children = true;
+      if (node->b % 4 != 0 || node->b > data_len
+          || data_len - node->b < sizeof(struct flat_repeat)) {
+        return false;
+      }
+      break;
+    case PARSER_OR:
+    case PARSER_AND:
+    case PARSER_SEP_BY:
+      children = second = true;
+      break;
+    default:
+      return false;
+    }
+    if (children && (node->a <= i || node->a >= header->num_nodes)) {
+      return false;
+    }
+    if (second && (node->b <= i || node->b >= header->num_nodes)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+struct parser *
+parser_load_mmap(
+    const char *path,
+    const struct parser_exe_binding *exes,
+    size_t num_exes)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (map == MAP_FAILED) {
+    return NULL;
+  }
+
+  const struct flat_header *header = map;
+  if (!flat_validate(map, st.st_size) || header->num_exes > num_exes) {
+    munmap(map, st.st_size);
+    return NULL;
+  }
+
+  struct parser_flat *g = parse_malloc(sizeof(struct parser_flat));
+  parser_set_defaults(&g->parser);
+  g->parser.run = parser_run_flat;
+  g->parser.free = parser_free_flat;
+  g->map = map;
+  g->map_len = st.st_size;
+  g->nodes = (const struct flat_node *)(header + 1);
+  g->data = (const uint8_t *)(g->nodes + header->num_nodes);
+  g->exes = parse_malloc((header->num_exes + 1) *
+                         sizeof(struct parser_exe_binding));
+  if (header->num_exes > 0) {
+    memcpy(g->exes, exes,
+           header->num_exes * sizeof(struct parser_exe_binding));
+  }
+  return &g->parser;
+}
@@ -0,0 +1,135 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "parser/engine.h"
+#include "parser/parser_internal.h"
+#include "parse.h"
+#include "state.h"
+
+/**
+ * Push-style sessions. Input is accumulated in a buffer owned by the session
+ * and parsed on the iterative engine with the state marked partial. When the
+ * engine needs a byte that has not arrived yet it suspends with its frame
+ * stack intact, and the next feed resumes it where it stopped.
+ *
+ * Whenever the parse has passed a top-level cut() the input and output before
+ * it are dropped from the front of the buffers and the engine is rebased, so
+ * memory is bounded by the distance between cuts rather than the stream.
+ */
+
+struct parser_session {
+  struct parse_state state;
+  struct engine engine;
+  char *buffer;
+  size_t len;
+  size_t cap;
+  enum parse_status status;
+};
+
+struct parser_session *
+parser_session_new(const struct parser *p)
+{
+  struct parser_session *s = parse_malloc(sizeof(struct parser_session));
+  s->buffer = NULL;
+  s->len = 0;
+  s->cap = 0;
+  s->status = PARSE_NEED_MORE;
+  state_create_len(&s->state, "", 0);
+  s->state.partial = true;
+  engine_create(&s->engine);
+  engine_start(&s->engine, p);
+  return s;
+}
+
+void
+parser_session_free(struct parser_session *s)
+{
+  state_destroy(&s->state);
+  engine_destroy(&s->engine);
+  parse_free(s->buffer);
+  parse_free(s);
+}
+
+static void
+parser_session_trim(struct parser_session *s)
+{
+  struct parse_state *state = &s->state;
+  size_t in = state->committed, out = state->output_committed;
+  if (in > 0) {
+    memmove(s->buffer, s->buffer + in, s->len - in);
+    s->len -= in;
+    state->input_len -= in;
+    state->pos -= in;
+    state->committed = 0;
+  }
+  if (out > 0) {
+    memmove(state->output, state->output + out, state->output_len - out + 1);
+    state->output_len -= out;
+    state->output_committed = 0;
+  }
+  if (in > 0 || out > 0) {
+    engine_rebase(&s->engine, in, out);
+  }
+}
+
+static enum parse_status
+parser_session_resume(struct parser_session *s)
+{
+  s->state.input = s->buffer ? s->buffer : "";
+  s->state.input_len = s->len;
+  switch (engine_resume(&s->engine, &s->state)) {
+  case ENGINE_SUSPENDED:
+    parser_session_trim(s);
+    return PARSE_NEED_MORE;
+  case ENGINE_MATCH:
+    state_execute(&s->state);
+    state_success_blank(&s->state);
+    return s->status = PARSE_MATCH;
+  default:
+    return s->status = PARSE_FAIL;
+  }
+}
+
+enum parse_status
+parser_session_feed(struct parser_session *s, const char *bytes, size_t n)
+{
+  if (s->status != PARSE_NEED_MORE) {
+    return s->status;
+  }
+  if (s->len + n > s->cap) {
+    s->cap = s->cap ? s->cap : 64;
+    while (s->cap < s->len + n) {
+      s->cap *= 2;
+    }
+    s->buffer = parse_realloc(s->buffer, s->cap);
+  }
+  memcpy(s->buffer + s->len, bytes, n);
+  s->len += n;
+  return parser_session_resume(s);
+}
+
+enum parse_status
+parser_session_finish(struct parser_session *s)
+{
+  if (s->status != PARSE_NEED_MORE) {
+    return s->status;
+  }
+  s->state.partial = false;
+  return parser_session_resume(s);
+}
+
+const char *
+parser_session_output(struct parser_session *s)
+{
+  if (s->status != PARSE_MATCH) {
+    return NULL;
+  }
+  return s->state.output;
+}
+
+size_t
+parser_session_buffered(struct parser_session *s)
+{
+  return s->len;
+}
@@ -0,0 +1,280 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "parser/parser_internal.h"
+#include "batch.h"
+#include "parse.h"
+#include "state.h"
+
+/**
+ * Speculative parallel parsing of many(record). The input is cut at guessed
+ * offsets and every chunk is handed to a worker, which slides forward from
+ * its guess until the record parser matches and then parses records until one
+ * starts past the end of its chunk. Chunk 0 starts at offset 0 and so is
+ * always right.
+ *
+ * Stitching then walks the chunks in order with the true end position of
+ * the previous chunk. A record parse depends only on its start position, so
+ * if that position is one of the chunk's record starts every record from
+ * there on is exactly what a sequential parse would produce. Otherwise the
+ * speculation was wrong and records are re-parsed sequentially until they
+ * land on one of the chunk's starts again or leave the chunk.
+ */
+
+#define CHUNKS_PER_THREAD 4
+#define CHUNK_MIN_SIZE (64 * 1024)
+
+struct spec_record {
+  size_t start;
+  size_t end;
+  size_t h_begin;
+  size_t h_end;
+};
+
+struct spec_chunk {
+  struct parse_state state;
+  struct spec_record *records;
+  size_t num_records;
+  size_t records_cap;
+  /* True if the last record starting inside the chunk failed to match */
+  bool stopped;
+};
+
+struct spec {
+  const struct parser *record;
+  const char *input;
+  size_t len;
+  size_t *bounds;
+  struct spec_chunk *chunks;
+};
+
+/**
+ * Parse one record at the state's current position, as try(record) would. A
+ * record that matches without consuming input counts as a failure so that
+ * the repetition always terminates.
+ */
+static bool
+spec_parse_record(const struct parser *record, struct parse_state *state,
+                  struct spec_record *out)
+{
+  struct parse_checkpoint cp;
+  state_checkpoint(state, &cp);
+  out->start = state->pos;
+  out->h_begin = state->num_outputs;
+  if (!parser_run(record, state) || state->pos == cp.pos) {
+    state_restore(state, &cp);
+    return false;
+  }
+  out->end = state->pos;
+  out->h_end = state->num_outputs;
+  state_output_truncate(state, 0);
+  return true;
+}
+
+static void
+spec_push(struct spec_chunk *chunk, struct spec_record *rec)
+{
+  if (chunk->num_records == chunk->records_cap) {
+    chunk->records_cap = chunk->records_cap ? chunk->records_cap * 2 : 64;
+    chunk->records = parse_realloc(
+        chunk->records, chunk->records_cap * sizeof(struct spec_record));
+  }
+  chunk->records[chunk->num_records++] = *rec;
+}
+
+static void
+spec_run_chunk(void *arg, struct parse_context *ctx, size_t i)
+{
+  (void)ctx;
+  struct spec *spec = arg;
+  struct spec_chunk *chunk = &spec->chunks[i];
+  size_t begin = spec->bounds[i], end = spec->bounds[i + 1];
+  struct spec_record rec;
+
+  memset(chunk, 0, sizeof(struct spec_chunk));
+  state_create_len(&chunk->state, spec->input, spec->len);
+  // Speculative records may be thrown away, so a cut() must not commit them.
+  chunk->state.backtrack_depth = 1;
+
+  // Resynchronise: find the first offset where a record matches.
+  size_t start = begin;
+  for (; i > 0 && start < end; start += 1) {
+    chunk->state.pos = start;
+    if (spec_parse_record(spec->record, &chunk->state, &rec)) {
+      spec_push(chunk, &rec);
+      break;
+    }
+  }
+  if (i == 0) {
+    chunk->state.pos = 0;
+  } else if (start == end) {
+    return;
+  }
+
+  while (chunk->state.pos < end) {
+    if (!spec_parse_record(spec->record, &chunk->state, &rec)) {
+      chunk->stopped = true;
+      return;
+    }
+    spec_push(chunk, &rec);
+  }
+}
+
+/**
+ * Index of the record starting exactly at pos, or num_records.
+ */
+static size_t
+spec_find(struct spec_chunk *chunk, size_t pos)
+{
+  size_t lo = 0, hi = chunk->num_records;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (chunk->records[mid].start < pos) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo < chunk->num_records && chunk->records[lo].start == pos) {
+    return lo;
+  }
+  return chunk->num_records;
+}
+
+struct spec_segment {
+  struct parse_state *state;
+  size_t h_begin;
+  size_t h_end;
+};
+
+struct spec_stitch {
+  struct spec_segment *segments;
+  size_t num_segments;
+  size_t segments_cap;
+  size_t reparsed;
+};
+
+static void
+spec_emit(struct spec_stitch *st, struct parse_state *state,
+          size_t h_begin, size_t h_end)
+{
+  if (h_begin == h_end) {
+    return;
+  }
+  if (st->num_segments > 0) {
+    struct spec_segment *last = &st->segments[st->num_segments - 1];
+    if (last->state == state && last->h_end == h_begin) {
+      last->h_end = h_end;
+      return;
+    }
+  }
+  if (st->num_segments == st->segments_cap) {
+    st->segments_cap = st->segments_cap ? st->segments_cap * 2 : 16;
+    st->segments = parse_realloc(
+        st->segments, st->segments_cap * sizeof(struct spec_segment));
+  }
+  st->segments[st->num_segments++] =
+    (struct spec_segment){state, h_begin, h_end};
+}
+
+/**
+ * Walk the chunks in order, accepting speculative records that start at the
+ * true position and re-parsing where the speculation missed. Returns the
+ * position a sequential many(try(record)) would stop at.
+ */
+static size_t
+spec_stitch(struct spec *spec, size_t n, struct parse_state *redo,
+            struct spec_stitch *st)
+{
+  size_t cur = 0;
+  for (size_t i = 0; i < n; i += 1) {
+    struct spec_chunk *chunk = &spec->chunks[i];
+    size_t end = spec->bounds[i + 1];
+    struct spec_record rec;
+
+    while (cur < end) {
+      size_t found = spec_find(chunk, cur);
+      if (found < chunk->num_records) {
+        struct spec_record *last = &chunk->records[chunk->num_records - 1];
+        spec_emit(st, &chunk->state, chunk->records[found].h_begin,
+                  last->h_end);
+        cur = last->end;
+        if (chunk->stopped) {
+          return cur;
+        }
+        break;
+      }
+      // Mis-speculated: parse the next record ourselves.
+      redo->pos = cur;
+      if (!spec_parse_record(spec->record, redo, &rec)) {
+        return cur;
+      }
+      st->reparsed += 1;
+      spec_emit(st, redo, rec.h_begin, rec.h_end);
+      cur = rec.end;
+    }
+  }
+  return cur;
+}
+
+bool
+run_speculative(
+    const struct parser *record,
+    const char *input,
+    size_t len,
+    size_t nthreads,
+    struct parse_result *result)
+{
+  if (nthreads == 0) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = online > 0 ? (size_t)online : 1;
+  }
+  size_t n = nthreads * CHUNKS_PER_THREAD;
+  if (len / n < CHUNK_MIN_SIZE) {
+    n = len / CHUNK_MIN_SIZE + 1;
+  }
+
+  struct spec spec;
+  spec.record = record;
+  spec.input = input;
+  spec.len = len;
+  spec.bounds = parse_malloc((n + 1) * sizeof(size_t));
+  for (size_t i = 0; i < n; i += 1) {
+    spec.bounds[i] = len / n * i;
+  }
+  spec.bounds[n] = len;
+  spec.chunks = parse_malloc(n * sizeof(struct spec_chunk));
+
+  batch_for_each(n, nthreads, spec_run_chunk, &spec);
+
+  struct parse_state redo;
+  struct spec_stitch st;
+  memset(&st, 0, sizeof(st));
+  state_create_len(&redo, input, len);
+  redo.backtrack_depth = 1;
+  size_t stop = spec_stitch(&spec, n, &redo, &st);
+
+  bool success = stop == len;
+  if (success) {
+    for (size_t i = 0; i < st.num_segments; i += 1) {
+      struct spec_segment *seg = &st.segments[i];
+      state_execute_range(seg->state, seg->h_begin, seg->h_end);
+    }
+  }
+  if (result) {
+    result->success = success;
+    result->consumed = stop;
+  }
+
+  state_destroy(&redo);
+  parse_free(st.segments);
+  for (size_t i = 0; i < n; i += 1) {
+    state_destroy(&spec.chunks[i].state);
+    parse_free(spec.chunks[i].records);
+  }
+  parse_free(spec.chunks);
+  parse_free(spec.bounds);
+  return success;
+}
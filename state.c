@@ -3,12 +3,34 @@
 #include <stdlib.h>
 #include <stdint.h>
 
+#include "alloc.h"
+#include "lexer.h"
 #include "state.h"
 
+/**
+ * Grow a buffer to hold at least need elements of the given size, doubling so
+ * that repeated appends are amortised constant time.
+ */
+static void *
+buffer_grow(void *buf, size_t *cap, size_t need, size_t size)
+{
+  if (need <= *cap) {
+    return buf;
+  }
+  size_t new_cap = *cap ? *cap : 16;
+  while (new_cap < need) {
+    new_cap *= 2;
+  }
+  *cap = new_cap;
+  return parse_realloc(buf, new_cap * size);
+}
+
 bool
 state_getc(struct parse_state *state, char *c)
 {
+  state_examine(state);
   if (state->pos >= state->input_len) {
+    state->starved |= state->partial;
     return false;
   }
   if (c) {
@@ -19,59 +41,116 @@ state_getc(struct parse_state *state, char *c)
 
 void
 state_create(struct parse_state *state, const char *input)
+{
+  state_create_len(state, input, strlen(input));
+}
+
+void
+state_create_len(struct parse_state *state, const char *input, size_t len)
 {
   memset(state, 0, sizeof(struct parse_state));
   state->input = input;
-  state->input_len = strlen(input);
+  state->input_len = len;
   state->pos = 0;
 }
 
+void
+state_reset(struct parse_state *state, const char *input, size_t len)
+{
+  state->input = input;
+  state->input_len = len;
+  state->pos = 0;
+  state->starved = false;
+  state->handlers_failed = false;
+  state->cuts = 0;
+  state->committed = 0;
+  state->output_committed = 0;
+  state->profiling = NULL;
+  state->backtracks = 0;
+  state->commits = 0;
+  state->examined = 0;
+  state->num_outputs = 0;
+  state->strings_len = 0;
+  state_output_truncate(state, 0);
+}
+
 void
 state_copy(struct parse_state *dest, struct parse_state *src)
 {
+  memset(dest, 0, sizeof(struct parse_state));
   dest->input = src->input;
   dest->input_len = src->input_len;
   dest->pos = src->pos;
-  dest->num_outputs = src->num_outputs;
   if (src->output) {
-    dest->output = malloc(strlen(src->output) + 1);
-    strcpy(dest->output, src->output);
-  } else {
-    dest->output = NULL;
-  }
-  dest->strings = malloc(src->num_outputs * sizeof(char *));
-  for (size_t i = 0; i < src->num_outputs; i += 1) {
-    if (src->strings[i]) {
-      dest->strings[i] = malloc(strlen(src->strings[i]) + 1);
-      strcpy(dest->strings[i], src->strings[i]);
-    } else {
-      dest->strings[i] = NULL;
-    }
+    state_output_append_n(dest, src->output, src->output_len);
+  }
+  dest->num_outputs = src->num_outputs;
+  dest->handlers = buffer_grow(NULL, &dest->handlers_cap, src->num_outputs,
+                               sizeof(struct parse_handler));
+  if (src->num_outputs) {
+    memcpy(dest->handlers, src->handlers,
+           src->num_outputs * sizeof(struct parse_handler));
+  }
+  dest->strings_len = src->strings_len;
+  dest->strings = buffer_grow(NULL, &dest->strings_cap, src->strings_len, 1);
+  if (src->strings_len) {
+    memcpy(dest->strings, src->strings, src->strings_len);
   }
-  dest->args = malloc(src->num_outputs * sizeof(void *));
-  memcpy(dest->args, src->args, src->num_outputs * sizeof(void *));
-  dest->handlers = malloc(src->num_outputs * sizeof(bool (*)(char *, void *)));
-  memcpy(dest->handlers, src->handlers, src->num_outputs * sizeof(bool (*)(char *, void *)));
 }
 
 void
-state_destroy(struct parse_state *target)
+state_append_handlers(
+    struct parse_state *state,
+    const struct parse_handler *handlers,
+    size_t n,
+    const char *strings,
+    size_t strings_len)
 {
-  free(target->output);
-  for (size_t i = 0; i < target->num_outputs; i += 1) {
-    free(target->strings[i]);
+  if (n == 0) {
+    return;
   }
-  free(target->handlers);
-  free(target->strings);
-  free(target->args);
+  size_t base = state->strings_len;
+  state->strings = buffer_grow(state->strings, &state->strings_cap,
+                               base + strings_len, 1);
+  memcpy(state->strings + base, strings, strings_len);
+  state->strings_len += strings_len;
+
+  state->handlers = buffer_grow(state->handlers, &state->handlers_cap,
+                                state->num_outputs + n,
+                                sizeof(struct parse_handler));
+  for (size_t i = 0; i < n; i += 1) {
+    struct parse_handler *h = &state->handlers[state->num_outputs++];
+    *h = handlers[i];
+    h->string += base;
+  }
+}
+
+void
+state_destroy(struct parse_state *target)
+{
+  parse_free(target->output);
+  parse_free(target->handlers);
+  parse_free(target->strings);
 }
 
 bool
 state_execute(struct parse_state *state)
+{
+  if (!state->handlers_failed) {
+    state->handlers_failed = !state_execute_range(state, 0, state->num_outputs);
+  }
+  state->num_outputs = 0;
+  state->strings_len = 0;
+  return !state->handlers_failed;
+}
+
+bool
+state_execute_range(struct parse_state *state, size_t from, size_t to)
 {
   bool success = true;
-  for (size_t i = 0; i < state->num_outputs; i += 1) {
-    success = success && (*state->handlers[i])(state->strings[i], state->args[i]);
+  for (size_t i = from; i < to; i += 1) {
+    struct parse_handler *h = &state->handlers[i];
+    success = success && (*h->handler)(state->strings + h->string, h->arg);
   }
   return success;
 }
@@ -79,7 +158,47 @@ state_execute(struct parse_state *state)
 bool
 state_finished(struct parse_state *state)
 {
-  return state->pos == state->input_len;
+  state_examine(state);
+  if (state->pos == state->input_len) {
+    state->starved |= state->partial;
+    return true;
+  }
+  return false;
+}
+
+void
+state_commit(struct parse_state *state)
+{
+  state_execute(state);
+  state->commits += 1;
+  state->committed = state->pos;
+  if (state->capture_depth == 0) {
+    state->output_committed = state->output_len;
+  }
+}
+
+void
+state_checkpoint(struct parse_state *state, struct parse_checkpoint *cp)
+{
+  cp->pos = state->pos;
+  cp->output_len = state->output_len;
+  cp->num_outputs = state->num_outputs;
+  cp->strings_len = state->strings_len;
+}
+
+void
+state_restore(struct parse_state *state, const struct parse_checkpoint *cp)
+{
+#ifdef PARSER_PROFILE
+  if (state->profiling && cp->pos < state->pos) {
+    state->profiling->rewinds += 1;
+  }
+#endif
+  state->backtracks += cp->pos < state->pos;
+  state->pos = cp->pos;
+  state->num_outputs = cp->num_outputs;
+  state->strings_len = cp->strings_len;
+  state_output_truncate(state, cp->output_len);
 }
 
 /**
@@ -110,70 +229,71 @@ state_rewind_n(struct parse_state *state, size_t n)
   return false;
 }
 
-/**
- * Allocates a free-able output string to the address given. No-op if o is NULL.
- */
-bool
-output_string_create(char **o)
+void
+state_output_reserve(struct parse_state *state, size_t n)
 {
-  if (o == NULL) {
-    return false;
-  } else if (*o == NULL) {
-    *o = malloc(1);
-    **o = '\0';
-  }
-  return true;
+  state->output = buffer_grow(state->output, &state->output_cap,
+                              state->output_len + n + 1, 1);
 }
 
-bool
-output_string_append_char(char **o, char c)
+void
+state_output_truncate(struct parse_state *state, size_t len)
 {
-  if (o == NULL) {
-    return false;
-  } else {
-    char buffer[] = {c, '\0'};
-    *o = realloc(*o, strlen(*o) + 2);
-    strcat(*o, buffer);
-    return true;
+  state->output_len = len;
+  if (state->output) {
+    state->output[len] = '\0';
   }
 }
 
 bool
-output_string_append_str(char **o, char *s)
+state_success(struct parse_state *state, char c)
 {
-  if (o == NULL || s == NULL) {
-    return false;
-  } else {
-    *o = realloc(*o, strlen(*o) + strlen(s) + 1);
-    strcat(*o, s);
-    return true;
-  }
+  state_output_reserve(state, 1);
+  state->output[state->output_len++] = c;
+  state->output[state->output_len] = '\0';
+  state->pos += 1;
+  return true;
 }
 
 bool
-state_success(struct parse_state *state, char c)
+state_success_blank(struct parse_state *state)
 {
   if (state->output == NULL) {
-    output_string_create(&state->output);
+    state_output_reserve(state, 0);
+    state->output[0] = '\0';
   }
-  output_string_append_char(&state->output, c);
-  state->pos += 1;
   return true;
 }
 
 bool
-state_success_blank(struct parse_state *state)
+state_success_token(struct parse_state *state)
 {
-  if (state->output == NULL) {
-    output_string_create(&state->output);
+  if (state->tokens == NULL) {
+    return state_success(state, state->input[state->pos]);
   }
+  const struct parse_token *t = &state->tokens->tokens[state->pos];
+  state_output_append_n(state, state->tokens->text + t->offset, t->len);
+  state->pos += 1;
   return true;
 }
 
 bool
 state_output_append_str(struct parse_state *state, char *str)
 {
-  return output_string_append_str(&state->output, str);
+  if (str == NULL) {
+    return false;
+  }
+  return state_output_append_n(state, str, strlen(str));
+}
+
+bool
+state_output_append_n(struct parse_state *state, const char *str, size_t n)
+{
+  state_output_reserve(state, n);
+  memcpy(state->output + state->output_len, str, n);
+  state->output_len += n;
+  state->output[state->output_len] = '\0';
+  return true;
 }
 
 bool
@@ -183,16 +303,50 @@ state_add_handler(
     char *string,
     void *arg)
 {
-  state->num_outputs += 1;
+  return state_add_handler_n(state, handler, string, strlen(string), arg);
+}
+
+bool
+state_add_handler_n(
+    struct parse_state *state,
+    bool (*handler)(char *, void *),
+    const char *string,
+    size_t n,
+    void *arg)
+{
+  bool eager = state->eager && state->backtrack_depth == 0;
+  if (eager) {
+    state_execute(state);
+  }
+
+  state->strings = buffer_grow(state->strings, &state->strings_cap,
+                               state->strings_len + n + 1, 1);
+  if (eager) {
+    memcpy(state->strings, string, n);
+    state->strings[n] = '\0';
+    if (!state->handlers_failed) {
+      state->handlers_failed = !(*handler)(state->strings, arg);
+    }
+    return true;
+  }
 
-  state->strings = realloc(state->strings, (state->num_outputs) * sizeof(char *) );
-  state->strings[state->num_outputs - 1] = malloc(strlen(string) + 1);
-  strcpy(state->strings[state->num_outputs - 1], string);
+  state->handlers = buffer_grow(state->handlers, &state->handlers_cap,
+                                state->num_outputs + 1,
+                                sizeof(struct parse_handler));
 
-  state->args = realloc(state->args, (state->num_outputs) * sizeof(void *));
-  state->args[state->num_outputs - 1] = arg;
+  struct parse_handler *h = &state->handlers[state->num_outputs++];
+  h->handler = handler;
+  h->arg = arg;
+  h->string = state->strings_len;
 
-  state->handlers = realloc(state->handlers, (state->num_outputs) * sizeof(bool (*)(char *, void *)));
-  state->handlers[state->num_outputs - 1] = handler;
+  memcpy(state->strings + state->strings_len, string, n);
+  state->strings[state->strings_len + n] = '\0';
+  state->strings_len += n + 1;
   return true;
 }
+
+char *
+state_handler_string(struct parse_state *state, size_t i)
+{
+  return state->strings + state->handlers[i].string;
+}
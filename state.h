@@ -4,29 +4,152 @@
 #include <stdlib.h>
 #include <stdint.h>
 
+#include "profile.h"
+
+struct parse_document;
+struct parse_tokens;
+
+/**
+ * A single deferred exe() handler. The matched string lives in the state's
+ * string buffer at offset string so that the buffer can grow without
+ * invalidating entries.
+ */
+struct parse_handler {
+  bool (*handler)(char *, void *);
+  void *arg;
+  size_t string;
+};
+
+/**
+ * Everything needed to undo the effects of a parser: input position, output
+ * length and handler log length. Taking and restoring a checkpoint never
+ * allocates.
+ */
+struct parse_checkpoint {
+  size_t pos;
+  size_t output_len;
+  size_t num_outputs;
+  size_t strings_len;
+};
+
+/**
+ * All buffers in the state keep their capacity across state_reset, so a state
+ * that is reused between runs stops allocating once it has seen its largest
+ * input.
+ */
 struct parse_state {
   const char *input;
   size_t input_len;
   size_t pos;
   char *output;
+  size_t output_len;
+  size_t output_cap;
   size_t num_outputs;
-  bool (**handlers)(char *, void *);
-  char **strings;
-  void **args;
+  size_t handlers_cap;
+  struct parse_handler *handlers;
+  char *strings;
+  size_t strings_len;
+  size_t strings_cap;
+  /* The input may continue past input_len (see parser_session_feed) */
+  bool partial;
+  /* Set when a partial input was read up to its end */
+  bool starved;
+  /* try() and until() nodes that may still rewind */
+  size_t backtrack_depth;
+  /* exe() nodes whose match is still being captured */
+  size_t capture_depth;
+  /* cut() nodes seen inside the innermost try() */
+  size_t cuts;
+  /* Input before committed and output before output_committed can never be
+   * read again */
+  size_t committed;
+  size_t output_committed;
+  /* Call handlers as soon as nothing can roll them back */
+  bool eager;
+  /* A handler has returned false; no further handlers are called */
+  bool handlers_failed;
+  /* Number of times state_restore moved pos back */
+  size_t backtracks;
+  /* Number of times handlers were run before the end of the run */
+  size_t commits;
+  /* One past the furthest input position looked at, where looking at the end
+   * of the input counts as position input_len */
+  size_t examined;
+  /* Attached document whose memo() entries are reused; see document.h */
+  struct parse_document *document;
+  /* Tokens whose kinds are the input, when parsing tokens; see lexer.h */
+  const struct parse_tokens *tokens;
+  /* Attached profile and the counters of the node currently running; only
+   * used in builds with PARSER_PROFILE */
+  struct parse_profile *profile;
+  struct parse_node_stats *profiling;
+  /* Attached trace; only used in builds with PARSER_PROFILE */
+  struct parse_trace *trace;
 };
 
 bool state_getc(struct parse_state *state, char *c);
 
+/**
+ * Note that the byte at the current position, or the end of the input, has
+ * been looked at. state_getc and state_finished do this themselves.
+ */
+static inline void
+state_examine(struct parse_state *state)
+{
+  if (state->pos >= state->examined) {
+    state->examined = state->pos + 1;
+  }
+}
+
 void state_create(struct parse_state *state, const char *input);
 
+void state_create_len(struct parse_state *state, const char *input, size_t len);
+
+/**
+ * Point an existing state at new input, discarding output and handlers but
+ * keeping every buffer's capacity.
+ */
+void state_reset(struct parse_state *state, const char *input, size_t len);
+
 void state_copy(struct parse_state *dest, struct parse_state *src);
 
+/**
+ * Append n handlers to the handler log, as if they had just been matched.
+ * Their string offsets are into strings, which holds strings_len bytes.
+ */
+void state_append_handlers(
+    struct parse_state *state,
+    const struct parse_handler *handlers,
+    size_t n,
+    const char *strings,
+    size_t strings_len);
+
 void state_destroy(struct parse_state *target);
 
+/**
+ * Run every pending handler and empty the log. Once a handler returns false
+ * no further handler is called for the rest of the run.
+ */
 bool state_execute(struct parse_state *state);
 
+/**
+ * Run the handlers with indices in [from, to) in order.
+ */
+bool state_execute_range(struct parse_state *state, size_t from, size_t to);
+
 bool state_finished(struct parse_state *state);
 
+/**
+ * Declare that nothing before the current position will be rewound: run and
+ * drop the pending handlers and move the commit marks up to the current
+ * position. Only valid when backtrack_depth is zero.
+ */
+void state_commit(struct parse_state *state);
+
+void state_checkpoint(struct parse_state *state, struct parse_checkpoint *cp);
+
+void state_restore(struct parse_state *state, const struct parse_checkpoint *cp);
+
 /**
  * Undo the action of reading a single character. Always returns false for
  * convenience.
@@ -43,6 +166,33 @@ bool state_success(struct parse_state *state, char c);
 
 bool state_success_blank(struct parse_state *state);
 
+/**
+ * Consume the token at the current position and add its text to the output.
+ * On input that is not a token array the byte itself is added instead.
+ */
+bool state_success_token(struct parse_state *state);
+
+/**
+ * Make room for at least n more output characters (plus the terminator).
+ */
+void state_output_reserve(struct parse_state *state, size_t n);
+
+void state_output_truncate(struct parse_state *state, size_t len);
+
 bool state_output_append_str(struct parse_state *state, char *str);
 
+bool state_output_append_n(struct parse_state *state, const char *str, size_t n);
+
 bool state_add_handler(struct parse_state *state, bool (*handler)(char *, void *), char *string, void *arg);
+
+/**
+ * Record a matched exe(). With state->eager set and no try() or until() that
+ * could still roll it back, the pending log is flushed and the handler is
+ * called right away instead, so its string is never stored.
+ */
+bool state_add_handler_n(struct parse_state *state, bool (*handler)(char *, void *), const char *string, size_t n, void *arg);
+
+/**
+ * The matched string recorded for the i'th handler.
+ */
+char *state_handler_string(struct parse_state *state, size_t i);
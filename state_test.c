@@ -2,11 +2,74 @@
 #include <stdbool.h>
 #include <stdlib.h>
 
+#include "assert.h"
+#include "error.h"
 #include "test.h"
 #include "log.h"
 #include "state.h"
 
+static bool
+noop_handler(char *s, void *arg)
+{
+  (void)s;
+  (void)arg;
+  return true;
+}
+
 new_test(create_state)
 {
   return NULL;
 }
+
+new_test(state_restore_undoes_output_and_handlers)
+{
+  struct parse_state state;
+  struct parse_checkpoint cp;
+  state_create(&state, "abc");
+  state_success(&state, 'a');
+  state_checkpoint(&state, &cp);
+  state_success(&state, 'b');
+  state_add_handler(&state, noop_handler, "b", NULL);
+  state_restore(&state, &cp);
+
+  error_try(assert_unsigned_equal(1, state.pos));
+  error_try(assert_string_equal("a", state.output));
+  error_try(assert_unsigned_equal(0, state.num_outputs));
+  state_destroy(&state);
+  return NULL;
+}
+
+new_test(state_reset_keeps_capacity)
+{
+  struct parse_state state;
+  state_create(&state, "abc");
+  state_success(&state, 'a');
+  state_add_handler(&state, noop_handler, "a", NULL);
+  char *output = state.output;
+  size_t output_cap = state.output_cap;
+  struct parse_handler *handlers = state.handlers;
+
+  state_reset(&state, "xyz", 3);
+  error_try(assert_unsigned_equal(0, state.pos));
+  error_try(assert_string_equal("", state.output));
+  error_try(assert_unsigned_equal(0, state.num_outputs));
+  error_try(assert(output == state.output));
+  error_try(assert(handlers == state.handlers));
+  error_try(assert_unsigned_equal(output_cap, state.output_cap));
+  state_destroy(&state);
+  return NULL;
+}
+
+new_test(state_handler_strings_survive_growth)
+{
+  struct parse_state state;
+  state_create(&state, "");
+  state_add_handler(&state, noop_handler, "first", NULL);
+  for (int i = 0; i < 100; i += 1) {
+    state_add_handler(&state, noop_handler, "padding", NULL);
+  }
+  error_try(assert_string_equal("first", state_handler_string(&state, 0)));
+  error_try(assert_string_equal("padding", state_handler_string(&state, 100)));
+  state_destroy(&state);
+  return NULL;
+}
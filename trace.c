@@ -0,0 +1,231 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "parser/parser_internal.h"
+#include "context.h"
+#include "parse.h"
+#include "profile.h"
+#include "state.h"
+
+/**
+ * A trace is a flat array of events in the order they happened. Both writers
+ * replay it with a stack of open nodes; the folded writer first merges the
+ * events into a call tree keyed by node, so that every distinct path is
+ * written once however often it ran.
+ */
+
+struct trace_event {
+  const struct parser *p;
+  size_t pos;
+  uint64_t ns;
+  enum trace_event_type type;
+};
+
+struct parse_trace {
+  struct trace_event *events;
+  size_t len;
+  size_t cap;
+};
+
+struct parse_trace *
+parse_trace_new()
+{
+  struct parse_trace *trace = parse_malloc(sizeof(struct parse_trace));
+  trace->len = 0;
+  trace->cap = 256;
+  trace->events = parse_malloc(trace->cap * sizeof(struct trace_event));
+  return trace;
+}
+
+void
+parse_trace_free(struct parse_trace *trace)
+{
+  parse_free(trace->events);
+  parse_free(trace);
+}
+
+void
+parse_trace_clear(struct parse_trace *trace)
+{
+  trace->len = 0;
+}
+
+size_t
+parse_trace_len(const struct parse_trace *trace)
+{
+  return trace->len;
+}
+
+void
+parse_context_set_trace(struct parse_context *ctx, struct parse_trace *trace)
+{
+  ctx->state.trace = trace;
+}
+
+void
+trace_event(
+    struct parse_trace *trace,
+    const struct parser *p,
+    size_t pos,
+    enum trace_event_type type)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  if (trace->len == trace->cap) {
+    trace->cap *= 2;
+    trace->events = parse_realloc(trace->events,
+                                  trace->cap * sizeof(struct trace_event));
+  }
+  trace->events[trace->len++] = (struct trace_event){
+    p, pos, (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec, type,
+  };
+}
+
+/**
+ * A node of the call tree. Node 0 is a root standing for no node at all;
+ * children are kept in a list in the order they first ran.
+ */
+struct call {
+  const struct parser *p;
+  size_t first_child;
+  size_t last_child;
+  size_t next_sibling;
+  uint64_t self;
+};
+
+struct open_call {
+  size_t call;
+  uint64_t start;
+  uint64_t children;
+};
+
+static size_t
+call_child(struct call **calls, size_t *len, size_t *cap, size_t parent,
+           const struct parser *p)
+{
+  for (size_t i = (*calls)[parent].first_child; i != 0;
+       i = (*calls)[i].next_sibling) {
+    if ((*calls)[i].p == p) {
+      return i;
+    }
+  }
+  if (*len == *cap) {
+    *cap *= 2;
+    *calls = parse_realloc(*calls, *cap * sizeof(struct call));
+  }
+  size_t i = (*len)++;
+  (*calls)[i] = (struct call){p, 0, 0, 0, 0};
+  if ((*calls)[parent].first_child == 0) {
+    (*calls)[parent].first_child = i;
+  } else {
+    (*calls)[(*calls)[parent].last_child].next_sibling = i;
+  }
+  (*calls)[parent].last_child = i;
+  return i;
+}
+
+static void
+write_folded_label(const struct parser *p, FILE *out)
+{
+  char label[64];
+  parser_describe(p, label, sizeof(label));
+  for (char *c = label; *c; c += 1) {
+    fputc(*c == ';' ? ',' : *c, out);
+  }
+}
+
+bool
+parse_trace_write_folded(const struct parse_trace *trace, FILE *out)
+{
+  size_t len = 1, cap = 64, depth = 1, stack_cap = 64;
+  struct call *calls = parse_malloc(cap * sizeof(struct call));
+  struct open_call *stack = parse_malloc(stack_cap * sizeof(struct open_call));
+  calls[0] = (struct call){NULL, 0, 0, 0, 0};
+  stack[0] = (struct open_call){0, 0, 0};
+
+  for (size_t i = 0; i < trace->len; i += 1) {
+    const struct trace_event *event = &trace->events[i];
+    if (event->type == TRACE_ENTER) {
+      if (depth == stack_cap) {
+        stack_cap *= 2;
+        stack = parse_realloc(stack, stack_cap * sizeof(struct open_call));
+      }
+      size_t call = call_child(&calls, &len, &cap, stack[depth - 1].call,
+                               event->p);
+      stack[depth++] = (struct open_call){call, event->ns, 0};
+    } else if (depth > 1) {
+      struct open_call *top = &stack[--depth];
+      uint64_t total = event->ns - top->start;
+      calls[top->call].self += total - top->children;
+      stack[depth - 1].children += total;
+    }
+  }
+
+  // Depth-first over the tree, keeping the path from the root in stack.
+  size_t next = calls[0].first_child;
+  depth = 0;
+  while (next != 0) {
+    stack[depth++].call = next;
+    for (size_t k = 0; k < depth; k += 1) {
+      if (k > 0) {
+        fputc(';', out);
+      }
+      write_folded_label(calls[stack[k].call].p, out);
+    }
+    fprintf(out, " %llu\n", (unsigned long long)calls[next].self);
+
+    next = calls[next].first_child;
+    while (next == 0 && depth > 0) {
+      next = calls[stack[--depth].call].next_sibling;
+    }
+  }
+
+  parse_free(stack);
+  parse_free(calls);
+  return !ferror(out);
+}
+
+static void
+write_json_string(const char *s, FILE *out)
+{
+  fputc('"', out);
+  for (; *s; s += 1) {
+    unsigned char c = *s;
+    if (c == '"' || c == '\\') {
+      fprintf(out, "\\%c", c);
+    } else if (c < 0x20) {
+      fprintf(out, "\\u%04x", c);
+    } else {
+      fputc(c, out);
+    }
+  }
+  fputc('"', out);
+}
+
+bool
+parse_trace_write_chrome(const struct parse_trace *trace, FILE *out)
+{
+  uint64_t origin = trace->len ? trace->events[0].ns : 0;
+  fprintf(out, "{\"traceEvents\":[");
+  for (size_t i = 0; i < trace->len; i += 1) {
+    const struct trace_event *event = &trace->events[i];
+    char label[64];
+    parser_describe(event->p, label, sizeof(label));
+    fprintf(out, "%s\n{\"name\":", i ? "," : "");
+    write_json_string(label, out);
+    fprintf(out, ",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":1,\"tid\":1,"
+            "\"args\":{\"pos\":%zu",
+            event->type == TRACE_ENTER ? "B" : "E",
+            (event->ns - origin) / 1e3, event->pos);
+    if (event->type != TRACE_ENTER) {
+      fprintf(out, ",\"matched\":%s",
+              event->type == TRACE_MATCH ? "true" : "false");
+    }
+    fprintf(out, "}}");
+  }
+  fprintf(out, "\n],\"displayTimeUnit\":\"ns\"}\n");
+  return !ferror(out);
+}